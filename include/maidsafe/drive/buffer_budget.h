@@ -0,0 +1,69 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_BUFFER_BUDGET_H_
+#define MAIDSAFE_DRIVE_BUFFER_BUDGET_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "maidsafe/common/types.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+// Shares a drive-wide memory budget between the buffers of open files.  Each new buffer is offered
+// an equal share of the budget (limited to 'max_per_buffer'), but never less than 'min_per_buffer'
+// unless the budget is exhausted.  Shares are fixed for the lifetime of a buffer; the buffer itself
+// spills to disk anything beyond its share.
+class BufferBudget {
+ public:
+  BufferBudget(MemoryUsage total, MemoryUsage min_per_buffer, MemoryUsage max_per_buffer);
+
+  // Reserves memory for a new buffer.  If less than the buffer's fair share is free, waits up to
+  // 'timeout' for other buffers to be released, then settles for whatever is free (possibly none).
+  MemoryUsage Reserve(std::chrono::steady_clock::duration timeout);
+  void Release(MemoryUsage reserved);
+
+  MemoryUsage available() const;
+  uint32_t buffer_count() const;
+
+ private:
+  BufferBudget(const BufferBudget&);
+  BufferBudget(BufferBudget&&);
+  BufferBudget& operator=(BufferBudget);
+
+  const uint64_t kTotal_, kMinPerBuffer_, kMaxPerBuffer_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_var_;
+  uint64_t available_;
+  uint32_t buffer_count_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_BUFFER_BUDGET_H_
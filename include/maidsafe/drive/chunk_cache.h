@@ -0,0 +1,92 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_CHUNK_CACHE_H_
+#define MAIDSAFE_DRIVE_CHUNK_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/common/types.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+// A least-recently-used cache of chunks retrieved from storage, shared by all files and directories
+// of a drive.  Chunks evicted from memory are moved to disk; chunks evicted from disk are dropped.
+// Since a chunk's name is the hash of its content, chunks read back from disk are validated against
+// their names and discarded if corrupt.
+class ChunkCache {
+ public:
+  ChunkCache(MemoryUsage max_memory_usage, DiskUsage max_disk_usage,
+             const boost::filesystem::path& disk_path);
+  ~ChunkCache();
+
+  // Returns true and sets 'content' if the chunk is cached.
+  bool Get(const std::string& name, NonEmptyString& content);
+  void Put(const std::string& name, const NonEmptyString& content);
+
+  uint64_t memory_hit_count() const;
+  uint64_t disk_hit_count() const;
+  uint64_t miss_count() const;
+
+ private:
+  ChunkCache(const ChunkCache&);
+  ChunkCache(ChunkCache&&);
+  ChunkCache& operator=(ChunkCache);
+
+  typedef std::list<std::pair<std::string, NonEmptyString>> MemoryChunks;
+  typedef std::list<std::pair<std::string, uint64_t>> DiskChunks;  // name and size
+
+  boost::filesystem::path ChunkPath(const std::string& name) const;
+  // Must be called with 'mutex_' locked.  Returns the chunks evicted from memory.
+  std::vector<std::pair<std::string, NonEmptyString>> PutInMemory(const std::string& name,
+                                                                  const NonEmptyString& content);
+  // Must be called without 'mutex_' locked.
+  void PutOnDisk(const std::vector<std::pair<std::string, NonEmptyString>>& chunks);
+
+  const MemoryUsage kMaxMemoryUsage_;
+  const DiskUsage kMaxDiskUsage_;
+  const boost::filesystem::path kDiskPath_;
+  mutable std::mutex mutex_;
+  MemoryChunks memory_chunks_;  // most recently used last
+  std::map<std::string, MemoryChunks::iterator> memory_index_;
+  uint64_t memory_usage_;
+  DiskChunks disk_chunks_;  // most recently used last
+  std::map<std::string, DiskChunks::iterator> disk_index_;
+  uint64_t disk_usage_;
+  uint64_t memory_hit_count_, disk_hit_count_, miss_count_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_CHUNK_CACHE_H_
@@ -0,0 +1,97 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_CHUNK_PREFETCHER_H_
+#define MAIDSAFE_DRIVE_CHUNK_PREFETCHER_H_
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "boost/thread/future.hpp"
+
+#include "maidsafe/common/types.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+#include "maidsafe/encrypt/data_map.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+// The read history of an open file, used to detect sequential access.  Protected by the file's
+// mutex.
+struct ReadPattern {
+  ReadPattern() : next_offset(0), sequential_count(0), prefetched_until(0) {}
+  uint64_t next_offset;
+  uint32_t sequential_count;
+  // Index of the first chunk of the data map not yet requested by the prefetcher.
+  size_t prefetched_until;
+};
+
+// Fetches chunks of sequentially-read files from storage ahead of the encryptors needing them.
+// Fetched chunks are held until retrieved via 'Get' (at which point the encryptor takes ownership)
+// or until evicted by newer prefetches.
+class ChunkPrefetcher {
+ public:
+  typedef std::function<boost::future<ImmutableData>(const ImmutableData::Name&)> GetFunctor;
+
+  ChunkPrefetcher(GetFunctor get_functor, uint32_t max_chunks);
+
+  // Returns the chunk, waiting for an outstanding prefetch if there is one, otherwise fetching it.
+  NonEmptyString Get(const std::string& name);
+  // Should be called before a read of an open file.  If the range spans several chunks, requests
+  // them all at once (including one the read starts part-way into) so that they're retrieved
+  // concurrently rather than one after another as the encryptor reaches them.
+  void FetchRange(const encrypt::DataMap& data_map, uint64_t offset, uint32_t size);
+  // Should be called after each read of an open file.  If the reads are sequential, requests the
+  // chunks of 'data_map' following the range just read.
+  void NotifyRead(const encrypt::DataMap& data_map, uint64_t offset, uint32_t size,
+                  ReadPattern& read_pattern);
+
+  uint64_t hit_count() const;
+  uint64_t request_count() const;
+
+ private:
+  ChunkPrefetcher(const ChunkPrefetcher&);
+  ChunkPrefetcher(ChunkPrefetcher&&);
+  ChunkPrefetcher& operator=(ChunkPrefetcher);
+
+  void Prefetch(const std::string& name);
+
+  typedef std::list<std::pair<std::string, boost::shared_future<ImmutableData>>> Chunks;
+  GetFunctor get_functor_;
+  const uint32_t kMaxChunks_;
+  mutable std::mutex mutex_;
+  Chunks chunks_;  // oldest request first
+  std::map<std::string, Chunks::iterator> index_;
+  uint64_t hit_count_, request_count_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_CHUNK_PREFETCHER_H_
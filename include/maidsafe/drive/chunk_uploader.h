@@ -0,0 +1,93 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_CHUNK_UPLOADER_H_
+#define MAIDSAFE_DRIVE_CHUNK_UPLOADER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "maidsafe/common/asio_service.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+// Stores chunks in the background so that flushing a file's encryptor only has to wait for its
+// chunks to be queued rather than stored.  At most 'max_in_flight' chunks are being stored at any
+// time and at most 'max_queued' are held in total; 'Put' blocks while the queue is full, so it
+// mustn't be called while holding a directory's mutex.
+class ChunkUploader {
+ public:
+  typedef std::function<void(const ImmutableData&)> PutFunctor;
+
+  ChunkUploader(PutFunctor put_functor, uint32_t max_in_flight, uint32_t max_queued);
+  // Waits for all queued chunks to be stored.
+  ~ChunkUploader();
+
+  // Each chunk is put on behalf of a batch (e.g. the directory whose listing will refer to it), so
+  // that its failure is reported to that batch alone.
+  void Put(const ImmutableData& chunk, const std::string& batch = std::string());
+  // Re-queues the chunks of 'batch' which have failed to be stored, then blocks until every chunk
+  // queued before this call has been stored.  Returns false if any chunk of 'batch' queued before
+  // this call has failed to be stored.  Failed chunks are kept, and the batch keeps failing, until
+  // a later call stores them or they're dropped by 'DropFailed'.
+  bool WaitForQueued(const std::string& batch = std::string());
+  // Discards the failed chunks of 'batch', e.g. once nothing will refer to them.
+  void DropFailed(const std::string& batch);
+
+  // The number of chunks currently queued or being stored, and the most there have been at once.
+  uint32_t queue_depth() const;
+  uint32_t max_queue_depth() const;
+  uint64_t failure_count() const;
+
+ private:
+  ChunkUploader(const ChunkUploader&);
+  ChunkUploader(ChunkUploader&&);
+  ChunkUploader& operator=(ChunkUploader);
+
+  void Store(const ImmutableData& chunk, uint64_t ticket, const std::string& batch);
+
+  PutFunctor put_functor_;
+  const uint32_t kMaxQueued_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_var_;
+  std::set<uint64_t> outstanding_;  // tickets of queued and in-flight chunks
+  // Batches and contents of failed chunks, keyed by ticket, until they're re-queued.
+  std::map<uint64_t, std::pair<std::string, ImmutableData>> failed_;
+  uint32_t max_queue_depth_;
+  uint64_t next_ticket_, failure_count_;
+  AsioService asio_service_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_CHUNK_UPLOADER_H_
@@ -46,10 +46,66 @@ namespace detail {
 
 extern const boost::filesystem::path kRoot;
 extern const MaxVersions kMaxVersions;
-// The delay between the last update to a directory and the creation of the corresponding version.
+// The delay between the last update to a directory and the creation of the corresponding version
+// when updates are infrequent.
 extern const std::chrono::steady_clock::duration kDirectoryInactivityDelay;
+// The shortest pause in changes to a directory which is waited for before storing it, used when
+// changes are frequent, and the longest a changed directory goes unstored while changes continue.
+extern const std::chrono::steady_clock::duration kMinDirectoryInactivityDelay;
+extern const std::chrono::steady_clock::duration kMaxDirectoryStaleness;
 // The delay between the last close on a file and the deletion of its buffer and encryptor.
 extern const std::chrono::steady_clock::duration kFileInactivityDelay;
+// The interval between checks for newer versions of cached directories stored by other clients,
+// and how recently a cached directory must have been used to be included in a check.
+extern const std::chrono::steady_clock::duration kRemoteChangesCheckInterval;
+extern const std::chrono::steady_clock::duration kRemoteChangesMaxIdleTime;
+// The interval between checks for directories whose children have been written to.
+extern const std::chrono::steady_clock::duration kDirtyDirectoriesSweepInterval;
+// Default FUSE transfer limits requested when mounting.  libfuse 2.x clamps max_write to its
+// channel buffer size (128 KiB), so larger values are accepted but have no further effect on
+// writes.
+extern const uint32_t kDefaultMaxWrite;
+extern const uint32_t kDefaultMaxReadahead;
+extern const uint32_t kDefaultMaxBackground;
+// Default times (in seconds) for which the kernel may cache attributes, name lookups and failed
+// name lookups respectively.  Changes made through the mount are always visible immediately; these
+// only bound how long remote changes can go unnoticed.
+extern const double kDefaultAttributeTimeout;
+extern const double kDefaultEntryTimeout;
+extern const double kDefaultNegativeTimeout;
+// Once this many consecutive reads of an open file have been sequential, the next
+// 'kReadAheadChunkCount' chunks are fetched in the background.  At most 'kMaxPrefetchedChunks'
+// fetched-but-unread chunks are held across the whole drive.
+extern const uint32_t kSequentialReadThreshold;
+extern const uint32_t kReadAheadChunkCount;
+extern const uint32_t kMaxPrefetchedChunks;
+// Upper limits on the memory and disk space used by a drive's cache of chunks retrieved from
+// storage.
+extern const MemoryUsage kChunkCacheMemoryUsage;
+extern const DiskUsage kChunkCacheDiskUsage;
+// The memory shared between the buffers of all open files, the least each buffer is given while
+// there is memory to spare, and how long opening a file may wait for memory to be released (the
+// wait is made before the file is locked).
+extern const MemoryUsage kBufferMemoryBudget;
+extern const MemoryUsage kMinBufferMemory;
+extern const std::chrono::steady_clock::duration kBufferBudgetTimeout;
+// The number of chunks of flushed files and directories which may be being stored concurrently,
+// and the number which may be waiting to be stored before further flushes block.
+extern const uint32_t kMaxInFlightChunkPuts;
+extern const uint32_t kMaxQueuedChunkPuts;
+// The number of threads running the timers of open files and the dirty directories sweep, and the
+// least number running directory stores and remote change checks (more are used on machines with
+// more cores).  Timer handlers only post their work to the store threads, so never block.
+extern const uint32_t kTimerThreadCount;
+extern const uint32_t kMinStoreThreadCount;
+// The number of directories held in memory beyond which unused, fully-stored directories are
+// evicted.
+extern const uint32_t kMaxCachedDirectories;
+// The number of directory listings kept in the metadata snapshot beyond which the least recently
+// used are dropped.
+extern const uint32_t kMaxSnapshotDirectories;
+// The most subdirectories of an opened directory loaded in the background.
+extern const uint32_t kMaxPrefetchedDirectories;
 
 }  // namespace detail
 
@@ -0,0 +1,55 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_COPY_RANGE_H_
+#define MAIDSAFE_DRIVE_COPY_RANGE_H_
+
+#ifndef MAIDSAFE_WIN32
+#include <sys/ioctl.h>
+#endif
+
+#include <cstdint>
+
+namespace maidsafe {
+
+namespace drive {
+
+// Request to copy a range of one file on the drive into another without reading and re-encrypting
+// the data.  Issued as an ioctl on the open, writable destination file, e.g.
+//   CopyRangeRequest request = {...};
+//   ioctl(destination_fd, kCopyRangeIoctl, &request);
+// If the whole of the source is copied over the whole of the destination, the destination shares
+// the source's chunks.  Otherwise the range is copied via the drive's read and write paths.  On
+// success, 'size' is set to the number of bytes copied.
+struct CopyRangeRequest {
+  uint64_t source_offset;
+  uint64_t destination_offset;
+  uint64_t size;
+  // Path of the source file relative to the drive's mount point, null-terminated.
+  char source_path[2048];
+};
+
+#ifndef MAIDSAFE_WIN32
+const unsigned long kCopyRangeIoctl = _IOWR('M', 1, CopyRangeRequest);  // NOLINT
+#endif
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_COPY_RANGE_H_
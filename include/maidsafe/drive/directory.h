@@ -19,9 +19,12 @@
 #ifndef MAIDSAFE_DRIVE_DIRECTORY_H_
 #define MAIDSAFE_DRIVE_DIRECTORY_H_
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -55,7 +58,10 @@ class DirectoryTest;
 
 }  // namespace test
 
-class Directory {
+// All public member functions are safe to call concurrently.  'mutex_' protects the set of children
+// and the versioning/storing state.  Per-file state of a child is protected by that child's own
+// mutex, which is only ever acquired after (never before) 'mutex_'.
+class Directory : public std::enable_shared_from_this<Directory> {
  public:
   Directory(ParentId parent_id, DirectoryId directory_id, boost::asio::io_service& io_service,
             std::function<void(Directory*)> put_functor,  // NOLINT
@@ -71,37 +77,95 @@ class Directory {
   ~Directory();
   // This marks the start of an attempt to store the directory.  It serialises the appropriate
   // member data (critically parent_id_ must never be serialised), and sets 'store_state_' to
-  // kOngoing.  It also calls 'FlushChild' on all children (see below).
+  // kOngoing.  It also flushes all open children, queueing their new chunks for storing once
+  // 'mutex_' has been released.
   std::string Serialise();
   // Stores all new chunks from 'child', increments all the other chunks, and resets child's
-  // self_encryptor & buffer.
+  // self_encryptor & buffer.  The new chunks are queued for storing after 'mutex_' is released.
   void FlushChildAndDeleteEncryptor(FileContext* child);
+  // As above, but only if 'child' is still the child called 'name' and isn't open.  For use where
+  // 'child' may have been removed since it was last known to be valid (e.g. a timer's handler).
+  void FlushClosedChild(const boost::filesystem::path& name, const FileContext* child);
+  // As 'FlushChildAndDeleteEncryptor', then invokes 'functor' while still holding the child's mutex
+  // and 'other_mutex' (locked together with it), so that 'functor' sees exactly the flushed
+  // contents even if the child is being written to concurrently.
+  void FlushChildAndApply(FileContext* child, std::mutex& other_mutex,
+                          const std::function<void()>& functor);
 
   size_t VersionsCount() const;
+  // Newest first.
+  std::vector<StructuredDataVersions::VersionName> Versions() const;
+  // These return directory_id and the version to be stored for 'version_id' ('AddNewVersion' also
+  // returns the current version which it follows).  The new version is only added to the
+  // directory's versions by 'StoreSucceeded', so that a failed attempt leaves them as they are in
+  // storage.
   std::tuple<DirectoryId, StructuredDataVersions::VersionName>
       InitialiseVersions(ImmutableData::Name version_id);
-  // This marks the end of an attempt to store the directory.  It returns directory_id and most
-  // recent 2 version names (including the one passed in), and sets 'store_state_' to kComplete.
   std::tuple<DirectoryId, StructuredDataVersions::VersionName, StructuredDataVersions::VersionName>
       AddNewVersion(ImmutableData::Name version_id);
 
+  // Returns true if 'version' is one of the versions of this directory known locally (i.e. it is
+  // not newer than the current listing).
+  bool HasVersion(const StructuredDataVersions::VersionName& version) const;
+  // Replaces the listing with that of 'remote', a more recent version of this directory which has
+  // been retrieved from storage (e.g. stored by another client or via a share), and adopts its
+  // versions.  Existing children are updated in place so that pointers to them remain valid; files
+  // which are open here keep their local state.  Does nothing and returns false if this directory
+  // has local changes waiting to be stored.
+  bool ApplyRemoteVersion(Directory& remote);
+
   bool HasChild(const boost::filesystem::path& name) const;
   const FileContext* GetChild(const boost::filesystem::path& name) const;
   FileContext* GetMutableChild(const boost::filesystem::path& name);
-  const FileContext* GetChildAndIncrementCounter();
-  void AddChild(FileContext&& child);
+  // Invokes 'functor' on the child called 'name' with 'mutex_' and the child's mutex held, so the
+  // child can't be removed meanwhile.  If 'functor' returns true (i.e. it changed the child), the
+  // directory is scheduled for storing.  'functor' must not call back into this directory.
+  void ApplyToChild(const boost::filesystem::path& name,
+                    const std::function<bool(FileContext&)>& functor);
+  // Invokes 'functor' on each child whose name sorts after 'name' (or on all children if 'name' is
+  // empty) in name order, stopping early if 'functor' returns false.  The directory's mutex is held
+  // throughout, so 'functor' must not call back into this directory.
+  void ForEachChildAfter(const boost::filesystem::path& name,
+                         std::function<bool(const FileContext&)> functor) const;
+  // Returns a pointer to the added child.  This remains valid until the child is removed (moving
+  // the child to a different parent via 'TakeChild' and 'AddChild' doesn't invalidate it).
+  FileContext* AddChild(FileContext&& child);
+  FileContext* AddChild(std::unique_ptr<FileContext> child);
   FileContext RemoveChild(const boost::filesystem::path& name);
+  std::unique_ptr<FileContext> TakeChild(const boost::filesystem::path& name);
   void RenameChild(const boost::filesystem::path& old_name,
                    const boost::filesystem::path& new_name);
-  void ResetChildrenCounter();
   bool empty() const;
+  // True if the directory has no unstored changes, no store in progress and no open or buffered
+  // children, i.e. if it could be dropped from memory and reloaded from storage without loss.
+  // Never blocks: if the directory or any child is locked, it's in use and false is returned.
+  bool CanBeEvicted() const;
   ParentId parent_id() const;
   // This will block while a store attempt is ongoing.
   void SetNewParent(const ParentId parent_id, std::function<void(Directory*)> put_functor,  // NOLINT
                     const boost::filesystem::path& path);
+  // Doesn't lock 'mutex_', since the ID never changes once constructed.
   DirectoryId directory_id() const;
   void ScheduleForStoring();
+  // Records a change to the content of a child (e.g. a write) without taking 'mutex_' or touching
+  // the store timer.  The change is scheduled for storing by the next call to 'ScheduleIfDirty',
+  // 'StoreImmediatelyIfPending' or 'Sync'.  Returns true if the directory wasn't already dirty.
+  bool MarkDirty() { return !dirty_.exchange(true); }
+  void ScheduleIfDirty();
   void StoreImmediatelyIfPending();
+  // Blocks until all changes made to this directory (including writes to its children) before the
+  // call have been stored.  If no store is in progress, the pending store is brought forward and
+  // run on the calling thread; otherwise the running store is waited for first.  Concurrent callers
+  // wait for that store rather than each starting their own, so a burst of calls costs one store
+  // for all the changes it covers.
+  void Sync();
+  // One of these must be called at the end of each attempt to store the directory (i.e. after the
+  // new version has been stored, or has failed to be).  'StoreSucceeded' adds the new version and
+  // sets 'store_state_' to kComplete unless further changes are pending.  A failed attempt is
+  // retried after a delay.  A store whose timer expired while this attempt was running is started
+  // now.
+  void StoreSucceeded();
+  void StoreFailed();
 
   friend void test::DirectoriesMatch(const Directory& lhs, const Directory& rhs);
   friend class test::DirectoryTest;
@@ -114,26 +178,55 @@ class Directory {
   Directory(Directory&& other);
   Directory& operator=(Directory other);
 
-  typedef std::vector<std::unique_ptr<FileContext>> Children;
+  // Keyed by the child's name, which must be kept equal to its 'meta_data.name'.
+  typedef std::map<boost::filesystem::path, std::unique_ptr<FileContext>> Children;
 
   Children::iterator Find(const boost::filesystem::path& name);
   Children::const_iterator Find(const boost::filesystem::path& name) const;
-  void SortAndResetChildrenCounter();
+  // Must be called with 'lock' holding 'mutex_', which is released before this returns.
+  // If 'other_mutex' is not null, it's locked along with the child's mutex and 'functor' is invoked
+  // once the child has been flushed.
+  void DoFlushChildAndDeleteEncryptor(std::unique_lock<std::mutex>& lock, FileContext* child,
+                                      bool only_if_closed, std::mutex* other_mutex = nullptr,
+                                      const std::function<void()>& functor = nullptr);
   void DoScheduleForStoring(bool use_delay = true);
+  // The store timer's handler.  At most one store attempt runs at a time, so if one is running, the
+  // store is deferred until it ends.
+  void StoreOnTimer(const boost::system::error_code& ec);
+  // Must be called with 'mutex_' locked.
+  void DoScheduleIfDirty();
+  void CompleteStore();
+  void StartDeferredStore();
 
   std::condition_variable cond_var_;
   ParentId parent_id_;
   DirectoryId directory_id_;
   boost::asio::steady_timer timer_;
-  std::function<void(const boost::system::error_code&)> store_functor_;
+  std::function<void(Directory*)> put_functor_;  // NOLINT
+  boost::filesystem::path path_;
   std::function<void(const ImmutableData&)> put_chunk_functor_;
   std::function<void(std::vector<ImmutableData::Name>)> increment_chunks_functor_;
   std::vector<ImmutableData::Name> chunks_to_be_incremented_;
   std::deque<StructuredDataVersions::VersionName> versions_;
+  // The version being stored, set by 'InitialiseVersions' or 'AddNewVersion'.
+  std::unique_ptr<StructuredDataVersions::VersionName> new_version_;
   MaxVersions max_versions_;
   Children children_;
-  size_t children_count_position_;
   enum class StoreState { kPending, kOngoing, kComplete } store_state_;
+  // 'storing_' is true from the start of a store attempt (on the timer's expiry, or by 'Sync' or
+  // 'Serialise') to its end ('store_state_' can be reset to kPending by changes made during that
+  // time), and 'store_deferred_' is set if the timer expires meanwhile.  'change_count_' is
+  // incremented on every change, and 'stored_count_' is its value as of the last successfully
+  // stored version.
+  bool storing_, store_deferred_;
+  uint64_t change_count_, serialised_count_, stored_count_;
+  // When the earliest change not yet being stored was made, when the latest change was made, and a
+  // moving average of the interval between changes.  Used to choose when to store.
+  std::chrono::steady_clock::time_point pending_since_, last_change_time_;
+  std::chrono::steady_clock::duration mean_change_interval_;
+  std::atomic<bool> dirty_;
+  // The number of 'FlushChildAndDeleteEncryptor' calls still queueing their chunks for storing.
+  uint32_t flushes_being_queued_;
 };
 
 bool operator<(const Directory& lhs, const Directory& rhs);
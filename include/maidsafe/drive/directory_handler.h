@@ -20,12 +20,16 @@
 #define MAIDSAFE_DRIVE_DIRECTORY_HANDLER_H_
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -37,6 +41,7 @@
 
 #include "maidsafe/common/error.h"
 #include "maidsafe/common/log.h"
+#include "maidsafe/common/on_scope_exit.h"
 #include "maidsafe/common/profiler.h"
 #include "maidsafe/common/rsa.h"
 #include "maidsafe/common/types.h"
@@ -46,10 +51,13 @@
 
 #include "maidsafe/encrypt/self_encryptor.h"
 
+#include "maidsafe/drive/chunk_cache.h"
+#include "maidsafe/drive/chunk_uploader.h"
 #include "maidsafe/drive/config.h"
 #include "maidsafe/drive/directory.h"
 #include "maidsafe/drive/utils.h"
 #include "maidsafe/drive/file_context.h"
+#include "maidsafe/drive/metadata_snapshot.h"
 
 namespace maidsafe {
 
@@ -62,21 +70,54 @@ namespace test { class DirectoryHandlerTest; }
 template <typename Storage>
 class DirectoryHandler {
  public:
+  // If 'snapshot_dir' and 'snapshot_secret' (derived from the user's credentials) are given,
+  // listings are kept in a 'MetadataSnapshot' there between mounts.
   DirectoryHandler(std::shared_ptr<Storage> storage, const Identity& unique_user_id,
                    const Identity& root_parent_id, const boost::filesystem::path& disk_buffer_path,
-                   bool create, boost::asio::io_service& asio_service);
+                   bool create, boost::asio::io_service& asio_service,
+                   std::shared_ptr<ChunkCache> chunk_cache = nullptr,
+                   const boost::filesystem::path& snapshot_dir = boost::filesystem::path(),
+                   const std::string& snapshot_secret = std::string());
   ~DirectoryHandler();
 
-  void Add(const boost::filesystem::path& relative_path, FileContext&& file_context);
-  Directory* Get(const boost::filesystem::path& relative_path);
+  FileContext* Add(const boost::filesystem::path& relative_path, FileContext&& file_context);
+  // The returned directory stays in the cache (and so can't be evicted) while it's held.
+  std::shared_ptr<Directory> Get(const boost::filesystem::path& relative_path);
+  // Loads 'relative_path' and up to 'kMaxPrefetchedDirectories' of its uncached subdirectories in
+  // the background, the subdirectories concurrently, so that a traversal doesn't wait on storage
+  // for each in turn.
+  void PrefetchSubdirectories(const boost::filesystem::path& relative_path);
   void FlushAll();
+  // Blocks until the changes to every cached directory have been stored (see 'Directory::Sync').
+  // Each store runs on the calling thread unless one is already running.
+  void SyncAll();
+  // Checks storage for a newer version of each cached directory used within the last
+  // 'kRemoteChangesMaxIdleTime' (e.g. one stored by another client) and applies any found to the
+  // cached listing.  The checks are made concurrently.  Directories with unstored local changes are
+  // skipped, since storing those will create a competing version anyway.
+  void ApplyRemoteChanges();
+  // Marks 'directory' dirty (see 'Directory::MarkDirty'), queueing it for the next call to
+  // 'ScheduleDirtyDirectories' if it wasn't already.  'directory' must be owned by the cache.
+  void MarkDirty(Directory& directory);
+  // Schedules the storing of each directory queued by 'MarkDirty' since the last call.
+  void ScheduleDirtyDirectories();
   void Delete(const boost::filesystem::path& relative_path);
   void Rename(const boost::filesystem::path& old_relative_path,
               const boost::filesystem::path& new_relative_path);
+  // Stores a chunk popped from a file's full buffer and records it in 'popped_chunks'.
   void HandleDataPoppedFromBuffer(const boost::filesystem::path& relative_path,
-                                  const std::string& name, const NonEmptyString& content) const;
+                                  const std::string& name, const NonEmptyString& content,
+                                  PoppedChunks& popped_chunks) const;
+  // Queues a chunk of a file being written for storing on behalf of its parent 'parent_id', and
+  // records it in 'popped_chunks'.
+  void StoreCompletedChunk(const ImmutableData& chunk, const DirectoryId& parent_id,
+                           PoppedChunks& popped_chunks) const;
 
   Identity root_parent_id() const { return root_parent_id_; }
+  size_t cache_size() const;
+  uint64_t cache_hit_count() const;
+  uint64_t cache_miss_count() const;
+  const ChunkUploader& chunk_uploader() const { return chunk_uploader_; }
 
   friend class test::DirectoryHandlerTest;
 
@@ -87,32 +128,117 @@ class DirectoryHandler {
   DirectoryHandler& operator=(const DirectoryHandler);
 
   bool IsDirectory(const FileContext& file_context) const;
-  std::pair<Directory*, FileContext*> GetParent(const boost::filesystem::path& relative_path);
+  std::pair<std::shared_ptr<Directory>, FileContext*> GetParent(
+      const boost::filesystem::path& relative_path);
   void PrepareNewPath(const boost::filesystem::path& new_relative_path, Directory* new_parent);
   void RenameDifferentParent(const boost::filesystem::path& old_relative_path,
                              const boost::filesystem::path& new_relative_path,
                              Directory* new_parent);
   void Put(Directory* directory);
-  ImmutableData SerialiseDirectory(Directory* directory) const;
+  // Returns a functor which queues chunks for storing on behalf of the directory 'directory_id', so
+  // that failures are reported to that directory's store alone.
+  std::function<void(const ImmutableData&)> PutChunkFunctor(const DirectoryId& directory_id) const;
+  // Queues the chunks of 'serialised_directory' for storing and returns its encrypted data map.
+  ImmutableData EncryptAndStore(Directory* directory,
+                                const std::string& serialised_directory) const;
   std::unique_ptr<Directory> GetFromStorage(const boost::filesystem::path& relative_path,
       const ParentId& parent_id, const DirectoryId& directory_id);
+  // As above, but for a version tip already retrieved from storage.
+  std::unique_ptr<Directory> GetFromStorage(const boost::filesystem::path& relative_path,
+      const ParentId& parent_id, const DirectoryId& directory_id,
+      const StructuredDataVersions::VersionName& version_tip);
   std::unique_ptr<Directory> ParseDirectory(
       const boost::filesystem::path& relative_path, const ImmutableData& encrypted_data_map,
       const ParentId& parent_id, const DirectoryId& directory_id,
       std::vector<StructuredDataVersions::VersionName> versions);
   void DeleteOldestVersion(Directory* directory);
   void DeleteAllVersions(Directory* directory);
+  // Removes from the cache (and the snapshot) the cached subdirectories of 'relative_path' which
+  // are no longer in 'directory's listing, e.g. after a remote version has been applied to it.
+  void DropRemovedSubdirectories(const boost::filesystem::path& relative_path,
+                                 const Directory& directory);
+  // A cached directory.  Nodes form a tree mirroring the directory hierarchy, with 'cache_' being
+  // the root's parent.  Each node is keyed in its parent by the last component of its path, so a
+  // lookup costs one hash probe per component and moving a node moves all cached directories below
+  // it.  Every ancestor of a cached directory is cached too.
+  struct CacheNode {
+    CacheNode(CacheNode* parent_in, const std::string& name_in,
+              std::shared_ptr<Directory> directory_in)
+        : parent(parent_in), name(name_in), directory(std::move(directory_in)),
+          last_used(std::chrono::steady_clock::now()), children() {}
+    CacheNode* parent;
+    std::string name;
+    // Shared with callers of 'Get'; the directory is only evicted while the cache holds the sole
+    // reference.
+    std::shared_ptr<Directory> directory;
+    std::chrono::steady_clock::time_point last_used;
+    // Declared after 'directory' so that subdirectories are destroyed before their parent.
+    std::unordered_map<std::string, std::unique_ptr<CacheNode>> children;
+
+   private:
+    CacheNode(const CacheNode&);
+    CacheNode& operator=(const CacheNode&);
+  };
+
+  // The key of 'relative_path' in its parent's node.
+  std::string CacheKey(const boost::filesystem::path& relative_path) const;
+  // The following must all be called with 'cache_mutex_' locked.
+  // Returns the node of the deepest cached directory on 'relative_path', and sets 'uncached' to
+  // the first component of 'relative_path' below that node (the end if it's fully cached).
+  CacheNode* FindDeepestCached(const boost::filesystem::path& relative_path,
+                               boost::filesystem::path::iterator& uncached);
+  // Returns nullptr if 'relative_path' isn't cached.
+  CacheNode* FindCached(const boost::filesystem::path& relative_path);
+  // Takes ownership of 'directory' only if there's no node called 'name' under 'parent' already.
+  // Returns the node and whether it was added.
+  std::pair<CacheNode*, bool> AddToCache(CacheNode* parent, const std::string& name,
+                                         std::shared_ptr<Directory> directory);
+  // Removes 'node' and all nodes below it.
+  void RemoveFromCache(CacheNode* node);
+  size_t CountCached(const CacheNode& node) const;
+  void ForEachCached(CacheNode& node, const boost::filesystem::path& relative_path,
+      const std::function<void(const boost::filesystem::path&, CacheNode&)>& functor);
+  // If the cache holds more than 'max_cached_directories_', evicts the least recently used
+  // directories which aren't held outside the cache, which have no cached subdirectories and which
+  // can be reloaded from storage without losing anything.  'just_added' is never evicted.
+  void EvictDirectories(const CacheNode* just_added);
+  // Runs 'Get' for 'relative_path' on 'asio_service_', then if 'subdirectories' is true, does the
+  // same for its uncached subdirectories.
+  void Prefetch(const boost::filesystem::path& relative_path, bool subdirectories);
+
+  // Shared with queued prefetches, so that those which run after this is destroyed can tell.
+  struct PrefetchState {
+    PrefetchState() : mutex(), cond_var(), running_count(0), stopped(false) {}
+    std::mutex mutex;
+    std::condition_variable cond_var;
+    uint32_t running_count;
+    bool stopped;
+  };
 
   std::shared_ptr<Storage> storage_;
   Identity unique_user_id_, root_parent_id_;
   mutable detail::FileContext::Buffer disk_buffer_;
+  std::shared_ptr<ChunkCache> chunk_cache_;
+  // Must outlive 'cache_', since destroying a directory can flush its children's encryptors.
+  mutable ChunkUploader chunk_uploader_;
   std::function<NonEmptyString(const std::string&)> get_chunk_from_store_;
   std::function<void(Directory*)> put_functor_;  // NOLINT
-  std::function<void(const ImmutableData&)> put_chunk_functor_;
   std::function<void(std::vector<ImmutableData::Name>)> increment_chunks_functor_;
+  // Must outlive 'cache_', since destroying a directory can store it.
+  std::unique_ptr<MetadataSnapshot> snapshot_;
+  // Protects 'cache_' only.  It may be held while acquiring a Directory's mutex, but must not be
+  // held while fetching from or storing to 'storage_'.
   mutable std::mutex cache_mutex_;
   boost::asio::io_service& asio_service_;
-  std::map<boost::filesystem::path, std::unique_ptr<Directory>> cache_;
+  CacheNode cache_;
+  size_t cache_size_;
+  size_t max_cached_directories_;
+  uint64_t cache_hit_count_, cache_miss_count_;
+  std::shared_ptr<PrefetchState> prefetch_state_;
+  // Directories which have become dirty since the last 'ScheduleDirtyDirectories'.  Weak, since a
+  // queued directory may be deleted before it's scheduled.
+  std::mutex dirty_mutex_;
+  std::vector<std::weak_ptr<Directory>> dirty_directories_;
 };
 
 // ==================== Implementation details ====================================================
@@ -122,7 +248,10 @@ DirectoryHandler<Storage>::DirectoryHandler(std::shared_ptr<Storage> storage,
                                             const Identity& root_parent_id,
                                             const boost::filesystem::path& disk_buffer_path,
                                             bool create,
-                                            boost::asio::io_service& asio_service)
+                                            boost::asio::io_service& asio_service,
+                                            std::shared_ptr<ChunkCache> chunk_cache,
+                                            const boost::filesystem::path& snapshot_dir,
+                                            const std::string& snapshot_secret)
     : storage_(storage),
       unique_user_id_(unique_user_id),
       root_parent_id_(root_parent_id),
@@ -130,23 +259,40 @@ DirectoryHandler<Storage>::DirectoryHandler(std::shared_ptr<Storage> storage,
       // out of buffer, so allow pop_functor to be a no-op.
       disk_buffer_(MemoryUsage(Concurrency() * 1024 * 1024), DiskUsage(30 * 1024 * 1024),
                    [](const std::string&, const NonEmptyString&) {}, disk_buffer_path, true),
+      chunk_cache_(chunk_cache),
+      chunk_uploader_([this](const ImmutableData& chunk) { storage_->Put(chunk); },
+                      kMaxInFlightChunkPuts, kMaxQueuedChunkPuts),
       get_chunk_from_store_(),
       put_functor_([this](Directory* directory) { Put(directory); }),
-      put_chunk_functor_([this](const ImmutableData& chunk) { storage_->Put(chunk); }),
       increment_chunks_functor_([this](const std::vector<ImmutableData::Name>& chunk_names) {
                                   storage_->IncrementReferenceCount(chunk_names);
                                 }),
+      snapshot_(snapshot_dir.empty() || snapshot_secret.empty() ? nullptr :
+                new MetadataSnapshot(snapshot_dir, unique_user_id, root_parent_id,
+                                     NonEmptyString(snapshot_secret))),
       cache_mutex_(),
       asio_service_(asio_service),
-      cache_() {
+      cache_(nullptr, "", nullptr),
+      cache_size_(1),
+      max_cached_directories_(kMaxCachedDirectories),
+      cache_hit_count_(0),
+      cache_miss_count_(0),
+      prefetch_state_(std::make_shared<PrefetchState>()),
+      dirty_mutex_(),
+      dirty_directories_() {
   if (!unique_user_id.IsInitialised())
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::uninitialised));
   if (!root_parent_id.IsInitialised())
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::uninitialised));
   get_chunk_from_store_ = [this](const std::string& name)->NonEmptyString {
     try {
-      auto chunk(storage_->Get(ImmutableData::Name(Identity(name))).get());
-      return chunk.data();
+      NonEmptyString content;
+      if (chunk_cache_ && chunk_cache_->Get(name, content))
+        return content;
+      content = storage_->Get(ImmutableData::Name(Identity(name))).get().data();
+      if (chunk_cache_)
+        chunk_cache_->Put(name, content);
+      return content;
     }
     catch (const std::exception& e) {
       LOG(kError) << "Failed to get chunk from storage: " << e.what();
@@ -155,7 +301,7 @@ DirectoryHandler<Storage>::DirectoryHandler(std::shared_ptr<Storage> storage,
   };
   if (!create) {
     try {
-      cache_[""] = GetFromStorage("", ParentId(unique_user_id_), root_parent_id_);
+      cache_.directory = GetFromStorage("", ParentId(unique_user_id_), root_parent_id_);
     } catch (...) {
       create = true;
     }
@@ -163,150 +309,293 @@ DirectoryHandler<Storage>::DirectoryHandler(std::shared_ptr<Storage> storage,
   if (create) {
     // TODO(Fraser#5#): 2013-12-05 - Fill 'root_file_context' attributes appropriately.
     FileContext root_file_context(kRoot, true);
-    std::unique_ptr<Directory> root_parent(new Directory(ParentId(unique_user_id_),
-        root_parent_id, asio_service_, put_functor_, put_chunk_functor_, increment_chunks_functor_,
-        ""));
-    std::unique_ptr<Directory> root(new Directory(ParentId(root_parent_id),
-        *root_file_context.meta_data.directory_id, asio_service_, put_functor_, put_chunk_functor_,
-        increment_chunks_functor_, kRoot));
+    std::shared_ptr<Directory> root_parent(new Directory(ParentId(unique_user_id_),
+        root_parent_id, asio_service_, put_functor_, PutChunkFunctor(root_parent_id),
+        increment_chunks_functor_, ""));
+    std::shared_ptr<Directory> root(new Directory(ParentId(root_parent_id),
+        *root_file_context.meta_data.directory_id, asio_service_, put_functor_,
+        PutChunkFunctor(*root_file_context.meta_data.directory_id), increment_chunks_functor_,
+        kRoot));
     root_file_context.parent = root_parent.get();
     root_parent->AddChild(std::move(root_file_context));
     root->ScheduleForStoring();
-    cache_[""] = std::move(root_parent);
-    cache_[kRoot] = std::move(root);
+    cache_.directory = root_parent;
+    AddToCache(&cache_, CacheKey(kRoot), root);
   }
 }
 
 template <typename Storage>
 DirectoryHandler<Storage>::~DirectoryHandler() {
+  {
+    std::unique_lock<std::mutex> lock(prefetch_state_->mutex);
+    prefetch_state_->stopped = true;
+    prefetch_state_->cond_var.wait(lock, [this] { return prefetch_state_->running_count == 0; });
+  }
   FlushAll();
 }
 
 template <typename Storage>
-void DirectoryHandler<Storage>::Add(const boost::filesystem::path& relative_path,
-                                    FileContext&& file_context) {
+FileContext* DirectoryHandler<Storage>::Add(const boost::filesystem::path& relative_path,
+                                            FileContext&& file_context) {
   SCOPED_PROFILE
   auto parent(GetParent(relative_path));
   assert(parent.first && parent.second);
 
   if (IsDirectory(file_context)) {
-    std::unique_ptr<Directory> directory(new Directory(ParentId(parent.first->directory_id()),
-        *file_context.meta_data.directory_id, asio_service_, put_functor_, put_chunk_functor_,
-        increment_chunks_functor_, relative_path));
+    std::shared_ptr<Directory> directory(new Directory(ParentId(parent.first->directory_id()),
+        *file_context.meta_data.directory_id, asio_service_, put_functor_,
+        PutChunkFunctor(*file_context.meta_data.directory_id), increment_chunks_functor_,
+        relative_path));
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    cache_[relative_path] = std::move(directory);
+    auto parent_node(FindCached(relative_path.parent_path()));
+    assert(parent_node);
+    auto added(AddToCache(parent_node, CacheKey(relative_path), directory));
+    if (!added.second) {
+      added.first->directory = directory;
+      added.first->last_used = std::chrono::steady_clock::now();
+    }
+    EvictDirectories(added.first);
   }
 
-  parent.second->meta_data.UpdateLastModifiedTime();
-
+  std::shared_ptr<Directory> grandparent;
+  {
+    std::lock_guard<std::mutex> lock(*parent.second->mutex);
+    parent.second->meta_data.UpdateLastModifiedTime();
 #ifndef MAIDSAFE_WIN32
-  parent.second->meta_data.attributes.st_ctime = parent.second->meta_data.attributes.st_mtime;
-  if (IsDirectory(file_context)) {
-    ++parent.second->meta_data.attributes.st_nlink;
-    parent.second->parent->ScheduleForStoring();
-  }
+    parent.second->meta_data.attributes.st_ctime = parent.second->meta_data.attributes.st_mtime;
+    if (IsDirectory(file_context)) {
+      ++parent.second->meta_data.attributes.st_nlink;
+      grandparent = parent.second->parent->shared_from_this();
+    }
 #endif
+  }
+  if (grandparent)
+    grandparent->ScheduleForStoring();
 
   // TODO(Fraser#5#): 2013-11-28 - Use on_scope_exit or similar to undo changes if AddChild throws.
-  parent.first->AddChild(std::move(file_context));
+  return parent.first->AddChild(std::move(file_context));
 }
 
 template <typename Storage>
-Directory* DirectoryHandler<Storage>::Get(const boost::filesystem::path& relative_path) {
+std::shared_ptr<Directory> DirectoryHandler<Storage>::Get(
+    const boost::filesystem::path& relative_path) {
   SCOPED_PROFILE
-  Directory* parent(nullptr);
-  boost::filesystem::path antecedent;
+  std::shared_ptr<Directory> parent;
+  auto path_itr(std::begin(relative_path));
   {  // NOLINT
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    // Try to find the exact directory
-    auto itr(cache_.find(relative_path));
-    if (itr != std::end(cache_))
-      return itr->second.get();
-
-    // Locate the first antecedent in cache
-    antecedent = relative_path;
-    while (itr == std::end(cache_) && !antecedent.empty()) {
-      antecedent = antecedent.parent_path();
-      itr = cache_.find(antecedent);
+    // Find the exact directory or else its deepest cached antecedent
+    auto node(FindDeepestCached(relative_path, path_itr));
+    node->last_used = std::chrono::steady_clock::now();
+    if (path_itr == std::end(relative_path)) {
+      ++cache_hit_count_;
+      return node->directory;
     }
-    assert(itr != std::end(cache_));
-    parent = itr->second.get();
+    parent = node->directory;
   }
 
-  // Recover the decendent directories until we reach the target
-  const FileContext* file_context(nullptr);
-  auto path_itr(std::begin(relative_path));
-  std::advance(path_itr, std::distance(std::begin(antecedent), std::end(antecedent)));
+  boost::filesystem::path antecedent;
+  for (auto itr(std::begin(relative_path)); itr != path_itr; ++itr)
+    antecedent = (itr == std::begin(relative_path)) ? kRoot : (antecedent / *itr).make_preferred();
+
+  // Recover the decendent directories until we reach the target.  Holding 'parent' stops it being
+  // evicted, but it can still be deleted or moved while its child is being fetched.
   while (path_itr != std::end(relative_path)) {
+    boost::filesystem::path name;
     if (path_itr == std::begin(relative_path)) {
-      file_context = parent->GetChild(kRoot);
+      name = kRoot;
       antecedent = kRoot;
     } else {
-      file_context = parent->GetChild(*path_itr);
+      name = *path_itr;
       antecedent = (antecedent / *path_itr).make_preferred();
     }
 
-    if (!file_context->meta_data.directory_id)
+    // The ID is copied while the parent is locked, since a concurrent rename or unlink can move or
+    // destroy the child once it's unlocked.
+    std::unique_ptr<DirectoryId> directory_id;
+    parent->ApplyToChild(name, [&](FileContext& child) {
+      if (child.meta_data.directory_id)
+        directory_id.reset(new DirectoryId(*child.meta_data.directory_id));
+      return false;
+    });
+    if (!directory_id)
       BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
-    auto directory(GetFromStorage(antecedent, ParentId(parent->directory_id()),
-                                  *file_context->meta_data.directory_id));
+    std::shared_ptr<Directory> directory(GetFromStorage(antecedent,
+        ParentId(parent->directory_id()), *directory_id));
     {
       std::lock_guard<std::mutex> lock(cache_mutex_);
-      parent = directory.get();
-      auto insertion_result(cache_.emplace(antecedent, std::move(directory)));
-      assert(insertion_result.second);
-      static_cast<void>(insertion_result);
+      auto parent_node(FindCached(antecedent.parent_path()));
+      if (!parent_node || parent_node->directory != parent)
+        BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
+      // Another thread may have retrieved the same directory while we were fetching it.  If so,
+      // use the cached one and discard ours.
+      auto added(AddToCache(parent_node, CacheKey(antecedent), directory));
+      parent = added.first->directory;
+      if (added.second) {
+        ++cache_miss_count_;
+        EvictDirectories(added.first);
+      }
     }
     ++path_itr;
   }
   return parent;
 }
 
+template <typename Storage>
+void DirectoryHandler<Storage>::PrefetchSubdirectories(
+    const boost::filesystem::path& relative_path) {
+  Prefetch(relative_path, true);
+}
+
 template <typename Storage>
 void DirectoryHandler<Storage>::FlushAll() {
   SCOPED_PROFILE
   bool error(false);
   std::lock_guard<std::mutex> lock(cache_mutex_);
-  for (auto& dir : cache_) {
-    dir.second->ResetChildrenCounter();
-    auto child(dir.second->GetChildAndIncrementCounter());
-    while (child) {
-      if (child->self_encryptor && !child->self_encryptor->Flush()) {
+  ForEachCached(cache_, "", [&](const boost::filesystem::path& relative_path, CacheNode& node) {
+    node.directory->ForEachChildAfter("", [&](const FileContext& child) {
+      std::lock_guard<std::mutex> child_lock(*child.mutex);
+      if (child.self_encryptor && !child.self_encryptor->Flush()) {
         error = true;
-        LOG(kError) << "Failed to flush " << (dir.first / child->meta_data.name);
+        LOG(kError) << "Failed to flush " << (relative_path / child.meta_data.name);
       }
-      child = dir.second->GetChildAndIncrementCounter();
+      return true;
+    });
+    node.directory->StoreImmediatelyIfPending();
+  });
+  if (error)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::SyncAll() {
+  SCOPED_PROFILE
+  // 'cache_mutex_' mustn't be held while storing.
+  std::vector<std::pair<boost::filesystem::path, std::shared_ptr<Directory>>> directories;
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    ForEachCached(cache_, "", [&](const boost::filesystem::path& relative_path, CacheNode& node) {
+      directories.emplace_back(relative_path, node.directory);
+    });
+  }
+  bool error(false);
+  for (const auto& directory : directories) {
+    try {
+      directory.second->Sync();
+    }
+    catch (const std::exception& e) {
+      error = true;
+      LOG(kError) << "Failed to store " << directory.first << ": " << e.what();
     }
-    dir.second->ResetChildrenCounter();
-    dir.second->StoreImmediatelyIfPending();
   }
   if (error)
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
 }
 
+template <typename Storage>
+void DirectoryHandler<Storage>::ApplyRemoteChanges() {
+  SCOPED_PROFILE
+  // Holding the directories keeps them from being evicted or destroyed while they're checked.
+  std::vector<std::pair<boost::filesystem::path, std::shared_ptr<Directory>>> directories;
+  {  // NOLINT
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    const auto used_since(std::chrono::steady_clock::now() - kRemoteChangesMaxIdleTime);
+    ForEachCached(cache_, "", [&](const boost::filesystem::path& relative_path, CacheNode& node) {
+      if (node.last_used >= used_since)
+        directories.emplace_back(relative_path, node.directory);
+    });
+  }
+
+  // Request all of the version tips before waiting on any of them.
+  std::vector<boost::future<std::vector<StructuredDataVersions::VersionName>>> version_tips;
+  for (auto itr(std::begin(directories)); itr != std::end(directories);) {
+    try {
+      MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(
+          itr->second->directory_id()));
+      version_tips.push_back(storage_->GetVersions(hash_directory_id));
+      ++itr;
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Failed to check " << itr->first << " for remote changes: " << e.what();
+      itr = directories.erase(itr);
+    }
+  }
+
+  for (size_t i(0); i != directories.size(); ++i) {
+    const boost::filesystem::path& relative_path(directories[i].first);
+    const std::shared_ptr<Directory>& directory(directories[i].second);
+    try {
+      auto version_tip_of_trees(version_tips[i].get());
+      if (version_tip_of_trees.empty() || directory->HasVersion(version_tip_of_trees.front()))
+        continue;
+      auto remote(GetFromStorage(relative_path, directory->parent_id(), directory->directory_id(),
+                                 version_tip_of_trees.front()));
+      if (directory->ApplyRemoteVersion(*remote)) {
+        LOG(kInfo) << "Applied remote changes to " << relative_path;
+        DropRemovedSubdirectories(relative_path, *directory);
+      }
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Failed to check " << relative_path << " for remote changes: " << e.what();
+    }
+  }
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::MarkDirty(Directory& directory) {
+  if (!directory.MarkDirty())
+    return;
+  std::lock_guard<std::mutex> lock(dirty_mutex_);
+  dirty_directories_.push_back(directory.shared_from_this());
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::ScheduleDirtyDirectories() {
+  std::vector<std::weak_ptr<Directory>> dirty_directories;
+  {
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    dirty_directories.swap(dirty_directories_);
+  }
+  for (const auto& dirty_directory : dirty_directories) {
+    auto directory(dirty_directory.lock());
+    if (directory)
+      directory->ScheduleIfDirty();
+  }
+}
+
 template <typename Storage>
 void DirectoryHandler<Storage>::Delete(const boost::filesystem::path& relative_path) {
   SCOPED_PROFILE
   auto parent(GetParent(relative_path));
   assert(parent.first && parent.second);
 
-  auto file_context(parent.first->GetChild(relative_path.filename()));
+  // The child is only used while its parent is locked, since it's destroyed by 'RemoveChild' below
+  // or by a concurrent unlink.
+  bool is_directory(false);
+  parent.first->ApplyToChild(relative_path.filename(), [&](FileContext& child) {
+    is_directory = IsDirectory(child);
+    return false;
+  });
 
-  if (IsDirectory(*file_context)) {
+  if (is_directory) {
     auto directory(Get(relative_path));
-    DeleteAllVersions(directory);
+    DeleteAllVersions(directory.get());
+    // Nothing will refer to the directory's chunks which failed to be stored.
+    chunk_uploader_.DropFailed(directory->directory_id().string());
     {  // NOLINT
       std::lock_guard<std::mutex> lock(cache_mutex_);
-      cache_.erase(relative_path);
+      auto node(FindCached(relative_path));
+      if (node)
+        RemoveFromCache(node);
     }
   }
 
   parent.first->RemoveChild(relative_path.filename());
+  std::lock_guard<std::mutex> lock(*parent.second->mutex);
   parent.second->meta_data.UpdateLastModifiedTime();
-
 #ifndef MAIDSAFE_WIN32
   parent.second->meta_data.attributes.st_ctime = parent.second->meta_data.attributes.st_mtime;
-  if (IsDirectory(*file_context))
+  if (is_directory)
     --parent.second->meta_data.attributes.st_nlink;
 #endif
 }
@@ -318,27 +607,31 @@ void DirectoryHandler<Storage>::Rename(const boost::filesystem::path& old_relati
   assert(old_relative_path != new_relative_path);
 
   auto new_parent(Get(new_relative_path.parent_path()));
-  PrepareNewPath(new_relative_path, new_parent);
+  PrepareNewPath(new_relative_path, new_parent.get());
 
   if (old_relative_path.parent_path() == new_relative_path.parent_path())
     new_parent->RenameChild(old_relative_path.filename(), new_relative_path.filename());
   else
-    RenameDifferentParent(old_relative_path, new_relative_path, new_parent);
+    RenameDifferentParent(old_relative_path, new_relative_path, new_parent.get());
 
   if (IsDirectory(FileContext(old_relative_path, true))) {
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    // Fix old entry (if it's still there) and any children entries in the cache (effectively
-    // renaming the key part of each such entry).
-    auto old_path_size(old_relative_path.string().size());
-    auto itr(cache_.lower_bound(old_relative_path));
-    while (itr != std::end(cache_)) {
-      if (itr->first.string().substr(0, old_path_size) == old_relative_path.string()) {
-        boost::filesystem::path new_path(
-            new_relative_path.string() + itr->first.string().substr(old_path_size));
-        cache_.insert(std::make_pair(new_path, std::move(itr->second)));
-        itr = cache_.erase(itr);
+    // Move the cached directory (if it's still cached), and with it any cached subdirectories.
+    auto node(FindCached(old_relative_path));
+    if (node) {
+      auto old_itr(node->parent->children.find(node->name));
+      std::unique_ptr<CacheNode> moved(std::move(old_itr->second));
+      node->parent->children.erase(old_itr);
+      auto new_parent_node(FindCached(new_relative_path.parent_path()));
+      if (new_parent_node) {
+        node->parent = new_parent_node;
+        node->name = CacheKey(new_relative_path);
+        auto& new_slot(new_parent_node->children[node->name]);
+        if (new_slot)
+          cache_size_ -= CountCached(*new_slot);
+        new_slot = std::move(moved);
       } else {
-        break;
+        cache_size_ -= CountCached(*moved);
       }
     }
   }
@@ -350,12 +643,16 @@ bool DirectoryHandler<Storage>::IsDirectory(const FileContext& file_context) con
 }
 
 template <typename Storage>
-std::pair<Directory*, FileContext*> DirectoryHandler<Storage>::GetParent(
+std::pair<std::shared_ptr<Directory>, FileContext*> DirectoryHandler<Storage>::GetParent(
     const boost::filesystem::path& relative_path) {
   auto grandparent(Get(relative_path.parent_path().parent_path()));
-  auto parent_context(grandparent->GetMutableChild(relative_path.parent_path().filename()));
-  if (!(parent_context->meta_data.directory_id))
-    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  FileContext* parent_context(nullptr);
+  grandparent->ApplyToChild(relative_path.parent_path().filename(), [&](FileContext& child) {
+    if (!IsDirectory(child))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+    parent_context = &child;
+    return false;
+  });
   return std::make_pair(Get(relative_path.parent_path()), parent_context);
 }
 
@@ -368,17 +665,24 @@ void DirectoryHandler<Storage>::PrepareNewPath(const boost::filesystem::path& ne
   // existing directory, it is removed if empty on ISO/IEC 9945 but is an error on Windows. A
   // symbolic link is itself renamed, rather than the file it resolves to being renamed."
   try {
-    auto existing_child(new_parent->GetChild(new_relative_path.filename()));
-    if (IsDirectory(*existing_child)) {
+    bool existing_is_directory(false);
+    new_parent->ApplyToChild(new_relative_path.filename(), [&](FileContext& child) {
+      existing_is_directory = IsDirectory(child);
+      return false;
+    });
+    if (existing_is_directory) {
 #ifdef MAIDSAFE_WIN32
       BOOST_THROW_EXCEPTION(MakeError(DriveErrors::file_exists));
 #else
       auto existing_directory(Get(new_relative_path));
       if (existing_directory->empty()) {
         new_parent->RemoveChild(new_relative_path.filename());
-        DeleteAllVersions(existing_directory);
+        DeleteAllVersions(existing_directory.get());
+        chunk_uploader_.DropFailed(existing_directory->directory_id().string());
         std::lock_guard<std::mutex> lock(cache_mutex_);
-        cache_.erase(new_relative_path);
+        auto node(FindCached(new_relative_path));
+        if (node)
+          RemoveFromCache(node);
       } else {
         BOOST_THROW_EXCEPTION(MakeError(DriveErrors::file_exists));
       }
@@ -400,7 +704,17 @@ void DirectoryHandler<Storage>::RenameDifferentParent(
     Directory* new_parent) {
   auto old_parent(GetParent(old_relative_path));
   assert(old_parent.first && old_parent.second && new_parent);
-  auto file_context(old_parent.first->RemoveChild(old_relative_path.filename()));
+  // A moved directory is loaded (it may have been evicted) and pinned before it's taken from its
+  // parent, so that the entry isn't lost if loading it fails.
+  bool is_directory(false);
+  old_parent.first->ApplyToChild(old_relative_path.filename(), [&](FileContext& child) {
+    is_directory = IsDirectory(child);
+    return false;
+  });
+  std::shared_ptr<Directory> directory(is_directory ? Get(old_relative_path) : nullptr);
+  // The context is moved without reallocating, so pointers to it held by open file handles remain
+  // valid.
+  auto file_context(old_parent.first->TakeChild(old_relative_path.filename()));
 
 // #ifndef MAIDSAFE_WIN32
 //   struct stat old;
@@ -409,25 +723,21 @@ void DirectoryHandler<Storage>::RenameDifferentParent(
 //   time(&meta_data.attributes.st_mtime);
 //   meta_data.attributes.st_ctime = meta_data.attributes.st_mtime;
 // #endif
-  if (IsDirectory(file_context)) {
-    auto directory(Get(old_relative_path));
-    DeleteAllVersions(directory);
+  if (directory) {
+    DeleteAllVersions(directory.get());
     {
+      // The cache entry is moved to the new path by 'Rename'.
       std::lock_guard<std::mutex> lock(cache_mutex_);
-      auto itr(cache_.find(old_relative_path));
-      assert(itr != std::end(cache_));
-      std::unique_ptr<Directory> temp(std::move(itr->second));
-      temp->SetNewParent(ParentId(new_parent->directory_id()), put_functor_, new_relative_path);
-      cache_.erase(itr);
-      auto insertion_result(cache_.emplace(new_relative_path, std::move(temp)));
-      assert(insertion_result.second);
-      directory = insertion_result.first->second.get();
+      directory->SetNewParent(ParentId(new_parent->directory_id()), put_functor_,
+                              new_relative_path);
     }
     directory->ScheduleForStoring();
   }
 
-  file_context.meta_data.name = new_relative_path.filename();
-  file_context.parent = new_parent;
+  {
+    std::lock_guard<std::mutex> lock(*file_context->mutex);
+    file_context->meta_data.name = new_relative_path.filename();
+  }
   new_parent->AddChild(std::move(file_context));
 
 #ifdef MAIDSAFE_WIN32
@@ -454,24 +764,54 @@ void DirectoryHandler<Storage>::RenameDifferentParent(
 
 template <typename Storage>
 void DirectoryHandler<Storage>::Put(Directory* directory) {
-  ImmutableData encrypted_data_map(SerialiseDirectory(directory));
-  storage_->Put(encrypted_data_map);
-  if (directory->VersionsCount() == 0) {
-    auto result(directory->InitialiseVersions(encrypted_data_map.name()));
-    MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(std::get<0>(result)));
-    auto future(storage_->CreateVersionTree(hash_directory_id,
-                                            std::get<1>(result), kMaxVersions, 2));
-    future.get();
-  } else {
-    auto result(directory->AddNewVersion(encrypted_data_map.name()));
-    MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(std::get<0>(result)));
-    storage_->PutVersion(hash_directory_id, std::get<1>(result), std::get<2>(result));
+  try {
+    // The attempt has started, so it must end with 'StoreFailed' even if this throws.
+    std::string serialised_directory(directory->Serialise());
+    ImmutableData encrypted_data_map(EncryptAndStore(directory, serialised_directory));
+    // The new version mustn't be visible before all chunks it refers to, including those of files
+    // flushed since the last store and any which failed to be stored before, have been stored.
+    if (!chunk_uploader_.WaitForQueued(directory->directory_id().string()))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unable_to_handle_request));
+    storage_->Put(encrypted_data_map);
+    // The directory's versions are only updated once the new version is in storage, so that a
+    // failed attempt is retried from the version actually stored.
+    std::vector<StructuredDataVersions::VersionName> versions(directory->Versions());
+    if (versions.empty()) {
+      auto result(directory->InitialiseVersions(encrypted_data_map.name()));
+      MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(std::get<0>(result)));
+      auto future(storage_->CreateVersionTree(hash_directory_id,
+                                              std::get<1>(result), kMaxVersions, 2));
+      future.get();
+      versions.push_back(std::get<1>(result));
+    } else {
+      auto result(directory->AddNewVersion(encrypted_data_map.name()));
+      MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(std::get<0>(result)));
+      storage_->PutVersion(hash_directory_id, std::get<1>(result), std::get<2>(result)).get();
+      versions.insert(std::begin(versions), std::get<2>(result));
+      if (versions.size() > kMaxVersions)
+        versions.pop_back();
+    }
+    if (snapshot_)
+      snapshot_->Put(directory->directory_id(), versions, serialised_directory);
+  }
+  catch (const std::exception& e) {
+    LOG(kError) << "Failed to store directory: " << e.what();
+    directory->StoreFailed();
+    throw;
   }
+  directory->StoreSucceeded();
 }
 
 template <typename Storage>
-ImmutableData DirectoryHandler<Storage>::SerialiseDirectory(Directory* directory) const {
-  std::string serialised_directory(directory->Serialise());
+std::function<void(const ImmutableData&)> DirectoryHandler<Storage>::PutChunkFunctor(
+    const DirectoryId& directory_id) const {
+  const std::string batch(directory_id.string());
+  return [this, batch](const ImmutableData& chunk) { chunk_uploader_.Put(chunk, batch); };
+}
+
+template <typename Storage>
+ImmutableData DirectoryHandler<Storage>::EncryptAndStore(
+    Directory* directory, const std::string& serialised_directory) const {
   encrypt::DataMap data_map;
   {
     encrypt::SelfEncryptor self_encryptor(data_map, disk_buffer_, get_chunk_from_store_);
@@ -483,7 +823,7 @@ ImmutableData DirectoryHandler<Storage>::SerialiseDirectory(Directory* directory
   }
   for (const auto& chunk : data_map.chunks) {
     auto content(disk_buffer_.Get(chunk.hash));
-    storage_->Put(ImmutableData(content));
+    chunk_uploader_.Put(ImmutableData(content), directory->directory_id().string());
   }
   auto encrypted_data_map_contents(encrypt::EncryptDataMap(directory->parent_id(),
                                                            directory->directory_id(), data_map));
@@ -503,10 +843,40 @@ std::unique_ptr<Directory> DirectoryHandler<Storage>::GetFromStorage(
     //                  one to keep)
     version_tip_of_trees.resize(1);
   }
-  auto versions(storage_->GetBranch(hash_directory_id, version_tip_of_trees.front()).get());
+  return GetFromStorage(relative_path, parent_id, directory_id, version_tip_of_trees.front());
+}
+
+template <typename Storage>
+std::unique_ptr<Directory> DirectoryHandler<Storage>::GetFromStorage(
+    const boost::filesystem::path& relative_path, const ParentId& parent_id,
+    const DirectoryId& directory_id, const StructuredDataVersions::VersionName& version_tip) {
+  std::string serialised_listing;
+  std::vector<StructuredDataVersions::VersionName> snapshot_versions;
+  if (snapshot_ &&
+      snapshot_->Get(directory_id, version_tip, serialised_listing, snapshot_versions)) {
+    try {
+      std::unique_ptr<Directory> directory(new Directory(parent_id, serialised_listing,
+          snapshot_versions, asio_service_, put_functor_, PutChunkFunctor(directory_id),
+          increment_chunks_functor_, relative_path));
+      if (directory->directory_id() == directory_id)
+        return std::move(directory);
+      LOG(kWarning) << "Snapshot of " << relative_path << " has the wrong directory ID.";
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Failed to parse snapshot of " << relative_path << ": " << e.what();
+    }
+    snapshot_->Remove(directory_id);
+  }
+
+  MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(directory_id));
+  // The tip's ID is the name of the encrypted data map, so there's no need to wait for the branch
+  // before requesting it.
+  auto versions_future(storage_->GetBranch(hash_directory_id, version_tip));
+  auto encrypted_data_map_future(storage_->Get(version_tip.id));
+  auto versions(versions_future.get());
   assert(!versions.empty());
   try {
-    ImmutableData encrypted_data_map(storage_->Get(versions.front().id).get());
+    ImmutableData encrypted_data_map(encrypted_data_map_future.get());
     return ParseDirectory(relative_path, encrypted_data_map, parent_id, directory_id,
                           std::move(versions));
   }
@@ -523,15 +893,52 @@ std::unique_ptr<Directory> DirectoryHandler<Storage>::ParseDirectory(
     std::vector<StructuredDataVersions::VersionName> versions) {
   auto data_map(encrypt::DecryptDataMap(parent_id.data, directory_id,
                                         encrypted_data_map.data().string()));
-  encrypt::SelfEncryptor self_encryptor(data_map, disk_buffer_, get_chunk_from_store_);
+  // Request all of the listing's uncached chunks at once, rather than one after another as the
+  // encryptor reads them.
+  std::mutex chunks_mutex;
+  std::map<std::string, NonEmptyString> cached_chunks;
+  std::map<std::string, boost::future<ImmutableData>> requested_chunks;
+  for (const auto& chunk : data_map.chunks) {
+    NonEmptyString content;
+    if (chunk_cache_ && chunk_cache_->Get(chunk.hash, content))
+      cached_chunks.insert(std::make_pair(chunk.hash, content));
+    else if (requested_chunks.count(chunk.hash) == 0)
+      requested_chunks.emplace(chunk.hash,
+                               storage_->Get(ImmutableData::Name(Identity(chunk.hash))));
+  }
+  auto get_chunk([&](const std::string& name)->NonEmptyString {
+    std::lock_guard<std::mutex> lock(chunks_mutex);
+    auto cached_itr(cached_chunks.find(name));
+    if (cached_itr != std::end(cached_chunks))
+      return cached_itr->second;
+    auto requested_itr(requested_chunks.find(name));
+    if (requested_itr == std::end(requested_chunks))
+      return get_chunk_from_store_(name);
+    NonEmptyString content;
+    try {
+      content = requested_itr->second.get().data();
+    }
+    catch (const std::exception& e) {
+      LOG(kError) << "Failed to get chunk from storage: " << e.what();
+      throw;
+    }
+    requested_chunks.erase(requested_itr);
+    cached_chunks.insert(std::make_pair(name, content));
+    if (chunk_cache_)
+      chunk_cache_->Put(name, content);
+    return content;
+  });
+  encrypt::SelfEncryptor self_encryptor(data_map, disk_buffer_, get_chunk);
   uint32_t data_map_size(static_cast<uint32_t>(data_map.size()));
   std::string serialised_listing(data_map_size, 0);
 
   if (!self_encryptor.Read(const_cast<char*>(serialised_listing.c_str()), data_map_size, 0))
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+  if (snapshot_ && !versions.empty())
+    snapshot_->Put(directory_id, versions, serialised_listing);
 
   std::unique_ptr<Directory> directory(new Directory(parent_id, serialised_listing,
-      std::move(versions), asio_service_, put_functor_, put_chunk_functor_,
+      std::move(versions), asio_service_, put_functor_, PutChunkFunctor(directory_id),
       increment_chunks_functor_, relative_path));
   assert(directory->directory_id() == directory_id);
   return std::move(directory);
@@ -550,25 +957,236 @@ void DirectoryHandler<Storage>::DeleteOldestVersion(Directory* /*directory*/) {
 }
 
 template <typename Storage>
-void DirectoryHandler<Storage>::DeleteAllVersions(Directory* /*directory*/) {
+void DirectoryHandler<Storage>::DeleteAllVersions(Directory* directory) {
+  if (snapshot_)
+    snapshot_->Remove(directory->directory_id());
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::DropRemovedSubdirectories(
+    const boost::filesystem::path& relative_path, const Directory& directory) {
+  // Destroyed once 'cache_mutex_' is released, since destroying a directory can store it.
+  std::vector<std::unique_ptr<CacheNode>> removed;
+  std::vector<DirectoryId> removed_ids;
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto node(FindCached(relative_path));
+    if (!node || node->children.empty())
+      return;
+    std::map<std::string, DirectoryId> subdirectories;
+    directory.ForEachChildAfter("", [&](const FileContext& child) {
+      if (child.meta_data.directory_id) {
+        subdirectories.insert(std::make_pair(child.meta_data.name.string(),
+                                             *child.meta_data.directory_id));
+      }
+      return true;
+    });
+    for (auto itr(std::begin(node->children)); itr != std::end(node->children);) {
+      auto subdirectory(subdirectories.find(itr->first));
+      // A subdirectory removed and recreated remotely has the same name but a different ID.
+      if (subdirectory != std::end(subdirectories) &&
+          subdirectory->second == itr->second->directory->directory_id()) {
+        ++itr;
+        continue;
+      }
+      LOG(kInfo) << (relative_path / itr->first) << " was removed remotely.";
+      ForEachCached(*itr->second, "", [&](const boost::filesystem::path&, CacheNode& removed_node) {
+        removed_ids.push_back(removed_node.directory->directory_id());
+      });
+      cache_size_ -= CountCached(*itr->second);
+      removed.push_back(std::move(itr->second));
+      itr = node->children.erase(itr);
+    }
+  }
+  // Any pending stores of the removed directories are done before their snapshots are removed.
+  removed.clear();
+  if (snapshot_) {
+    for (const auto& removed_id : removed_ids)
+      snapshot_->Remove(removed_id);
+  }
+}
+
+template <typename Storage>
+size_t DirectoryHandler<Storage>::cache_size() const {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  return cache_size_;
+}
+
+template <typename Storage>
+uint64_t DirectoryHandler<Storage>::cache_hit_count() const {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  return cache_hit_count_;
+}
+
+template <typename Storage>
+uint64_t DirectoryHandler<Storage>::cache_miss_count() const {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  return cache_miss_count_;
+}
+
+template <typename Storage>
+std::string DirectoryHandler<Storage>::CacheKey(
+    const boost::filesystem::path& relative_path) const {
+  return relative_path.parent_path().empty() ? kRoot.string() : relative_path.filename().string();
+}
+
+template <typename Storage>
+typename DirectoryHandler<Storage>::CacheNode* DirectoryHandler<Storage>::FindDeepestCached(
+    const boost::filesystem::path& relative_path, boost::filesystem::path::iterator& uncached) {
+  CacheNode* node(&cache_);
+  for (uncached = std::begin(relative_path); uncached != std::end(relative_path); ++uncached) {
+    auto child(node->children.find(
+        uncached == std::begin(relative_path) ? kRoot.string() : uncached->string()));
+    if (child == std::end(node->children))
+      break;
+    node = child->second.get();
+  }
+  return node;
+}
+
+template <typename Storage>
+typename DirectoryHandler<Storage>::CacheNode* DirectoryHandler<Storage>::FindCached(
+    const boost::filesystem::path& relative_path) {
+  boost::filesystem::path::iterator uncached;
+  auto node(FindDeepestCached(relative_path, uncached));
+  return uncached == std::end(relative_path) ? node : nullptr;
+}
+
+template <typename Storage>
+std::pair<typename DirectoryHandler<Storage>::CacheNode*, bool>
+    DirectoryHandler<Storage>::AddToCache(CacheNode* parent, const std::string& name,
+                                          std::shared_ptr<Directory> directory) {
+  auto& child(parent->children[name]);
+  if (child) {
+    child->last_used = std::chrono::steady_clock::now();
+    return std::make_pair(child.get(), false);
+  }
+  child.reset(new CacheNode(parent, name, std::move(directory)));
+  ++cache_size_;
+  return std::make_pair(child.get(), true);
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::RemoveFromCache(CacheNode* node) {
+  assert(node != &cache_);
+  cache_size_ -= CountCached(*node);
+  node->parent->children.erase(node->name);
+}
+
+template <typename Storage>
+size_t DirectoryHandler<Storage>::CountCached(const CacheNode& node) const {
+  size_t count(1);
+  for (const auto& child : node.children)
+    count += CountCached(*child.second);
+  return count;
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::ForEachCached(CacheNode& node,
+    const boost::filesystem::path& relative_path,
+    const std::function<void(const boost::filesystem::path&, CacheNode&)>& functor) {
+  functor(relative_path, node);
+  for (auto& child : node.children)
+    ForEachCached(*child.second, relative_path / child.first, functor);
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::EvictDirectories(const CacheNode* just_added) {
+  if (cache_size_ <= max_cached_directories_)
+    return;
+  // Only directories without cached subdirectories are evicted, since every ancestor of a cached
+  // directory must be cached.  The root and its parent are never evicted.  A directory held by a
+  // caller of 'Get' (or a prefetch, or 'ApplyRemoteChanges') has a use count above one.
+  std::vector<std::pair<std::chrono::steady_clock::time_point, CacheNode*>> idle;
+  ForEachCached(cache_, "", [&](const boost::filesystem::path&, CacheNode& node) {
+    if (node.children.empty() && &node != &cache_ && node.parent != &cache_ &&
+        &node != just_added && node.directory.use_count() == 1) {
+      idle.emplace_back(node.last_used, &node);
+    }
+  });
+  std::sort(std::begin(idle), std::end(idle),
+            [](const std::pair<std::chrono::steady_clock::time_point, CacheNode*>& lhs,
+               const std::pair<std::chrono::steady_clock::time_point, CacheNode*>& rhs) {
+              return lhs.first < rhs.first;
+            });
+  // Evict down to below the limit, so that this isn't repeated for every directory fetched.
+  const size_t target(max_cached_directories_ - max_cached_directories_ / 10);
+  for (const auto& candidate : idle) {
+    if (cache_size_ <= target)
+      break;
+    if (candidate.second->directory->CanBeEvicted()) {
+      LOG(kVerbose) << "Evicting " << candidate.second->name << " from directory cache.";
+      RemoveFromCache(candidate.second);
+    }
+  }
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::Prefetch(const boost::filesystem::path& relative_path,
+                                         bool subdirectories) {
+  std::shared_ptr<PrefetchState> prefetch_state(prefetch_state_);
+  asio_service_.post([this, prefetch_state, relative_path, subdirectories] {
+    {
+      std::lock_guard<std::mutex> lock(prefetch_state->mutex);
+      if (prefetch_state->stopped)
+        return;
+      ++prefetch_state->running_count;
+    }
+    on_scope_exit finished([prefetch_state] {
+      std::lock_guard<std::mutex> lock(prefetch_state->mutex);
+      --prefetch_state->running_count;
+      prefetch_state->cond_var.notify_all();
+    });
+    try {
+      auto directory(Get(relative_path));
+      if (!subdirectories)
+        return;
+      std::vector<std::string> names;
+      directory->ForEachChildAfter("", [&](const FileContext& child) {
+        if (child.meta_data.directory_id)
+          names.push_back(child.meta_data.name.string());
+        return true;
+      });
+      std::vector<boost::filesystem::path> uncached;
+      {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto node(FindCached(relative_path));
+        for (const auto& name : names) {
+          if (uncached.size() == kMaxPrefetchedDirectories)
+            break;
+          if (!node || node->children.count(name) == 0)
+            uncached.push_back(relative_path / name);
+        }
+      }
+      for (const auto& subdirectory : uncached)
+        Prefetch(subdirectory, false);
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Failed to prefetch " << relative_path << ": " << e.what();
+    }
+  });
 }
 
 template <typename Storage>
 void DirectoryHandler<Storage>::HandleDataPoppedFromBuffer(
     const boost::filesystem::path& relative_path, const std::string& name,
-    const NonEmptyString& content) const {
+    const NonEmptyString& content, PoppedChunks& popped_chunks) const {
   // NOTE, This will be executed on a different thread to the one writing to the encryptor which has
   // triggered this call.  We therefore can't safely access any non-threadsafe class members here.
-  LOG(kWarning) << "Chunk " << HexSubstr(name) << " has been popped from the buffer for "
-                << relative_path;
-  // TODO(Fraser#5#): 2013-11-27 - Handle mutex-protecting the file_contexts, so we can log that
-  // we're storing this chunk to the network.  If it's only a temporary chunk (i.e. it's not still
-  // listed in the datamap when we get the next flush/close call), we should delete it from the
-  // network again.
+  LOG(kInfo) << "Chunk " << HexSubstr(name) << " has been popped from the buffer for "
+             << relative_path << " - storing it now.";
   ImmutableData data(content);
   assert(data.name()->string() == name);
-//  storage_->Put(data);
-  BOOST_THROW_EXCEPTION(MakeError(CommonErrors::file_too_large));
+  storage_->Put(data);
+  popped_chunks.Add(name);
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::StoreCompletedChunk(const ImmutableData& chunk,
+                                                    const DirectoryId& parent_id,
+                                                    PoppedChunks& popped_chunks) const {
+  chunk_uploader_.Put(chunk, parent_id.string());
+  popped_chunks.Add(chunk.name()->string());
 }
 
 }  // namespace detail
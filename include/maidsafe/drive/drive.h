@@ -31,6 +31,7 @@
 #include <tuple>
 #include <vector>
 
+#include "boost/asio/steady_timer.hpp"
 #include "boost/filesystem/operations.hpp"
 #include "boost/filesystem/path.hpp"
 #include "boost/thread/future.hpp"
@@ -39,6 +40,9 @@
 #include "maidsafe/common/rsa.h"
 #include "maidsafe/common/utils.h"
 
+#include "maidsafe/drive/buffer_budget.h"
+#include "maidsafe/drive/chunk_cache.h"
+#include "maidsafe/drive/chunk_prefetcher.h"
 #include "maidsafe/drive/config.h"
 #include "maidsafe/drive/meta_data.h"
 #include "maidsafe/drive/directory_handler.h"
@@ -49,6 +53,14 @@ namespace maidsafe {
 
 namespace drive {
 
+// Drive operations may be invoked concurrently (e.g. from several FUSE worker threads).  The
+// locking model is hierarchical, and locks are only ever acquired in this order:
+//   1. DirectoryHandler::cache_mutex_ - protects the map of cached directories only.
+//   2. Directory::mutex_ - protects a directory's children and its versioning/storing state.
+//   3. FileContext::mutex - protects a single file's meta_data, buffer, encryptor and timer.
+// No lock is held while waiting on storage, other than a FileContext's own mutex while its
+// encryptor retrieves chunks.  Operations on different files therefore only contend briefly on a
+// shared parent directory's mutex.
 template <typename Storage>
 class Drive {
  public:
@@ -56,29 +68,61 @@ class Drive {
   boost::future<void> GetMountFuture();
 
  protected:
+  // If 'snapshot_secret' (derived from the user's credentials) is given, directory listings are
+  // kept on disk between mounts (see 'MetadataSnapshot').
   Drive(std::shared_ptr<Storage> storage, const Identity& unique_user_id,
         const Identity& root_parent_id, const boost::filesystem::path& mount_dir,
         const boost::filesystem::path& user_app_dir,
-        const std::string& mount_status_shared_object_name, bool create);
+        const std::string& mount_status_shared_object_name, bool create,
+        const std::string& snapshot_secret = std::string());
 
   virtual ~Drive();
   virtual void Mount() = 0;
   virtual void Unmount() = 0;
 
-  const detail::FileContext* GetContext(const boost::filesystem::path& relative_path);
+  // Invokes 'functor' on the context of 'relative_path' with its parent's and its own mutexes held
+  // (see 'Directory::ApplyToChild').  Use this rather than 'GetMutableContext' for files which
+  // aren't open, since their contexts can be removed once the parent's mutex is released.
+  void ApplyToContext(const boost::filesystem::path& relative_path,
+                      const std::function<bool(detail::FileContext&)>& functor);
+  // The returned context is only safe to use while the file is open.
   detail::FileContext* GetMutableContext(const boost::filesystem::path& relative_path);
-  void Create(const boost::filesystem::path& relative_path, detail::FileContext&& file_context);
-  void Open(const boost::filesystem::path& relative_path);
+  // 'Create' and 'Open' return the context of the file, which remains valid until the file is
+  // deleted.  Front-ends may keep this as a handle to avoid resolving the path again in subsequent
+  // operations on the open file.
+  detail::FileContext* Create(const boost::filesystem::path& relative_path,
+                              detail::FileContext&& file_context);
+  detail::FileContext* Open(const boost::filesystem::path& relative_path);
   void Flush(const boost::filesystem::path& relative_path);
+  void Flush(detail::FileContext* file_context);
+  // Block until the file's (or directory's) current contents and metadata have been stored.
+  // Concurrent calls on the same directory are satisfied by a single store of that directory.
+  void Fsync(detail::FileContext* file_context);
+  void FsyncDir(const boost::filesystem::path& relative_path);
   void Release(const boost::filesystem::path& relative_path);
-  void ReleaseDir(const boost::filesystem::path& relative_path);
+  void Release(detail::FileContext* file_context);
   void Delete(const boost::filesystem::path& relative_path);
   void Rename(const boost::filesystem::path& old_relative_path,
               const boost::filesystem::path& new_relative_path);
   uint32_t Read(const boost::filesystem::path& relative_path, char* data, uint32_t size,
                 uint64_t offset);
+  uint32_t Read(const detail::FileContext* file_context, char* data, uint32_t size,
+                uint64_t offset);
   uint32_t Write(const boost::filesystem::path& relative_path, const char* data, uint32_t size,
                  uint64_t offset);
+  uint32_t Write(detail::FileContext* file_context, const char* data, uint32_t size,
+                 uint64_t offset);
+  // Copies 'size' bytes from 'source' at 'source_offset' into the open file 'destination' at
+  // 'destination_offset', returning the number of bytes copied.  If the whole of 'source' is copied
+  // over the whole of 'destination', the destination shares the source's chunks (see 'Clone');
+  // otherwise the data is read and re-written.
+  uint64_t CopyRange(detail::FileContext* source, uint64_t source_offset,
+                     detail::FileContext* destination, uint64_t destination_offset,
+                     uint64_t size);
+
+  // The directory containing 'file_context'.  A rename can move the file to another directory, so
+  // this is read under the file's mutex, which mustn't already be held.
+  std::shared_ptr<detail::Directory> GetParent(detail::FileContext* file_context) const;
 
   std::shared_ptr<Storage> storage_;
   const boost::filesystem::path kMountDir_;
@@ -91,18 +135,45 @@ class Drive {
 
  private:
   typedef detail::FileContext::Buffer Buffer;
+  // Gives the file an encryptor and buffer, unless it still has those from when it was last open.
+  // 'reserved_memory' is buffer memory already reserved from 'buffer_budget_' for this call; it's
+  // used for a new buffer or else returned to the budget.  If it's null, memory is reserved without
+  // waiting, since the caller holds the file's mutex.
   void InitialiseEncryptor(const boost::filesystem::path& relative_path,
-                           detail::FileContext& file_context);
+                           detail::FileContext& file_context, const MemoryUsage* reserved_memory);
   void ScheduleDeletionOfEncryptor(detail::FileContext* file_context);
-
+  // Called after each write to an open file.  While writes are sequential, stores the chunks which
+  // the encryptor has finished with, so that flushing is left with little more than the first two
+  // and the last chunks (which depend on the end of the file).
+  void StoreCompletedChunks(detail::FileContext& file_context, uint64_t offset, uint32_t size);
+  // Replaces the contents of the open file 'destination' with those of 'source' by copying the
+  // source's data map.  Reference counts of the shared chunks are incremented when the destination
+  // is next stored, as for any unmodified chunks of an opened file.
+  void Clone(detail::FileContext* source, detail::FileContext* destination);
+  // Periodically picks up changes to cached directories made by other clients.  The kernel sees
+  // these via the updated attributes (and with 'auto_cache', drops cached pages of changed files).
+  void ScheduleRemoteChangesCheck();
+  // Periodically schedules the storing of cached directories whose children have been written to.
+  // Writes only mark their parent dirty, leaving the rescheduling of its store to this sweep.
+  void ScheduleDirtyDirectoriesSweep();
+
+  std::shared_ptr<detail::ChunkCache> chunk_cache_;
+  detail::ChunkPrefetcher chunk_prefetcher_;
   std::function<NonEmptyString(const std::string&)> get_chunk_from_store_;
   MemoryUsage default_max_buffer_memory_;
   DiskUsage default_max_buffer_disk_;
+  detail::BufferBudget buffer_budget_;
 
  protected:
-  AsioService asio_service_;
-  // Needs to be destructed first so that 'get_chunk_from_store_' and 'storage_' outlive it.
+  // File timers and the dirty directories sweep run apart from directory stores and remote change
+  // checks, which block on storage.  Their handlers only post work to the store service, so a slow
+  // store can't stop other timers firing.
+  AsioService timer_asio_service_;
+  AsioService store_asio_service_;
+  // Declared after 'get_chunk_from_store_', 'storage_' and the services so that they outlive it,
+  // and before the timers, whose handlers use it, so that it outlives them.
   detail::DirectoryHandler<Storage> directory_handler_;
+  boost::asio::steady_timer remote_changes_timer_, dirty_directories_timer_;
 };
 
 // ==================== Implementation =============================================================
@@ -110,7 +181,8 @@ template <typename Storage>
 Drive<Storage>::Drive(std::shared_ptr<Storage> storage, const Identity& unique_user_id,
                       const Identity& root_parent_id, const boost::filesystem::path& mount_dir,
                       const boost::filesystem::path& user_app_dir,
-                      const std::string& mount_status_shared_object_name, bool create)
+                      const std::string& mount_status_shared_object_name, bool create,
+                      const std::string& snapshot_secret)
     : storage_(storage),
       kMountDir_(mount_dir),
       kUserAppDir_(user_app_dir),
@@ -128,30 +200,75 @@ Drive<Storage>::Drive(std::shared_ptr<Storage> storage, const Identity& unique_u
       kMountStatusSharedObjectName_(mount_status_shared_object_name),
       mount_promise_(),
       unmounted_once_flag_(),
+      chunk_cache_(std::make_shared<detail::ChunkCache>(detail::kChunkCacheMemoryUsage,
+          DiskUsage(std::min<uint64_t>(detail::kChunkCacheDiskUsage.data,
+                                       boost::filesystem::space(kUserAppDir_).available / 10)),
+          boost::filesystem::unique_path(*kBufferRoot_ / "Chunks-%%%%%-%%%%%-%%%%%-%%%%%"))),
+      chunk_prefetcher_([this](const ImmutableData::Name& name)->boost::future<ImmutableData> {
+                          NonEmptyString content;
+                          if (chunk_cache_->Get(name->string(), content)) {
+                            boost::promise<ImmutableData> cached;
+                            cached.set_value(ImmutableData(content));
+                            return cached.get_future();
+                          }
+                          return storage_->Get(name);
+                        },
+                        detail::kMaxPrefetchedChunks),
       get_chunk_from_store_(),
       // TODO(Fraser#5#): 2013-11-27 - BEFORE_RELEASE - confirm the following 2 variables.
       default_max_buffer_memory_(Concurrency() * 1024 * 1024),  // cores * default chunk size
       default_max_buffer_disk_(static_cast<uint64_t>(
           boost::filesystem::space(kUserAppDir_).available / 10)),
-      asio_service_(2),
+      buffer_budget_(detail::kBufferMemoryBudget, detail::kMinBufferMemory,
+                     default_max_buffer_memory_),
+      timer_asio_service_(detail::kTimerThreadCount),
+      store_asio_service_(std::max(detail::kMinStoreThreadCount,
+                                   static_cast<uint32_t>(Concurrency()))),
       directory_handler_(storage, unique_user_id, root_parent_id,
           boost::filesystem::unique_path(*kBufferRoot_ / "%%%%%-%%%%%-%%%%%-%%%%%"),
-          create, asio_service_.service()) {
+          create, store_asio_service_.service(), chunk_cache_, kUserAppDir_ / "Snapshots",
+          snapshot_secret),
+      remote_changes_timer_(store_asio_service_.service()),
+      dirty_directories_timer_(timer_asio_service_.service()) {
   get_chunk_from_store_ = [this](const std::string& name)->NonEmptyString {
     try {
-      auto chunk(storage_->Get(ImmutableData::Name(Identity(name))).get());
-      return chunk.data();
+      // The prefetcher's getter checks 'chunk_cache_' before going to storage.
+      auto content(chunk_prefetcher_.Get(name));
+      chunk_cache_->Put(name, content);
+      return content;
     }
     catch (const std::exception& e) {
       LOG(kError) << "Failed to get chunk from storage: " << e.what();
       throw;
     }
   };
+  ScheduleRemoteChangesCheck();
+  ScheduleDirtyDirectoriesSweep();
 }
 
 template <typename Storage>
 Drive<Storage>::~Drive() {
-  asio_service_.Stop();
+  remote_changes_timer_.cancel();
+  dirty_directories_timer_.cancel();
+  timer_asio_service_.Stop();
+  // Pending stores are run here while the store service is still running, since those posted once
+  // it has stopped would never run, and the directories would wait for them in vain when destroyed.
+  try {
+    directory_handler_.SyncAll();
+  }
+  catch (const std::exception& e) {
+    LOG(kError) << "Failed to store all directories before unmounting: " << e.what();
+  }
+  store_asio_service_.Stop();
+  LOG(kInfo) << "Chunk cache: " << chunk_cache_->memory_hit_count() << " memory hits, "
+             << chunk_cache_->disk_hit_count() << " disk hits, " << chunk_cache_->miss_count()
+             << " misses.  Chunk prefetcher: " << chunk_prefetcher_.hit_count() << " hits from "
+             << chunk_prefetcher_.request_count() << " requests.  Chunk uploader: "
+             << directory_handler_.chunk_uploader().max_queue_depth() << " peak queue depth, "
+             << directory_handler_.chunk_uploader().failure_count()
+             << " failures.  Directory cache: " << directory_handler_.cache_size()
+             << " directories, " << directory_handler_.cache_hit_count() << " hits, "
+             << directory_handler_.cache_miss_count() << " misses.";
 }
 
 template <typename Storage>
@@ -166,27 +283,58 @@ boost::future<void> Drive<Storage>::GetMountFuture() {
 
 template <typename Storage>
 void Drive<Storage>::InitialiseEncryptor(const boost::filesystem::path& relative_path,
-                                         detail::FileContext& file_context) {
+                                         detail::FileContext& file_context,
+                                         const MemoryUsage* reserved_memory) {
   assert(*file_context.open_count == 0 || *file_context.open_count == 1);
   if (!file_context.timer) {
-    file_context.timer.reset(new boost::asio::steady_timer(asio_service_.service()));
+    file_context.timer.reset(new boost::asio::steady_timer(timer_asio_service_.service()));
   } else if (file_context.timer->cancel() > 0) {
     // Encryptor and buffer were about to to be deleted
     assert(file_context.buffer && file_context.self_encryptor);
+    if (reserved_memory)
+      buffer_budget_.Release(*reserved_memory);
     return;
   } else if (file_context.buffer || file_context.self_encryptor) {
     assert(file_context.buffer && file_context.self_encryptor);
+    if (reserved_memory)
+      buffer_budget_.Release(*reserved_memory);
     return;
   }
-  auto buffer_pop_functor([this, relative_path](const std::string& name,
-                                                const NonEmptyString& content) {
-    directory_handler_.HandleDataPoppedFromBuffer(relative_path, name, content);
+  if (!file_context.popped_chunks) {
+    file_context.popped_chunks = std::make_shared<detail::PoppedChunks>(
+        [this](const ImmutableData::Name& name) { storage_->Delete(name); });
+  }
+  std::shared_ptr<detail::PoppedChunks> popped_chunks(file_context.popped_chunks);
+  auto buffer_pop_functor([this, relative_path, popped_chunks](const std::string& name,
+                                                               const NonEmptyString& content) {
+    // Keep a copy at hand, since the encryptor will need to retrieve the chunk to read it back.
+    chunk_cache_->Put(name, content);
+    directory_handler_.HandleDataPoppedFromBuffer(relative_path, name, content, *popped_chunks);
   });
-  auto disk_buffer_path(boost::filesystem::unique_path(*kBufferRoot_ / "%%%%%-%%%%%-%%%%%-%%%%%"));
-  file_context.buffer.reset(new detail::FileContext::Buffer(default_max_buffer_memory_,
-      default_max_buffer_disk_, buffer_pop_functor, disk_buffer_path, true));
+  auto buffer_memory(reserved_memory ? *reserved_memory :
+                                       buffer_budget_.Reserve(std::chrono::seconds(0)));
+  try {
+    auto disk_buffer_path(
+        boost::filesystem::unique_path(*kBufferRoot_ / "%%%%%-%%%%%-%%%%%-%%%%%"));
+    file_context.buffer = detail::FileContext::BufferPtr(
+        new detail::FileContext::Buffer(buffer_memory, default_max_buffer_disk_,
+                                        buffer_pop_functor, disk_buffer_path, true),
+        [this, buffer_memory](detail::FileContext::Buffer* buffer) {
+          delete buffer;
+          buffer_budget_.Release(buffer_memory);
+        });
+  }
+  catch (const std::exception& e) {
+    LOG(kError) << "Failed to create buffer for " << relative_path << ": " << e.what();
+    buffer_budget_.Release(buffer_memory);
+    throw;
+  }
   file_context.self_encryptor.reset(new encrypt::SelfEncryptor(*file_context.meta_data.data_map,
       *file_context.buffer, get_chunk_from_store_));
+  file_context.read_pattern.reset(new detail::ReadPattern);
+  // Chunks of the existing content are already stored, bar the last which is likely to change.
+  file_context.write_pattern.reset(new detail::WritePattern(
+      std::max<size_t>(2, file_context.meta_data.data_map->chunks.size())));
 }
 
 template <typename Storage>
@@ -197,92 +345,183 @@ void Drive<Storage>::ScheduleDeletionOfEncryptor(detail::FileContext* file_conte
     LOG(kInfo) << "Successfully cancelled " << cancelled_count << " encryptor deletion.";
     assert(cancelled_count == 1);
   }
-  auto name(file_context->meta_data.name);
 #endif
   static_cast<void>(cancelled_count);
+  // The file may be reopened, renamed or removed (and its parent with it) before the handler runs,
+  // so the handler mustn't use 'file_context' unless its parent confirms it's still a closed child.
+  std::weak_ptr<detail::Directory> parent(file_context->parent->shared_from_this());
+  const boost::filesystem::path file_name(file_context->meta_data.name);
   file_context->timer->async_wait([=](const boost::system::error_code& ec) {
       if (ec != boost::asio::error::operation_aborted) {
-        if (*file_context->open_count == 0) {
+        // Flushing blocks on the parent's and the file's locks, so is done on the store threads
+        // to leave the timer threads free to fire other files' timers.
+        store_asio_service_.service().post([=] {
+            auto directory(parent.lock());
+            if (directory) {
 #ifndef NDEBUG
-          LOG(kInfo) << "Deleting encryptor and buffer for " << name;
+              LOG(kInfo) << "Deleting encryptor and buffer for " << file_name
+                         << " if still closed";
 #endif
-          file_context->parent->FlushChildAndDeleteEncryptor(file_context);
-        } else {
-          LOG(kWarning) << "About to delete encryptor and buffer for "
-                        << file_context->meta_data.name << " but open_count > 0";
-        }
+              directory->FlushClosedChild(file_name, file_context);
+            }
+        });
       } else {
 #ifndef NDEBUG
-        LOG(kSuccess) << "Timer was cancelled - not deleting encryptor and buffer for " << name;
+        LOG(kSuccess) << "Timer was cancelled - not deleting encryptor and buffer for "
+                      << file_name;
 #endif
       }
   });
 }
 
 template <typename Storage>
-const detail::FileContext* Drive<Storage>::GetContext(
-    const boost::filesystem::path& relative_path) {
-  detail::Directory* parent(directory_handler_.Get(relative_path.parent_path()));
-  return parent->GetChild(relative_path.filename());
+void Drive<Storage>::StoreCompletedChunks(detail::FileContext& file_context, uint64_t offset,
+                                          uint32_t size) {
+  auto& write_pattern(*file_context.write_pattern);
+  const bool sequential(offset == write_pattern.next_offset);
+  write_pattern.next_offset = offset + size;
+  if (!sequential)
+    return;
+  // The last chunk may yet grow, so isn't complete.
+  const auto& chunks(file_context.self_encryptor->data_map().chunks);
+  for (; write_pattern.streamed_until + 1 < chunks.size(); ++write_pattern.streamed_until) {
+    const std::string& name(chunks[write_pattern.streamed_until].hash);
+    if (name.empty())
+      break;  // not yet encrypted
+    NonEmptyString content;
+    try {
+      content = file_context.buffer->Get(name);
+    }
+    catch (const std::exception&) {
+      continue;  // being popped from the buffer, so will be stored by the pop functor
+    }
+    directory_handler_.StoreCompletedChunk(ImmutableData(content),
+                                           file_context.parent->directory_id(),
+                                           *file_context.popped_chunks);
+  }
+}
+
+template <typename Storage>
+void Drive<Storage>::ScheduleRemoteChangesCheck() {
+  remote_changes_timer_.expires_from_now(detail::kRemoteChangesCheckInterval);
+  remote_changes_timer_.async_wait([this](const boost::system::error_code& ec) {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+    directory_handler_.ApplyRemoteChanges();
+    ScheduleRemoteChangesCheck();
+  });
+}
+
+template <typename Storage>
+void Drive<Storage>::ScheduleDirtyDirectoriesSweep() {
+  dirty_directories_timer_.expires_from_now(detail::kDirtyDirectoriesSweepInterval);
+  dirty_directories_timer_.async_wait([this](const boost::system::error_code& ec) {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+    store_asio_service_.service().post([this] { directory_handler_.ScheduleDirtyDirectories(); });
+    ScheduleDirtyDirectoriesSweep();
+  });
+}
+
+template <typename Storage>
+void Drive<Storage>::ApplyToContext(const boost::filesystem::path& relative_path,
+                                    const std::function<bool(detail::FileContext&)>& functor) {
+  SCOPED_PROFILE
+  directory_handler_.Get(relative_path.parent_path())->ApplyToChild(relative_path.filename(),
+                                                                     functor);
 }
 
 template <typename Storage>
 detail::FileContext* Drive<Storage>::GetMutableContext(
     const boost::filesystem::path& relative_path) {
   SCOPED_PROFILE
-  detail::Directory* parent(directory_handler_.Get(relative_path.parent_path()));
+  auto parent(directory_handler_.Get(relative_path.parent_path()));
   return parent->GetMutableChild(relative_path.filename());
 }
 
 template <typename Storage>
-void Drive<Storage>::Create(const boost::filesystem::path& relative_path,
-                            detail::FileContext&& file_context) {
+detail::FileContext* Drive<Storage>::Create(const boost::filesystem::path& relative_path,
+                                            detail::FileContext&& file_context) {
   if (!file_context.meta_data.directory_id) {
-    InitialiseEncryptor(relative_path, file_context);
+    // Creating a file may block for up to 'kBufferBudgetTimeout' if all buffer memory is in use.
+    auto buffer_memory(buffer_budget_.Reserve(detail::kBufferBudgetTimeout));
+    InitialiseEncryptor(relative_path, file_context, &buffer_memory);
     *file_context.open_count = 1;
   }
-  directory_handler_.Add(relative_path, std::move(file_context));
+  return directory_handler_.Add(relative_path, std::move(file_context));
 }
 
 template <typename Storage>
-void Drive<Storage>::Open(const boost::filesystem::path& relative_path) {
-  detail::Directory* parent(directory_handler_.Get(relative_path.parent_path()));
+detail::FileContext* Drive<Storage>::Open(const boost::filesystem::path& relative_path) {
+  auto parent(directory_handler_.Get(relative_path.parent_path()));
   auto file_context(parent->GetMutableChild(relative_path.filename()));
   if (!file_context->meta_data.directory_id) {
+    // Opening a closed file may block for up to 'kBufferBudgetTimeout' if all buffer memory is in
+    // use.  The memory is reserved before the file is locked so that other operations on the file
+    // aren't held up meanwhile.
+    bool needs_buffer(false);
+    {
+      std::lock_guard<std::mutex> lock(*file_context->mutex);
+      needs_buffer = !file_context->buffer;
+    }
+    MemoryUsage buffer_memory(0);
+    if (needs_buffer)
+      buffer_memory = buffer_budget_.Reserve(detail::kBufferBudgetTimeout);
+    std::lock_guard<std::mutex> lock(*file_context->mutex);
     LOG(kInfo) << "Opening " << relative_path << " open count: " << *file_context->open_count + 1;
     if (++(*file_context->open_count) == 1) {
-      std::lock_guard<std::mutex> lock(parent->mutex_);
-      InitialiseEncryptor(relative_path, *file_context);
+      InitialiseEncryptor(relative_path, *file_context, needs_buffer ? &buffer_memory : nullptr);
+    } else if (needs_buffer) {
+      buffer_budget_.Release(buffer_memory);
     }
+  } else {
+    directory_handler_.PrefetchSubdirectories(relative_path);
   }
+  return file_context;
 }
 
 template <typename Storage>
 void Drive<Storage>::Flush(const boost::filesystem::path& relative_path) {
-  auto file_context(GetMutableContext(relative_path));
+  Flush(GetMutableContext(relative_path));
+}
+
+template <typename Storage>
+void Drive<Storage>::Flush(detail::FileContext* file_context) {
+  std::lock_guard<std::mutex> lock(*file_context->mutex);
   if (file_context->self_encryptor && !file_context->self_encryptor->Flush()) {
-    LOG(kError) << "Failed to flush " << relative_path;
+    LOG(kError) << "Failed to flush " << file_context->meta_data.name;
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
   }
 }
 
 template <typename Storage>
-void Drive<Storage>::Release(const boost::filesystem::path& relative_path) {
+void Drive<Storage>::Fsync(detail::FileContext* file_context) {
   SCOPED_PROFILE
-  auto file_context(GetMutableContext(relative_path));
-  if (!file_context->meta_data.directory_id) {
-    LOG(kInfo) << "Releasing " << relative_path << " open count: " << *file_context->open_count - 1;
-    --(*file_context->open_count);
-    if (*file_context->open_count == 0)
-      ScheduleDeletionOfEncryptor(file_context);
-  }
+  // The parent's store flushes the file's encryptor and stores its chunks along with the metadata.
+  GetParent(file_context)->Sync();
 }
 
 template <typename Storage>
-void Drive<Storage>::ReleaseDir(const boost::filesystem::path& relative_path) {
+void Drive<Storage>::FsyncDir(const boost::filesystem::path& relative_path) {
   SCOPED_PROFILE
-  auto directory(directory_handler_.Get(relative_path));
-  directory->ResetChildrenCounter();
+  directory_handler_.Get(relative_path)->Sync();
+}
+
+template <typename Storage>
+void Drive<Storage>::Release(const boost::filesystem::path& relative_path) {
+  Release(GetMutableContext(relative_path));
+}
+
+template <typename Storage>
+void Drive<Storage>::Release(detail::FileContext* file_context) {
+  SCOPED_PROFILE
+  if (!file_context->meta_data.directory_id) {
+    std::lock_guard<std::mutex> lock(*file_context->mutex);
+    LOG(kInfo) << "Releasing " << file_context->meta_data.name << " open count: "
+               << *file_context->open_count - 1;
+    if (--(*file_context->open_count) == 0)
+      ScheduleDeletionOfEncryptor(file_context);
+  }
 }
 
 template <typename Storage>
@@ -299,12 +538,24 @@ void Drive<Storage>::Rename(const boost::filesystem::path& old_relative_path,
 template <typename Storage>
 uint32_t Drive<Storage>::Read(const boost::filesystem::path& relative_path, char* data,
                               uint32_t size, uint64_t offset) {
-  auto file_context(GetContext(relative_path));
+  return Read(GetMutableContext(relative_path), data, size, offset);
+}
+
+template <typename Storage>
+uint32_t Drive<Storage>::Read(const detail::FileContext* file_context, char* data, uint32_t size,
+                              uint64_t offset) {
+  std::lock_guard<std::mutex> lock(*file_context->mutex);
   assert(file_context->self_encryptor);
-  LOG(kInfo) << "For "  << relative_path << ", reading " << size << " of "
+  LOG(kInfo) << "For "  << file_context->meta_data.name << ", reading " << size << " of "
              << file_context->self_encryptor->size() << " bytes at offset " << offset;
+  if (file_context->read_pattern)
+    chunk_prefetcher_.FetchRange(file_context->self_encryptor->data_map(), offset, size);
   if (!file_context->self_encryptor->Read(data, size, offset))
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+  if (file_context->read_pattern) {
+    chunk_prefetcher_.NotifyRead(file_context->self_encryptor->data_map(), offset, size,
+                                 *file_context->read_pattern);
+  }
   // TODO(Fraser#5#): 2013-12-02 - Update last access time?
   if (offset + size > file_context->self_encryptor->size()) {
     return offset > file_context->self_encryptor->size() ? 0 :
@@ -317,22 +568,119 @@ uint32_t Drive<Storage>::Read(const boost::filesystem::path& relative_path, char
 template <typename Storage>
 uint32_t Drive<Storage>::Write(const boost::filesystem::path& relative_path, const char* data,
                                uint32_t size, uint64_t offset) {
-  auto file_context(GetMutableContext(relative_path));
-  assert(file_context->self_encryptor);
-  LOG(kInfo) << "For "  << relative_path << ", writing " << size << " bytes at offset " << offset;
-  if (!file_context->self_encryptor->Write(data, size, offset))
-    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
-  // TODO(Fraser#5#): 2013-12-02 - Update last write time?
+  return Write(GetMutableContext(relative_path), data, size, offset);
+}
+
+template <typename Storage>
+uint32_t Drive<Storage>::Write(detail::FileContext* file_context, const char* data, uint32_t size,
+                               uint64_t offset) {
+  std::shared_ptr<detail::Directory> parent;
+  {
+    std::lock_guard<std::mutex> lock(*file_context->mutex);
+    assert(file_context->self_encryptor);
+    parent = file_context->parent->shared_from_this();
+    LOG(kInfo) << "For "  << file_context->meta_data.name << ", writing " << size
+               << " bytes at offset " << offset;
+    if (!file_context->self_encryptor->Write(data, size, offset))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+    StoreCompletedChunks(*file_context, offset, size);
+    // TODO(Fraser#5#): 2013-12-02 - Update last write time?
 #ifndef MAIDSAFE_WIN32
-  int64_t max_size(
-      std::max(static_cast<off_t>(offset + size), file_context->meta_data.attributes.st_size));
-  file_context->meta_data.attributes.st_size = max_size;
-  file_context->meta_data.attributes.st_blocks = file_context->meta_data.attributes.st_size / 512;
+    int64_t max_size(
+        std::max(static_cast<off_t>(offset + size), file_context->meta_data.attributes.st_size));
+    file_context->meta_data.attributes.st_size = max_size;
+    file_context->meta_data.attributes.st_blocks = file_context->meta_data.attributes.st_size / 512;
 #endif
-  file_context->parent->ScheduleForStoring();
+  }
+  directory_handler_.MarkDirty(*parent);
   return size;
 }
 
+template <typename Storage>
+uint64_t Drive<Storage>::CopyRange(detail::FileContext* source, uint64_t source_offset,
+                                   detail::FileContext* destination, uint64_t destination_offset,
+                                   uint64_t size) {
+  if (source == destination || source->meta_data.directory_id ||
+      destination->meta_data.directory_id) {
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  }
+  uint64_t source_size(0), destination_size(0);
+  {
+    std::lock_guard<std::mutex> lock(*source->mutex);
+    source_size = source->self_encryptor ? source->self_encryptor->size() :
+                                           source->meta_data.data_map->size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(*destination->mutex);
+    assert(destination->self_encryptor);
+    destination_size = destination->self_encryptor->size();
+  }
+  if (source_offset >= source_size)
+    return 0;
+  size = std::min(size, source_size - source_offset);
+
+  if (source_offset == 0 && destination_offset == 0 && size == source_size &&
+      destination_size <= source_size) {
+    Clone(source, destination);
+    return size;
+  }
+
+  LOG(kInfo) << "Copying " << size << " bytes from " << source->meta_data.name << " to "
+             << destination->meta_data.name << " via read and write.";
+  const uint32_t kBufferSize(1024 * 1024);
+  std::vector<char> buffer(static_cast<size_t>(std::min<uint64_t>(size, kBufferSize)));
+  uint64_t copied(0);
+  while (copied < size) {
+    auto to_copy(static_cast<uint32_t>(std::min<uint64_t>(size - copied, buffer.size())));
+    auto read(Read(source, buffer.data(), to_copy, source_offset + copied));
+    if (read == 0)
+      break;
+    Write(destination, buffer.data(), read, destination_offset + copied);
+    copied += read;
+  }
+  return copied;
+}
+
+template <typename Storage>
+void Drive<Storage>::Clone(detail::FileContext* source, detail::FileContext* destination) {
+  // The source is flushed and its data map copied with both files locked, so a write racing with
+  // the clone is either wholly included in it or wholly after it.  Flushing also stores any of the
+  // source's chunks which are only held in its buffer, since the destination's encryptor will
+  // retrieve them from storage.
+  GetParent(source)->FlushChildAndApply(source, *destination->mutex, [&] {
+    assert(destination->self_encryptor && destination->buffer);
+    LOG(kInfo) << "Cloning " << source->meta_data.name << " to " << destination->meta_data.name;
+    // Chunks stored for the destination's previous contents aren't referenced by the cloned data
+    // map, so they're deleted now rather than being claimed by (or deleted from under) the cloned
+    // chunks at the destination's next flush.
+    if (destination->popped_chunks)
+      destination->popped_chunks->DeleteUntaken();
+    destination->self_encryptor.reset();
+    *destination->meta_data.data_map = *source->meta_data.data_map;
+    destination->self_encryptor.reset(new encrypt::SelfEncryptor(
+        *destination->meta_data.data_map, *destination->buffer, get_chunk_from_store_));
+    // As for a newly-opened file, the cloned chunks are already stored.
+    destination->write_pattern.reset(new detail::WritePattern(
+        std::max<size_t>(2, destination->meta_data.data_map->chunks.size())));
+#ifdef MAIDSAFE_WIN32
+    destination->meta_data.end_of_file = source->meta_data.end_of_file;
+    destination->meta_data.allocation_size = source->meta_data.allocation_size;
+#else
+    destination->meta_data.attributes.st_size = source->meta_data.attributes.st_size;
+    destination->meta_data.attributes.st_blocks = source->meta_data.attributes.st_blocks;
+#endif
+    destination->meta_data.UpdateLastModifiedTime();
+  });
+  GetParent(destination)->ScheduleForStoring();
+}
+
+template <typename Storage>
+std::shared_ptr<detail::Directory> Drive<Storage>::GetParent(
+    detail::FileContext* file_context) const {
+  std::lock_guard<std::mutex> lock(*file_context->mutex);
+  return file_context->parent->shared_from_this();
+}
+
 }  // namespace drive
 
 }  // namespace maidsafe
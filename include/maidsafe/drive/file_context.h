@@ -19,16 +19,22 @@
 #ifndef MAIDSAFE_DRIVE_FILE_CONTEXT_H_
 #define MAIDSAFE_DRIVE_FILE_CONTEXT_H_
 
+#include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include "boost/asio/steady_timer.hpp"
 #include "boost/filesystem/path.hpp"
 
 #include "maidsafe/common/config.h"
+#include "maidsafe/common/data_types/immutable_data.h"
 #include "maidsafe/common/data_stores/data_buffer.h"
 #include "maidsafe/encrypt/self_encryptor.h"
 
+#include "maidsafe/drive/chunk_prefetcher.h"
 #include "maidsafe/drive/meta_data.h"
 
 namespace maidsafe {
@@ -39,8 +45,49 @@ namespace detail {
 
 class Directory;
 
+// The write history of an open file, used to store chunks of sequentially-written files before the
+// file is flushed.  Protected by the file's mutex.
+struct WritePattern {
+  explicit WritePattern(size_t first_chunk_index)
+      : next_offset(0), streamed_until(first_chunk_index) {}
+  uint64_t next_offset;
+  // Index of the first chunk of the data map not yet considered for storing.
+  size_t streamed_until;
+};
+
+// Chunks popped from a file's buffer (when it overflows) or completed during sequential writes are
+// stored before the file is flushed and recorded here, so that the next flush of the file neither
+// stores them again nor leaks those no longer referenced by its data map.  The buffer pops chunks
+// on its own thread, so this has its own mutex rather than relying on the file's.
+class PoppedChunks {
+ public:
+  explicit PoppedChunks(std::function<void(const ImmutableData::Name&)> delete_chunk_functor);
+  // Called once a chunk has been stored or queued for storing.
+  void Add(const std::string& name);
+  // If a stored copy of 'name' is recorded, claims it as referenced by the data map being flushed.
+  bool Take(const std::string& name);
+  // Claims a copy of 'name' which is being popped but hasn't yet been added.
+  void Expect(const std::string& name);
+  // Deletes all stored copies not taken since the last call.
+  void DeleteUntaken();
+
+ private:
+  PoppedChunks(const PoppedChunks&);
+  PoppedChunks& operator=(const PoppedChunks&);
+
+  std::function<void(const ImmutableData::Name&)> delete_chunk_functor_;
+  std::mutex mutex_;
+  std::map<std::string, int> stored_, expected_;
+};
+
+// Lock ordering: a FileContext's 'mutex' protects its 'meta_data', 'buffer', 'self_encryptor',
+// 'read_pattern', 'write_pattern', 'popped_chunks' (the pointer, not the pointee), 'timer' and
+// 'parent' (which a rename can change).  It may be acquired while holding the parent Directory's
+// mutex, but never the other way round.
 struct FileContext {
   typedef data_stores::DataBuffer<std::string> Buffer;
+  // The deleter allows the buffer's share of the drive's buffer budget to be returned with it.
+  typedef std::unique_ptr<Buffer, std::function<void(Buffer*)>> BufferPtr;  // NOLINT
 
   FileContext();
   FileContext(FileContext&& other);
@@ -50,10 +97,14 @@ struct FileContext {
   ~FileContext();
 
   MetaData meta_data;
-  std::unique_ptr<Buffer> buffer;
+  BufferPtr buffer;
   std::unique_ptr<encrypt::SelfEncryptor> self_encryptor;
+  std::unique_ptr<ReadPattern> read_pattern;
+  std::unique_ptr<WritePattern> write_pattern;
+  std::shared_ptr<PoppedChunks> popped_chunks;
   std::unique_ptr<boost::asio::steady_timer> timer;
   std::unique_ptr<std::atomic<int>> open_count;
+  std::unique_ptr<std::mutex> mutex;
   Directory* parent;
   bool flushed;
 };
@@ -0,0 +1,114 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+
+#ifndef MAIDSAFE_DRIVE_METADATA_SNAPSHOT_H_
+#define MAIDSAFE_DRIVE_METADATA_SNAPSHOT_H_
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/common/types.h"
+#include "maidsafe/common/data_types/structured_data_versions.h"
+
+#include "maidsafe/drive/config.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+// The serialised listings of a drive's directories, each with the versions it was stored or
+// retrieved with, kept on disk between mounts so that a directory unchanged since it was last seen
+// can be loaded without fetching it from storage.  Listings are only served for the version
+// currently at the tip of the directory's tree, so the snapshot never hides changes made by other
+// clients.
+//
+// Each listing is written to its own file when put, and only the tip version of each is held in
+// memory.  Beyond 'max_entries' listings, the least recently used are dropped.  Files are encrypted
+// and authenticated (AES-256-GCM) with keys derived from 'secret', which must come from the user's
+// credentials; a file which fails to authenticate is discarded.
+class MetadataSnapshot {
+ public:
+  // Loads the snapshot of the drive identified by 'unique_user_id' and 'root_parent_id' from
+  // 'snapshot_dir' if there is one.
+  MetadataSnapshot(const boost::filesystem::path& snapshot_dir, const Identity& unique_user_id,
+                   const Identity& root_parent_id, const NonEmptyString& secret,
+                   size_t max_entries = kMaxSnapshotDirectories);
+
+  // Returns true and sets 'serialised_listing' and 'versions' (newest first) if the listing of
+  // 'directory_id' is held for 'version_tip'.
+  bool Get(const DirectoryId& directory_id, const StructuredDataVersions::VersionName& version_tip,
+           std::string& serialised_listing,
+           std::vector<StructuredDataVersions::VersionName>& versions);
+  // 'versions' must be newest first, and not empty.
+  void Put(const DirectoryId& directory_id,
+           const std::vector<StructuredDataVersions::VersionName>& versions,
+           const std::string& serialised_listing);
+  void Remove(const DirectoryId& directory_id);
+
+  size_t size() const;
+  uint64_t hit_count() const;
+  uint64_t miss_count() const;
+
+ private:
+  MetadataSnapshot(const MetadataSnapshot&);
+  MetadataSnapshot(MetadataSnapshot&&);
+  MetadataSnapshot& operator=(MetadataSnapshot);
+
+  struct Entry {
+    Entry(const StructuredDataVersions::VersionName& version_tip_in,
+          std::list<DirectoryId>::iterator lru_itr_in)
+        : version_tip(version_tip_in), lru_itr(lru_itr_in) {}
+    StructuredDataVersions::VersionName version_tip;
+    std::list<DirectoryId>::iterator lru_itr;
+  };
+
+  void Load();
+  // The following must be called with 'mutex_' locked.
+  boost::filesystem::path EntryPath(const DirectoryId& directory_id) const;
+  void Erase(std::map<DirectoryId, Entry>::iterator itr);
+  void EvictExcess();
+
+  std::string Encrypt(const std::string& plain_text) const;
+  // Throws if 'cipher_text' fails to authenticate.
+  std::string Decrypt(const std::string& cipher_text) const;
+
+  const std::string kEncryptionKey_, kNameKey_;
+  const boost::filesystem::path kDir_;
+  const size_t kMaxEntries_;
+  mutable std::mutex mutex_;
+  std::map<DirectoryId, Entry> entries_;
+  std::list<DirectoryId> lru_;  // least recently used first
+  uint64_t hit_count_, miss_count_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_METADATA_SNAPSHOT_H_
@@ -36,6 +36,8 @@
 
 #include "maidsafe/nfs/client/maid_node_nfs.h"
 
+#include "maidsafe/drive/config.h"
+
 namespace maidsafe {
 
 namespace drive {
@@ -83,7 +85,12 @@ struct Options {
               create_store(false), check_data(false), monitor_parent(true),
               drive_type(DriveType::kNetwork),
               drive_logging_args(), mount_status_shared_object_name(), peer_endpoint(),
-              encrypted_maid(), symm_key(), symm_iv(), parent_handle(nullptr) {}
+              encrypted_maid(), symm_key(), symm_iv(), parent_handle(nullptr),
+              max_write(detail::kDefaultMaxWrite), max_readahead(detail::kDefaultMaxReadahead),
+              max_background(detail::kDefaultMaxBackground),
+              attribute_timeout(detail::kDefaultAttributeTimeout),
+              entry_timeout(detail::kDefaultEntryTimeout),
+              negative_timeout(detail::kDefaultNegativeTimeout) {}
   boost::filesystem::path mount_path, storage_path, keys_path, drive_name;
   int key_index;
   Identity unique_id, root_parent_id;
@@ -92,6 +99,10 @@ struct Options {
   std::string drive_logging_args, mount_status_shared_object_name, peer_endpoint,
               encrypted_maid, symm_key, symm_iv;
   void* parent_handle;
+  // FUSE transfer limits negotiated in OpsInit (ignored on Windows).
+  uint32_t max_write, max_readahead, max_background;
+  // Kernel cache timeouts in seconds (ignored on Windows).
+  double attribute_timeout, entry_timeout, negative_timeout;
 };
 
 class Launcher {
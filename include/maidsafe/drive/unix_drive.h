@@ -19,14 +19,19 @@
 #ifndef MAIDSAFE_DRIVE_UNIX_DRIVE_H_
 #define MAIDSAFE_DRIVE_UNIX_DRIVE_H_
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <cstdio>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include "boost/filesystem/path.hpp"
 #include "boost/thread/future.hpp"
@@ -41,6 +46,7 @@
 
 #include "maidsafe/common/on_scope_exit.h"
 
+#include "maidsafe/drive/copy_range.h"
 #include "maidsafe/drive/drive.h"
 #include "maidsafe/drive/file_context.h"
 #include "maidsafe/drive/utils.h"
@@ -78,6 +84,48 @@ inline std::string GetFileType(mode_t mode) {
   return "";
 }
 
+// Open files are identified by their FileContext, which is stored in the file handle when the file
+// is created or opened.  This lets operations on open files avoid resolving the path.
+inline void SetFileContext(FileContext* file_context, struct fuse_file_info* file_info) {
+  file_info->fh = reinterpret_cast<uint64_t>(file_context);
+}
+
+inline FileContext* GetFileContext(struct fuse_file_info* file_info) {
+  assert(file_info && file_info->fh != 0);
+  return reinterpret_cast<FileContext*>(file_info->fh);
+}
+
+// Each open directory handle has its own readdir cursor.  Offsets passed to the filler are the
+// 1-based positions of the entries ('.' is 1 and '..' is 2).  Listing resumes after the name of
+// the last entry returned, so children added or removed during a listing neither restart nor
+// corrupt it.
+struct DirectoryCursor {
+  DirectoryCursor() : offset(0), last_name() {}
+  off_t offset;
+  boost::filesystem::path last_name;
+};
+
+inline DirectoryCursor* GetDirectoryCursor(struct fuse_file_info* file_info) {
+  assert(file_info && file_info->fh != 0);
+  return reinterpret_cast<DirectoryCursor*>(file_info->fh);
+}
+
+// Returns true if the calling process may access a file with 'attributes' as 'mask' (a combination
+// of R_OK, W_OK and X_OK) asks, as the kernel's 'default_permissions' check would (bar
+// supplementary groups).  Only needed for paths the kernel hasn't checked itself, e.g. those passed
+// in an ioctl.
+inline bool IsPermitted(const struct stat& attributes, int mask) {
+  const struct fuse_context* context(fuse_get_context());
+  if (context->uid == 0)
+    return (mask & X_OK) == 0 || (attributes.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+  mode_t granted(attributes.st_mode & S_IRWXO);
+  if (context->uid == attributes.st_uid)
+    granted = (attributes.st_mode & S_IRWXU) >> 6;
+  else if (context->gid == attributes.st_gid)
+    granted = (attributes.st_mode & S_IRWXG) >> 3;
+  return (granted & mask) == static_cast<mode_t>(mask);
+}
+
 // template <typename Storage>
 // bool ForceFlush(RootHandler<Storage>& root_handler, FileContext<Storage>* file_context) {
 //   assert(file_context);
@@ -101,9 +149,15 @@ class FuseDrive : public Drive<Storage> {
   FuseDrive(std::shared_ptr<Storage> storage, const Identity& unique_user_id,
             const Identity& root_parent_id, const boost::filesystem::path& mount_dir,
             const boost::filesystem::path& user_app_dir, const boost::filesystem::path& drive_name,
-            const std::string& mount_status_shared_object_name, bool create);
+            const std::string& mount_status_shared_object_name, bool create,
+            const std::string& snapshot_secret = std::string());
 
   virtual ~FuseDrive();
+  // Sets the transfer limits requested from the kernel in OpsInit.  Must be called before 'Mount'.
+  void SetTransferLimits(uint32_t max_write, uint32_t max_readahead, uint32_t max_background);
+  // Sets the times (in seconds) for which the kernel may cache attributes, name lookups and failed
+  // name lookups.  Must be called before 'Mount'.
+  void SetCacheTimeouts(double attribute_timeout, double entry_timeout, double negative_timeout);
   virtual void Mount();
   virtual void Unmount();
 
@@ -120,6 +174,10 @@ class FuseDrive : public Drive<Storage> {
   static int OpsChown(const char* path, uid_t uid, gid_t gid);
   static int OpsCreate(const char* path, mode_t mode, struct fuse_file_info* file_info);
   static void OpsDestroy(void* fuse);
+#if FUSE_VERSION >= 29 && defined(FALLOC_FL_PUNCH_HOLE)
+  static int OpsFallocate(const char* path, int mode, off_t offset, off_t length,
+                          struct fuse_file_info* file_info);
+#endif
   static int OpsFgetattr(const char* path, struct stat* stbuf, struct fuse_file_info* file_info);
   static int OpsFlush(const char* path, struct fuse_file_info* file_info);
   static int OpsFsync(const char* path, int isdatasync, struct fuse_file_info* file_info);
@@ -127,6 +185,10 @@ class FuseDrive : public Drive<Storage> {
   static int OpsFtruncate(const char* path, off_t size, struct fuse_file_info* file_info);
   static int OpsGetattr(const char* path, struct stat* stbuf);
   static void* OpsInit(struct fuse_conn_info* conn);
+#if FUSE_VERSION >= 28
+  static int OpsIoctl(const char* path, int cmd, void* arg, struct fuse_file_info* file_info,
+                      unsigned int flags, void* data);
+#endif
 //  static int OpsLink(const char* to, const char* from);
 //  static int OpsLock(const char* path, struct fuse_file_info* file_info, int cmd,
 //                     struct flock* lock);
@@ -150,6 +212,10 @@ class FuseDrive : public Drive<Storage> {
   static int OpsUtimens(const char* path, const struct timespec ts[2]);
   static int OpsWrite(const char* path, const char* buf, size_t size, off_t offset,
                       struct fuse_file_info* file_info);
+#if FUSE_VERSION >= 29
+  static int OpsWriteBuf(const char* path, struct fuse_bufvec* buf, off_t offset,
+                         struct fuse_file_info* file_info);
+#endif
 
 // We can set extended attribute for our own purposes, i.e. if we wanted to store extra info
 // (revisions for instance) then we can do it here.
@@ -161,15 +227,24 @@ class FuseDrive : public Drive<Storage> {
 //                         int flags);
 #endif  // HAVE_SETXATTR
 
-  static int CreateNew(const fs::path& full_path, mode_t mode, dev_t rdev = 0);
+  static int CreateNew(const fs::path& full_path, mode_t mode, dev_t rdev = 0,
+                       struct fuse_file_info* file_info = nullptr);
   static int GetAttributes(const char* path, struct stat* stbuf);
+  static int GetAttributes(const detail::FileContext* file_context, struct stat* stbuf);
+  // Returns true if the caller may search each directory leading to 'path' and read 'path' itself.
+  static bool MayRead(const fs::path& path);
   static int Truncate(const char* path, off_t size);
+  static int Truncate(detail::FileContext* file_context, off_t size);
+  // Sets 'length' bytes at 'offset' to zero without changing the file's size.
+  static int ZeroRange(detail::FileContext* file_context, off_t offset, off_t length);
 
   static struct fuse_operations maidsafe_ops_;
   struct fuse* fuse_;
   fuse_chan* fuse_channel_;
   fs::path fuse_mountpoint_;
   std::string drive_name_;
+  uint32_t max_write_, max_readahead_, max_background_;
+  double attribute_timeout_, entry_timeout_, negative_timeout_;
   std::once_flag mounted_once_flag_;
   std::thread unmount_ipc_waiter_;
 };
@@ -188,13 +263,20 @@ FuseDrive<Storage>::FuseDrive(std::shared_ptr<Storage> storage, const Identity&
                               const boost::filesystem::path& mount_dir,
                               const boost::filesystem::path& user_app_dir,
                               const boost::filesystem::path& drive_name,
-                              const std::string& mount_status_shared_object_name, bool create)
+                              const std::string& mount_status_shared_object_name, bool create,
+                              const std::string& snapshot_secret)
     : Drive<Storage>(storage, unique_user_id, root_parent_id, mount_dir, user_app_dir,
-                     mount_status_shared_object_name, create),
+                     mount_status_shared_object_name, create, snapshot_secret),
       fuse_(nullptr),
       fuse_channel_(nullptr),
       fuse_mountpoint_(mount_dir),
       drive_name_(drive_name.string()),
+      max_write_(detail::kDefaultMaxWrite),
+      max_readahead_(detail::kDefaultMaxReadahead),
+      max_background_(detail::kDefaultMaxBackground),
+      attribute_timeout_(detail::kDefaultAttributeTimeout),
+      entry_timeout_(detail::kDefaultEntryTimeout),
+      negative_timeout_(detail::kDefaultNegativeTimeout),
       mounted_once_flag_(),
       unmount_ipc_waiter_() {
   fs::create_directory(fuse_mountpoint_);
@@ -217,13 +299,19 @@ void FuseDrive<Storage>::Init() {
   maidsafe_ops_.chown = OpsChown;
   maidsafe_ops_.create = OpsCreate;
   maidsafe_ops_.destroy = OpsDestroy;
+#if FUSE_VERSION >= 29 && defined(FALLOC_FL_PUNCH_HOLE)
+  maidsafe_ops_.fallocate = OpsFallocate;
+#endif
   maidsafe_ops_.fgetattr = OpsFgetattr;
   maidsafe_ops_.flush = OpsFlush;
-//  maidsafe_ops_.fsync = OpsFsync;
-//  maidsafe_ops_.fsyncdir = OpsFsyncDir;
+  maidsafe_ops_.fsync = OpsFsync;
+  maidsafe_ops_.fsyncdir = OpsFsyncDir;
   maidsafe_ops_.ftruncate = OpsFtruncate;
   maidsafe_ops_.getattr = OpsGetattr;
   maidsafe_ops_.init = OpsInit;
+#if FUSE_VERSION >= 28
+  maidsafe_ops_.ioctl = OpsIoctl;
+#endif
 //  maidsafe_ops_.link = OpsLink;
 //  maidsafe_ops_.lock = OpsLock;
   maidsafe_ops_.mkdir = OpsMkdir;
@@ -243,6 +331,9 @@ void FuseDrive<Storage>::Init() {
   maidsafe_ops_.unlink = OpsUnlink;
   maidsafe_ops_.utimens = OpsUtimens;
   maidsafe_ops_.write = OpsWrite;
+#if FUSE_VERSION >= 29
+  maidsafe_ops_.write_buf = OpsWriteBuf;
+#endif
 
 #ifdef HAVE_SETXATTR
   maidsafe_ops_.getxattr = OpsGetxattr;
@@ -268,6 +359,22 @@ void FuseDrive<Storage>::SetMounted() {
   });
 }
 
+template <typename Storage>
+void FuseDrive<Storage>::SetTransferLimits(uint32_t max_write, uint32_t max_readahead,
+                                           uint32_t max_background) {
+  max_write_ = max_write;
+  max_readahead_ = max_readahead;
+  max_background_ = max_background;
+}
+
+template <typename Storage>
+void FuseDrive<Storage>::SetCacheTimeouts(double attribute_timeout, double entry_timeout,
+                                          double negative_timeout) {
+  attribute_timeout_ = attribute_timeout;
+  entry_timeout_ = entry_timeout;
+  negative_timeout_ = negative_timeout;
+}
+
 template <typename Storage>
 void FuseDrive<Storage>::Mount() {
   fuse_args args = FUSE_ARGS_INIT(0, nullptr);
@@ -281,14 +388,27 @@ void FuseDrive<Storage>::Mount() {
 #endif
   // NB - If we remove -odefault_permissions, we must check in OpsOpen, etc. that the operation is
   //      permitted for the given flags.  We also need to implement OpsAccess.
-  fuse_opt_add_arg(&args, "-odefault_permissions,kernel_cache");
+  // 'auto_cache' makes the kernel keep a file's cached pages across opens only while its size and
+  // modification time are unchanged, so changes applied from other clients are picked up.
+  fuse_opt_add_arg(&args, "-odefault_permissions,auto_cache");
+  // Allow writes larger than a single page; the final limits are negotiated in OpsInit.
+  std::string transfer_arg("-obig_writes,max_write=" + std::to_string(max_write_) +
+                           ",max_readahead=" + std::to_string(max_readahead_));
+  fuse_opt_add_arg(&args, (transfer_arg.c_str()));
+  // Without these, the kernel revalidates attributes and lookups roughly every second, each costing
+  // a full path resolution.
+  std::string timeout_arg("-oattr_timeout=" + std::to_string(attribute_timeout_) +
+                          ",entry_timeout=" + std::to_string(entry_timeout_) +
+                          ",negative_timeout=" + std::to_string(negative_timeout_));
+  fuse_opt_add_arg(&args, (timeout_arg.c_str()));
 #ifndef NDEBUG
   // fuse_opt_add_arg(&args, "-d");  // print debug info
   // fuse_opt_add_arg(&args, "-f");  // run in foreground
 #endif
   // TODO(Fraser#5#): 2014-01-08 - BEFORE_RELEASE Avoid running in foreground.
   fuse_opt_add_arg(&args, "-f");  // run in foreground
-  fuse_opt_add_arg(&args, "-s");  // run single threaded
+  // Requests are dispatched on multiple threads (fuse_loop_mt).  See the locking model described in
+  // drive.h.
 
   // tag the volume as "local" to make it appear on the Desktop and in Finder's sidebar.
   // fuse_opt_add_arg(&args, "-olocal");
@@ -376,10 +496,11 @@ template <typename Storage>
 int FuseDrive<Storage>::OpsChmod(const char* path, mode_t mode) {
   LOG(kInfo) << "OpsChmod: " << path << ", to " << std::oct << mode;
   try {
-    auto file_context(Global<Storage>::g_fuse_drive->GetMutableContext(path));
-    file_context->meta_data.attributes.st_mode = mode;
-    time(&file_context->meta_data.attributes.st_ctime);
-    file_context->parent->ScheduleForStoring();
+    Global<Storage>::g_fuse_drive->ApplyToContext(path, [mode](detail::FileContext& file_context) {
+      file_context.meta_data.attributes.st_mode = mode;
+      time(&file_context.meta_data.attributes.st_ctime);
+      return true;
+    });
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to chmod " << path << ": " << e.what();
@@ -399,13 +520,14 @@ int FuseDrive<Storage>::OpsChown(const char* path, uid_t uid, gid_t gid) {
   if (!change_uid && !change_gid)
     return 0;
   try {
-    auto file_context(Global<Storage>::g_fuse_drive->GetMutableContext(path));
-    if (change_uid)
-      file_context->meta_data.attributes.st_uid = uid;
-    if (change_gid)
-      file_context->meta_data.attributes.st_gid = gid;
-    time(&file_context->meta_data.attributes.st_ctime);
-    file_context->parent->ScheduleForStoring();
+    Global<Storage>::g_fuse_drive->ApplyToContext(path, [&](detail::FileContext& file_context) {
+      if (change_uid)
+        file_context.meta_data.attributes.st_uid = uid;
+      if (change_gid)
+        file_context.meta_data.attributes.st_gid = gid;
+      time(&file_context.meta_data.attributes.st_ctime);
+      return true;
+    });
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to chown " << path << ": " << e.what();
@@ -423,10 +545,10 @@ int FuseDrive<Storage>::OpsChown(const char* path, uid_t uid, gid_t gid) {
 // and open() methods will be called instead.
 template <typename Storage>
 int FuseDrive<Storage>::OpsCreate(const char* path, mode_t mode,
-                                  struct fuse_file_info* /*file_info*/) {
+                                  struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsCreate: " << path << " (" << detail::GetFileType(mode) << "), mode: "
              << std::oct << mode;
-  return Global<Storage>::g_fuse_drive->CreateNew(path, mode);
+  return Global<Storage>::g_fuse_drive->CreateNew(path, mode, 0, file_info);
 }
 
 // Quote from FUSE documentation:
@@ -439,6 +561,45 @@ void FuseDrive<Storage>::OpsDestroy(void* /*fuse*/) {
   LOG(kInfo) << "OpsDestroy";
 }
 
+#if FUSE_VERSION >= 29 && defined(FALLOC_FL_PUNCH_HOLE)
+// Quote from FUSE documentation:
+//
+// Allocates space for an open file
+//
+// This function ensures that required space is allocated for specified file.  If this function
+// returns success then any subsequent write request to specified range is guaranteed not to fail
+// because of lack of space on the file system media.
+//
+// Space isn't reserved in the network, so allocation only extends the file (unless KEEP_SIZE is
+// given).  Zeroed ranges are still encrypted, but identical zero chunks are only stored once.
+template <typename Storage>
+int FuseDrive<Storage>::OpsFallocate(const char* path, int mode, off_t offset, off_t length,
+                                     struct fuse_file_info* file_info) {
+  LOG(kInfo) << "OpsFallocate: " << path << ", mode: 0x" << std::hex << mode << std::dec
+             << ", offset: " << offset << ", length: " << length;
+  if (offset < 0 || length <= 0)
+    return -EINVAL;
+  const bool keep_size((mode & FALLOC_FL_KEEP_SIZE) != 0);
+  const bool punch_hole((mode & FALLOC_FL_PUNCH_HOLE) != 0);
+  if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 || (punch_hole && !keep_size))
+    return -EOPNOTSUPP;
+
+  auto file_context(detail::GetFileContext(file_info));
+  if (punch_hole)
+    return ZeroRange(file_context, offset, length);
+  if (keep_size)
+    return 0;
+
+  off_t file_size(0);
+  {
+    std::lock_guard<std::mutex> lock(*file_context->mutex);
+    assert(file_context->self_encryptor);
+    file_size = static_cast<off_t>(file_context->self_encryptor->size());
+  }
+  return (offset + length > file_size) ? Truncate(file_context, offset + length) : 0;
+}
+#endif
+
 // Quote from FUSE documentation:
 //
 // Get attributes from an open file.
@@ -449,9 +610,9 @@ void FuseDrive<Storage>::OpsDestroy(void* /*fuse*/) {
 // it may be called for invocations of fstat() too.
 template <typename Storage>
 int FuseDrive<Storage>::OpsFgetattr(const char* path, struct stat* stbuf,
-                                    struct fuse_file_info* /*file_info*/) {
+                                    struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsFgetattr: " << path;
-  return GetAttributes(path, stbuf);
+  return GetAttributes(detail::GetFileContext(file_info), stbuf);
 }
 
 // Quote from FUSE documentation:
@@ -475,7 +636,7 @@ template <typename Storage>
 int FuseDrive<Storage>::OpsFlush(const char* path, struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsFlush: " << path << ", flags: " << file_info->flags;
   try {
-    Global<Storage>::g_fuse_drive->Flush(path);
+    Global<Storage>::g_fuse_drive->Flush(detail::GetFileContext(file_info));
   }
   catch (const drive_error& error) {
     LOG(kError) << "OpsFlush: " << fs::path(path) << ": " << error.what();
@@ -488,7 +649,6 @@ int FuseDrive<Storage>::OpsFlush(const char* path, struct fuse_file_info* file_i
   return 0;
 }
 
-/*
 // Quote from FUSE documentation:
 //
 // Synchronize file contents
@@ -498,27 +658,18 @@ int FuseDrive<Storage>::OpsFlush(const char* path, struct fuse_file_info* file_i
 template <typename Storage>
 int FuseDrive<Storage>::OpsFsync(const char* path, int isdatasync,
                                  struct fuse_file_info* file_info) {
-  LOG(kInfo) << "OpsFsync: " << path;
-  detail::FileContext<Storage>* file_context(detail::RecoverFileContext<Storage>(file_info));
-  if (!file_context)
-    return -EINVAL;
-
-  // if (!detail::ForceFlush(Global<Storage>::g_fuse_drive->directory_handler_, file_context)) {
-  //   //    int result(Update(Global<Storage>::g_fuse_drive->directory_handler_,
-  //   //                      file_context,
-  //   //                      false,
-  //   //                      (isdatasync == 0)));
-  //   //    if (result != kSuccess) {
-  //   //      LOG(kError) << "OpsFsync: " << path << ", failed to update "
-  //   //                  << "metadata.  Result: " << result;
-  //   //      return -EIO;
-  //   //    }
-  // }
+  LOG(kInfo) << "OpsFsync: " << path << ", datasync: " << isdatasync;
+  // The file's data and metadata are stored together, so 'isdatasync' makes no difference.
+  try {
+    Global<Storage>::g_fuse_drive->Fsync(detail::GetFileContext(file_info));
+  }
+  catch (const std::exception& e) {
+    LOG(kError) << "OpsFsync: " << fs::path(path) << ": " << e.what();
+    return -EIO;
+  }
   return 0;
 }
-*/
 
-/*
 // Quote from FUSE documentation:
 //
 // Synchronize directory contents.
@@ -527,24 +678,17 @@ int FuseDrive<Storage>::OpsFsync(const char* path, int isdatasync,
 // data
 template <typename Storage>
 int FuseDrive<Storage>::OpsFsyncDir(const char* path, int isdatasync,
-                                    struct fuse_file_info* file_info) {
-  LOG(kInfo) << "OpsFsyncDir: " << path;
-  detail::FileContext<Storage>* file_context(detail::RecoverFileContext<Storage>(file_info));
-  if (!file_context)
-    return -EINVAL;
-
-  //  int result(Update(Global<Storage>::g_fuse_drive->directory_handler_,
-  //                    file_context,
-  //                    false,
-  //                    (isdatasync == 0)));
-  //  if (result != kSuccess) {
-  //    LOG(kError) << "OpsFsyncDir: " << path << ", failed to update "
-  //                << "metadata.  Result: " << result;
-  //    return -EIO;
-  //  }
+                                    struct fuse_file_info* /*file_info*/) {
+  LOG(kInfo) << "OpsFsyncDir: " << path << ", datasync: " << isdatasync;
+  try {
+    Global<Storage>::g_fuse_drive->FsyncDir(path);
+  }
+  catch (const std::exception& e) {
+    LOG(kError) << "OpsFsyncDir: " << fs::path(path) << ": " << e.what();
+    return -EIO;
+  }
   return 0;
 }
-*/
 
 // Quote from FUSE documentation:
 //
@@ -557,9 +701,9 @@ int FuseDrive<Storage>::OpsFsyncDir(const char* path, int isdatasync,
 // truncate() method will be called instead.
 template <typename Storage>
 int FuseDrive<Storage>::OpsFtruncate(const char* path, off_t size,
-                                     struct fuse_file_info* /*file_info*/) {
+                                     struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsFtruncate: " << path << ", size: " << size;
-  return Truncate(path, size);
+  return Truncate(detail::GetFileContext(file_info), size);
 }
 
 // Quote from FUSE documentation:
@@ -581,8 +725,27 @@ int FuseDrive<Storage>::OpsGetattr(const char* path, struct stat* stbuf) {
 // The return value will passed in the private_data field of fuse_context to all file operations and
 // as a parameter to the destroy() method.
 template <typename Storage>
-void* FuseDrive<Storage>::OpsInit(struct fuse_conn_info* /*conn*/) {
-  Global<Storage>::g_fuse_drive->SetMounted();
+void* FuseDrive<Storage>::OpsInit(struct fuse_conn_info* conn) {
+  auto drive(Global<Storage>::g_fuse_drive);
+  // Without big writes the kernel splits every write into page-sized requests, each of which costs
+  // a context lookup, an encryptor write and a parent update.
+  if (conn->capable & FUSE_CAP_BIG_WRITES)
+    conn->want |= FUSE_CAP_BIG_WRITES;
+  if (conn->capable & FUSE_CAP_ASYNC_READ) {
+    conn->want |= FUSE_CAP_ASYNC_READ;
+    conn->async_read = 1;
+  }
+  // libfuse clamps 'max_write' to its channel buffer size after this returns.
+  conn->max_write = drive->max_write_;
+  conn->max_readahead = std::min(conn->max_readahead, drive->max_readahead_);
+#if FUSE_VERSION >= 29
+  conn->max_background = drive->max_background_;
+  conn->congestion_threshold = (drive->max_background_ * 3) / 4;
+#endif
+  LOG(kInfo) << "OpsInit: max_write " << conn->max_write << ", max_readahead "
+             << conn->max_readahead << ", async_read " << conn->async_read << ", big_writes "
+             << ((conn->want & FUSE_CAP_BIG_WRITES) != 0);
+  drive->SetMounted();
   return nullptr;
 }
 
@@ -627,6 +790,57 @@ int FuseDrive<Storage>::OpsLink(const char* to, const char* from) {
 }
 */
 
+#if FUSE_VERSION >= 28
+// Quote from FUSE documentation:
+//
+// Ioctl.
+//
+// flags will have FUSE_IOCTL_COMPAT set for 32bit ioctls in 64bit environment.  The size and data
+// of the ioctl are determined by the _IOC_* bits of cmd.
+//
+// The only supported request is kCopyRangeIoctl (see copy_range.h), issued on the destination file.
+// FUSE 2.x has no copy_file_range operation, and FICLONE passes a file descriptor which is
+// meaningless to the filesystem process, so this is how a server-side copy is requested.
+template <typename Storage>
+int FuseDrive<Storage>::OpsIoctl(const char* path, int cmd, void* /*arg*/,
+                                 struct fuse_file_info* file_info, unsigned int flags,
+                                 void* data) {
+  LOG(kInfo) << "OpsIoctl: " << path << ", cmd: 0x" << std::hex << cmd << std::dec;
+  if (flags & FUSE_IOCTL_COMPAT)
+    return -ENOSYS;
+  if (static_cast<unsigned int>(cmd) != static_cast<unsigned int>(kCopyRangeIoctl))
+    return -ENOTTY;
+  if ((file_info->flags & O_ACCMODE) == O_RDONLY)
+    return -EBADF;
+
+  auto request(static_cast<CopyRangeRequest*>(data));
+  request->source_path[sizeof(request->source_path) - 1] = '\0';
+  auto source_path(detail::kRoot / fs::path(request->source_path).relative_path());
+  try {
+    // The kernel has only checked access to the destination.
+    if (!MayRead(source_path)) {
+      LOG(kWarning) << "Not permitted to copy from " << source_path << " to " << path;
+      return -EACCES;
+    }
+    auto source(Global<Storage>::g_fuse_drive->Open(source_path));
+    on_scope_exit release_source([&] { Global<Storage>::g_fuse_drive->Release(source); });
+    request->size = Global<Storage>::g_fuse_drive->CopyRange(
+        source, request->source_offset, detail::GetFileContext(file_info),
+        request->destination_offset, request->size);
+  }
+  catch (const drive_error& error) {
+    LOG(kWarning) << "Failed to copy from " << source_path << " to " << path << ": "
+                  << error.what();
+    return error.code() == make_error_code(DriveErrors::no_such_file) ? -ENOENT : -EIO;
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Failed to copy from " << source_path << " to " << path << ": " << e.what();
+    return -EINVAL;
+  }
+  return 0;
+}
+#endif
+
 // Quote from FUSE documentation:
 //
 // Create a directory.
@@ -681,20 +895,17 @@ int FuseDrive<Storage>::OpsOpen(const char* path, struct fuse_file_info* file_in
 
   assert(!(file_info->flags & O_DIRECTORY));
   try {
-    Global<Storage>::g_fuse_drive->Open(path);
+    detail::SetFileContext(Global<Storage>::g_fuse_drive->Open(path), file_info);
   }
   catch (const std::exception& e) {
     LOG(kError) << "OpsOpen: " << fs::path(path) << ": " << e.what();
     return -ENOENT;
   }
 
-  // Safe to allow the kernel to cache the file assuming it doesn't change "spontaneously".  For us,
-  // that presumably can happen on files which are part of a share, or if a user has >1 client
-  // instance, each with this file open.  To handle this, we need to either avoid allowing the
-  // kernel caching (set 'file_info->keep_cache' to 0), or preferrably use the low-level FUSE
-  // interface and if a file changes in the background, call fuse_lowlevel_notify_inval_inode().
-  // See http://fuse.996288.n3.nabble.com/fuse-file-info-keep-cache-usage-guidelines-td5130.html
-  file_info->keep_cache = 1;
+  // 'keep_cache' is left for libfuse to decide ('auto_cache' mount option): the kernel's cached
+  // pages are kept only if the file's attributes haven't changed since it was last opened.  Remote
+  // changes reach the attributes via 'Drive::ScheduleRemoteChangesCheck'.  Precise invalidation
+  // (e.g. fuse_lowlevel_notify_inval_inode) needs the low-level FUSE interface.
 
   return 0;
 }
@@ -721,6 +932,7 @@ int FuseDrive<Storage>::OpsOpendir(const char* path, struct fuse_file_info* file
     LOG(kError) << "OpsOpen: " << fs::path(path) << ": " << e.what();
     return -ENOENT;
   }
+  file_info->fh = reinterpret_cast<uint64_t>(new detail::DirectoryCursor);
   return 0;
 }
 
@@ -738,7 +950,8 @@ int FuseDrive<Storage>::OpsRead(const char* path, char* buf, size_t size, off_t
   LOG(kInfo) << "OpsRead: " << path << ", flags: 0x" << std::hex << file_info->flags << std::dec
              << " Size : " << size << " Offset : " << offset;
   try {
-    return static_cast<int>(Global<Storage>::g_fuse_drive->Read(path, buf, size, offset));
+    return static_cast<int>(Global<Storage>::g_fuse_drive->Read(
+        detail::GetFileContext(file_info), buf, static_cast<uint32_t>(size), offset));
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to read " << path << ": " << e.what();
@@ -761,12 +974,10 @@ int FuseDrive<Storage>::OpsRead(const char* path, char* buf, size_t size, off_t
 // full (or an error happens) the filler function will return '1'.
 template <typename Storage>
 int FuseDrive<Storage>::OpsReaddir(const char* path, void* buf, fuse_fill_dir_t filler,
-                                   off_t offset, struct fuse_file_info* /*file_info*/) {
+                                   off_t offset, struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsReaddir: " << path << "; offset = " << offset;
 
-  filler(buf, ".", nullptr, 0);
-  filler(buf, "..", nullptr, 0);
-  detail::Directory* directory;
+  std::shared_ptr<detail::Directory> directory;
   try {
     directory = Global<Storage>::g_fuse_drive->directory_handler_.Get(path);
   }
@@ -776,17 +987,47 @@ int FuseDrive<Storage>::OpsReaddir(const char* path, void* buf, fuse_fill_dir_t
   }
   assert(directory);
 
-  // TODO(Fraser#5#): 2011-05-18 - Handle offset properly.
-  if (offset == 0)
-    directory->ResetChildrenCounter();
+  auto cursor(detail::GetDirectoryCursor(file_info));
+  if (offset != cursor->offset) {
+    // Either a new listing, or the caller has seeked to a position other than the end of the
+    // previous batch.  Assuming no intervening changes to the directory, skip the appropriate
+    // number of children.
+    LOG(kInfo) << "OpsReaddir: " << path << " seeking from " << cursor->offset << " to " << offset;
+    *cursor = detail::DirectoryCursor();
+    cursor->offset = std::min(offset, static_cast<off_t>(2));
+    if (offset > 2) {
+      directory->ForEachChildAfter("", [&](const detail::FileContext& child) {
+        ++cursor->offset;
+        cursor->last_name = child.meta_data.name;
+        return cursor->offset != offset;
+      });
+    }
+  }
 
-  const detail::FileContext* file_context(directory->GetChildAndIncrementCounter());
-  while (file_context) {
-    if (filler(buf, file_context->meta_data.name.c_str(), &file_context->meta_data.attributes, 0))
-      break;
-    file_context = directory->GetChildAndIncrementCounter();
+  if (cursor->offset == 0) {
+    if (filler(buf, ".", nullptr, 1))
+      return 0;
+    cursor->offset = 1;
+  }
+  if (cursor->offset == 1) {
+    if (filler(buf, "..", nullptr, 2))
+      return 0;
+    cursor->offset = 2;
   }
 
+  directory->ForEachChildAfter(cursor->last_name, [&](const detail::FileContext& child) {
+    struct stat attributes;
+    {
+      std::lock_guard<std::mutex> lock(*child.mutex);
+      attributes = child.meta_data.attributes;
+    }
+    if (filler(buf, child.meta_data.name.c_str(), &attributes, cursor->offset + 1))
+      return false;
+    ++cursor->offset;
+    cursor->last_name = child.meta_data.name;
+    return true;
+  });
+
 //  if (file_context) {
 //    file_context->content_changed = true;
 //    time(&file_context->meta_data->attributes.st_atime);
@@ -838,7 +1079,7 @@ template <typename Storage>
 int FuseDrive<Storage>::OpsRelease(const char* path, struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsRelease: " << path << ", flags: " << file_info->flags;
   try {
-    Global<Storage>::g_fuse_drive->Release(path);
+    Global<Storage>::g_fuse_drive->Release(detail::GetFileContext(file_info));
   }
   catch (const std::exception& e) {
     LOG(kError) << "OpsRelease: " << path << ": " << e.what();
@@ -853,13 +1094,8 @@ int FuseDrive<Storage>::OpsRelease(const char* path, struct fuse_file_info* file
 template <typename Storage>
 int FuseDrive<Storage>::OpsReleasedir(const char* path, struct fuse_file_info* file_info) {
   LOG(kInfo) << "OpsReleasedir: " << path << ", flags: " << file_info->flags;
-  try {
-    Global<Storage>::g_fuse_drive->ReleaseDir(path);
-  }
-  catch (const std::exception& e) {
-    LOG(kError) << "OpsReleasedir: " << path << ": " << e.what();
-    return -EBADF;
-  }
+  delete detail::GetDirectoryCursor(file_info);
+  file_info->fh = 0;
   return 0;
 }
 
@@ -990,40 +1226,39 @@ int FuseDrive<Storage>::OpsUnlink(const char* path) {
 template <typename Storage>
 int FuseDrive<Storage>::OpsUtimens(const char* path, const struct timespec ts[2]) {
   LOG(kInfo) << "OpsUtimens: " << path;
-  detail::FileContext* file_context(nullptr);
   try {
-    file_context = Global<Storage>::g_fuse_drive->GetMutableContext(path);
+    Global<Storage>::g_fuse_drive->ApplyToContext(path, [ts](detail::FileContext& file_context) {
+      timespec tspec;
+#ifdef MAIDSAFE_APPLE
+      struct timeval _tspec;
+      gettimeofday(&_tspec, NULL);
+      tspec.tv_sec = _tspec.tv_sec;
+      tspec.tv_nsec = _tspec.tv_usec * 1000;
+      timespec &st_ctim = file_context.meta_data.attributes.st_ctimespec;
+      timespec &st_atim = file_context.meta_data.attributes.st_atimespec;
+      timespec &st_mtim = file_context.meta_data.attributes.st_mtimespec;
+#else
+      clock_gettime(CLOCK_REALTIME, &tspec);
+      timespec &st_ctim = file_context.meta_data.attributes.st_ctim;
+      timespec &st_atim = file_context.meta_data.attributes.st_atim;
+      timespec &st_mtim = file_context.meta_data.attributes.st_mtim;
+      // Really ought to support st_birthtim where available
+#endif
+      st_ctim = tspec;
+      if (ts) {
+        st_atim = ts[0];
+        st_mtim = ts[1];
+      } else {
+        st_atim = tspec;
+        st_mtim = tspec;
+      }
+      return true;
+    });
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to change times for " << path << ": " << e.what();
     return -ENOENT;
   }
-
-  timespec tspec;
-#ifdef MAIDSAFE_APPLE
-  struct timeval _tspec;
-  gettimeofday(&_tspec, NULL);
-  tspec.tv_sec = _tspec.tv_sec;
-  tspec.tv_nsec = _tspec.tv_usec * 1000;
-  timespec &st_ctim = file_context->meta_data.attributes.st_ctimespec;
-  timespec &st_atim = file_context->meta_data.attributes.st_atimespec;
-  timespec &st_mtim = file_context->meta_data.attributes.st_mtimespec;
-#else
-  clock_gettime(CLOCK_REALTIME, &tspec);
-  timespec &st_ctim = file_context->meta_data.attributes.st_ctim;
-  timespec &st_atim = file_context->meta_data.attributes.st_atim;
-  timespec &st_mtim = file_context->meta_data.attributes.st_mtim;
-  // Really ought to support st_birthtim where available
-#endif
-  st_ctim = tspec;
-  if (ts) {
-    st_atim = ts[0];
-    st_mtim = ts[1];
-  } else {
-    st_atim = tspec;
-    st_mtim = tspec;
-  }
-  file_context->parent->ScheduleForStoring();
   return 0;
 }
 
@@ -1040,13 +1275,70 @@ int FuseDrive<Storage>::OpsWrite(const char* path, const char* buf, size_t size,
              << " Size : " << size << " Offset : " << offset;
 
   try {
-    return static_cast<int>(Global<Storage>::g_fuse_drive->Write(path, buf, size, offset));
+    return static_cast<int>(Global<Storage>::g_fuse_drive->Write(
+        detail::GetFileContext(file_info), buf, static_cast<uint32_t>(size), offset));
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Failed to write " << path << ": " << e.what();
+    return -EINVAL;
+  }
+}
+
+#if FUSE_VERSION >= 29
+// Quote from FUSE documentation:
+//
+// Write contents of buffer to an open file.
+//
+// Similar to the write() method, but data is supplied in a generic buffer.  Use fuse_buf_copy() to
+// transfer data to the destination.
+//
+// Without this, libfuse coalesces any multi-segment or pipe-backed request into a freshly allocated
+// buffer before calling OpsWrite.  Here memory segments are handed to the encryptor in place, and
+// only pipe segments (from splice) are copied, into a buffer shared by the request's segments.
+template <typename Storage>
+int FuseDrive<Storage>::OpsWriteBuf(const char* path, struct fuse_bufvec* buf, off_t offset,
+                                    struct fuse_file_info* file_info) {
+  LOG(kInfo) << "OpsWriteBuf: " << path << ", flags: 0x" << std::hex << file_info->flags
+             << std::dec << " Size : " << fuse_buf_size(buf) << " Offset : " << offset;
+  std::vector<char> scratch;
+  auto file_context(detail::GetFileContext(file_info));
+  size_t written(0);
+  try {
+    for (size_t index(buf->idx); index < buf->count; ++index) {
+      const fuse_buf& segment(buf->buf[index]);
+      size_t segment_offset(index == buf->idx ? buf->off : 0);
+      if (segment_offset >= segment.size)
+        continue;
+      size_t size(segment.size - segment_offset);
+      const char* data(nullptr);
+      if (segment.flags & FUSE_BUF_IS_FD) {
+        if (scratch.size() < size)
+          scratch.resize(size);
+        fuse_bufvec source = FUSE_BUFVEC_INIT(size);
+        source.buf[0] = segment;
+        source.off = segment_offset;
+        fuse_bufvec destination = FUSE_BUFVEC_INIT(size);
+        destination.buf[0].mem = scratch.data();
+        ssize_t copied(fuse_buf_copy(&destination, &source, static_cast<fuse_buf_copy_flags>(0)));
+        if (copied < 0)
+          return static_cast<int>(copied);
+        size = static_cast<size_t>(copied);
+        data = scratch.data();
+      } else {
+        data = static_cast<const char*>(segment.mem) + segment_offset;
+      }
+      written += Global<Storage>::g_fuse_drive->Write(file_context, data,
+                                                      static_cast<uint32_t>(size),
+                                                      offset + written);
+    }
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to write " << path << ": " << e.what();
     return -EINVAL;
   }
+  return static_cast<int>(written);
 }
+#endif
 
 #ifdef HAVE_SETXATTR
 int FuseDrive<Storage>::OpsGetxattr(const char* path, const char* name, char* value, size_t size) {
@@ -1100,7 +1392,8 @@ int FuseDrive<Storage>::OpsSetxattr(const char* path, const char* name, const ch
 #endif  // HAVE_SETXATTR
 
 template <typename Storage>
-int FuseDrive<Storage>::CreateNew(const fs::path& full_path, mode_t mode, dev_t rdev) {
+int FuseDrive<Storage>::CreateNew(const fs::path& full_path, mode_t mode, dev_t rdev,
+                                  struct fuse_file_info* file_info) {
   if (detail::ExcludedFilename(full_path.filename().stem().string())) {
     LOG(kError) << "Invalid name: " << full_path;
     return -EINVAL;
@@ -1118,7 +1411,9 @@ int FuseDrive<Storage>::CreateNew(const fs::path& full_path, mode_t mode, dev_t
   file_context.meta_data.attributes.st_gid = fuse_get_context()->gid;
 
   try {
-    Global<Storage>::g_fuse_drive->Create(full_path, std::move(file_context));
+    auto added_context(Global<Storage>::g_fuse_drive->Create(full_path, std::move(file_context)));
+    if (file_info)
+      detail::SetFileContext(added_context, file_info);
   }
   catch (const std::exception& e) {
     LOG(kError) << "CreateNew: " << full_path << ": " << e.what();
@@ -1131,23 +1426,12 @@ int FuseDrive<Storage>::CreateNew(const fs::path& full_path, mode_t mode, dev_t
 template <typename Storage>
 int FuseDrive<Storage>::GetAttributes(const char* path, struct stat* stbuf) {
   try {
-    auto file_context(Global<Storage>::g_fuse_drive->GetContext(path));
-    *stbuf = file_context->meta_data.attributes;
-    LOG(kVerbose) << " meta_data info  = ";
-    LOG(kVerbose) << "     name =  " << file_context->meta_data.name.c_str();
-    LOG(kVerbose) << "     st_dev = " << file_context->meta_data.attributes.st_dev;
-    LOG(kVerbose) << "     st_ino = " << file_context->meta_data.attributes.st_ino;
-    LOG(kVerbose) << "     st_mode = " << file_context->meta_data.attributes.st_mode;
-    LOG(kVerbose) << "     st_nlink = " << file_context->meta_data.attributes.st_nlink;
-    LOG(kVerbose) << "     st_uid = " << file_context->meta_data.attributes.st_uid;
-    LOG(kVerbose) << "     st_gid = " << file_context->meta_data.attributes.st_gid;
-    LOG(kVerbose) << "     st_rdev = " << file_context->meta_data.attributes.st_rdev;
-    LOG(kVerbose) << "     st_size = " << file_context->meta_data.attributes.st_size;
-    LOG(kVerbose) << "     st_blksize = " << file_context->meta_data.attributes.st_blksize;
-    LOG(kVerbose) << "     st_blocks = " << file_context->meta_data.attributes.st_blocks;
-    LOG(kVerbose) << "     st_atim = " << file_context->meta_data.attributes.st_atime;
-    LOG(kVerbose) << "     st_mtim = " << file_context->meta_data.attributes.st_mtime;
-    LOG(kVerbose) << "     st_ctim = " << file_context->meta_data.attributes.st_ctime;
+    // The attributes are copied with the parent locked, since the context can be removed once it's
+    // unlocked.
+    Global<Storage>::g_fuse_drive->ApplyToContext(path, [stbuf](detail::FileContext& file_context) {
+      *stbuf = file_context.meta_data.attributes;
+      return false;
+    });
   }
   catch (const std::exception& e) {
 //    if (full_path.filename().string().size() > 255) {
@@ -1160,22 +1444,126 @@ int FuseDrive<Storage>::GetAttributes(const char* path, struct stat* stbuf) {
   return 0;
 }
 
+template <typename Storage>
+bool FuseDrive<Storage>::MayRead(const fs::path& path) {
+  const fs::path relative_path(path.relative_path());
+  bool permitted(true);
+  fs::path ancestor(detail::kRoot);
+  for (auto itr(std::begin(relative_path)); permitted && itr != std::end(relative_path); ++itr) {
+    ancestor /= *itr;
+    const int mask(ancestor == path ? R_OK : X_OK);
+    Global<Storage>::g_fuse_drive->ApplyToContext(ancestor, [&](detail::FileContext& context) {
+      permitted = detail::IsPermitted(context.meta_data.attributes, mask);
+      return false;
+    });
+  }
+  return permitted;
+}
+
+template <typename Storage>
+int FuseDrive<Storage>::GetAttributes(const detail::FileContext* file_context,
+                                      struct stat* stbuf) {
+  std::lock_guard<std::mutex> lock(*file_context->mutex);
+  *stbuf = file_context->meta_data.attributes;
+  LOG(kVerbose) << " meta_data info  = ";
+  LOG(kVerbose) << "     name =  " << file_context->meta_data.name.c_str();
+  LOG(kVerbose) << "     st_dev = " << file_context->meta_data.attributes.st_dev;
+  LOG(kVerbose) << "     st_ino = " << file_context->meta_data.attributes.st_ino;
+  LOG(kVerbose) << "     st_mode = " << file_context->meta_data.attributes.st_mode;
+  LOG(kVerbose) << "     st_nlink = " << file_context->meta_data.attributes.st_nlink;
+  LOG(kVerbose) << "     st_uid = " << file_context->meta_data.attributes.st_uid;
+  LOG(kVerbose) << "     st_gid = " << file_context->meta_data.attributes.st_gid;
+  LOG(kVerbose) << "     st_rdev = " << file_context->meta_data.attributes.st_rdev;
+  LOG(kVerbose) << "     st_size = " << file_context->meta_data.attributes.st_size;
+  LOG(kVerbose) << "     st_blksize = " << file_context->meta_data.attributes.st_blksize;
+  LOG(kVerbose) << "     st_blocks = " << file_context->meta_data.attributes.st_blocks;
+  LOG(kVerbose) << "     st_atim = " << file_context->meta_data.attributes.st_atime;
+  LOG(kVerbose) << "     st_mtim = " << file_context->meta_data.attributes.st_mtime;
+  LOG(kVerbose) << "     st_ctim = " << file_context->meta_data.attributes.st_ctime;
+  return 0;
+}
+
 template <typename Storage>
 int FuseDrive<Storage>::Truncate(const char* path, off_t size) {
+  detail::FileContext* file_context(nullptr);
   try {
-    auto file_context(Global<Storage>::g_fuse_drive->GetMutableContext(path));
-    assert(file_context->self_encryptor);
-    file_context->self_encryptor->Truncate(size);
-    file_context->meta_data.attributes.st_size = size;
-    time(&file_context->meta_data.attributes.st_mtime);
-    file_context->meta_data.attributes.st_ctime = file_context->meta_data.attributes.st_atime =
-        file_context->meta_data.attributes.st_mtime;
-    file_context->parent->ScheduleForStoring();
+    // Opening the file keeps its context valid and gives it an encryptor to truncate.
+    file_context = Global<Storage>::g_fuse_drive->Open(path);
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to truncate " << path << ": " << e.what();
     return -ENOENT;
   }
+  on_scope_exit release([&] { Global<Storage>::g_fuse_drive->Release(file_context); });
+  if (file_context->meta_data.directory_id)
+    return -EISDIR;
+  return Truncate(file_context, size);
+}
+
+template <typename Storage>
+int FuseDrive<Storage>::Truncate(detail::FileContext* file_context, off_t size) {
+  try {
+    std::shared_ptr<detail::Directory> parent;
+    {
+      std::lock_guard<std::mutex> lock(*file_context->mutex);
+      assert(file_context->self_encryptor);
+      parent = file_context->parent->shared_from_this();
+      file_context->self_encryptor->Truncate(size);
+      file_context->meta_data.attributes.st_size = size;
+      time(&file_context->meta_data.attributes.st_mtime);
+      file_context->meta_data.attributes.st_ctime = file_context->meta_data.attributes.st_atime =
+          file_context->meta_data.attributes.st_mtime;
+    }
+    parent->ScheduleForStoring();
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Failed to truncate " << file_context->meta_data.name << ": " << e.what();
+    return -EIO;
+  }
+  return 0;
+}
+
+template <typename Storage>
+int FuseDrive<Storage>::ZeroRange(detail::FileContext* file_context, off_t offset, off_t length) {
+  try {
+    {
+      std::lock_guard<std::mutex> lock(*file_context->mutex);
+      assert(file_context->self_encryptor);
+      const off_t file_size(static_cast<off_t>(file_context->self_encryptor->size()));
+      if (offset >= file_size)
+        return 0;
+      if (offset + length >= file_size) {
+        // Cutting the file short and extending it again lets the encryptor fill in the zeros
+        // itself, rather than passing them through 'Write'.
+        file_context->self_encryptor->Truncate(offset);
+        file_context->self_encryptor->Truncate(file_size);
+        length = 0;
+      } else {
+        LOG(kInfo) << "Zeroing " << length << " bytes of " << file_context->meta_data.name
+                   << " at offset " << offset;
+      }
+    }
+    static const std::vector<char> kZeros(1024 * 1024, 0);
+    while (length > 0) {
+      const uint32_t size(static_cast<uint32_t>(
+          std::min(static_cast<off_t>(kZeros.size()), length)));
+      Global<Storage>::g_fuse_drive->Write(file_context, kZeros.data(), size, offset);
+      offset += size;
+      length -= size;
+    }
+    {
+      // 'Write' leaves the times alone, so they're updated here for both ways of zeroing.
+      std::lock_guard<std::mutex> lock(*file_context->mutex);
+      file_context->meta_data.UpdateLastModifiedTime();
+      file_context->meta_data.attributes.st_ctime = file_context->meta_data.attributes.st_mtime;
+    }
+    Global<Storage>::g_fuse_drive->GetParent(file_context)->ScheduleForStoring();
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Failed to zero range of " << file_context->meta_data.name << ": "
+                  << e.what();
+    return -EIO;
+  }
   return 0;
 }
 
@@ -81,6 +81,21 @@ bool SetFiletime(FILETIME& filetime, PFILETIME new_value);
 
 void ErrorMessage(const std::string& method_name, ECBFSError error);
 
+// Each directory enumeration has its own cursor: the name of the last child it returned.  Listing
+// resumes after that name, so children added or removed during an enumeration neither restart nor
+// corrupt it.
+inline boost::filesystem::path* GetEnumerationCursor(
+    CbFsDirectoryEnumerationInfo* enumeration_info, bool restart) {
+  auto cursor(static_cast<boost::filesystem::path*>(enumeration_info->get_UserContext()));
+  if (!cursor) {
+    cursor = new boost::filesystem::path;
+    enumeration_info->set_UserContext(cursor);
+  } else if (restart) {
+    cursor->clear();
+  }
+  return cursor;
+}
+
 }  // namespace detail
 
 template <typename Storage>
@@ -89,7 +104,8 @@ class CbfsDrive : public Drive<Storage> {
   CbfsDrive(std::shared_ptr<Storage> storage, const Identity& unique_user_id,
             const Identity& root_parent_id, const boost::filesystem::path& mount_dir,
             const boost::filesystem::path& user_app_dir, const boost::filesystem::path& drive_name,
-            const std::string& mount_status_shared_object_name, bool create);
+            const std::string& mount_status_shared_object_name, bool create,
+            const std::string& snapshot_secret = std::string());
 
   virtual ~CbfsDrive();
 
@@ -192,9 +208,10 @@ CbfsDrive<Storage>::CbfsDrive(std::shared_ptr<Storage> storage, const Identity&
                               const boost::filesystem::path& mount_dir,
                               const boost::filesystem::path& user_app_dir,
                               const boost::filesystem::path& drive_name,
-                              const std::string& mount_status_shared_object_name, bool create)
+                              const std::string& mount_status_shared_object_name, bool create,
+                              const std::string& snapshot_secret)
     : Drive(storage, unique_user_id, root_parent_id, mount_dir, user_app_dir,
-            mount_status_shared_object_name, create),
+            mount_status_shared_object_name, create, snapshot_secret),
       callback_filesystem_(),
       icon_id_(L"MaidSafeDriveIcon"),
       drive_name_(drive_name.wstring()),
@@ -697,33 +714,35 @@ void CbfsDrive<Storage>::CbFsGetFileInfo(
   SCOPED_PROFILE
   boost::filesystem::path relative_path(file_name);
   LOG(kInfo) << "CbFsGetFileInfo - " << relative_path;
-  const detail::FileContext* file_context(nullptr);
   try {
     auto cbfs_drive(detail::GetDrive<Storage>(sender));
-    file_context = cbfs_drive->GetContext(relative_path);
+    // The metadata is copied with the parent locked, since the context can be removed once it's
+    // unlocked.
+    cbfs_drive->ApplyToContext(relative_path, [&](detail::FileContext& file_context) {
+      *creation_time = file_context.meta_data.creation_time;
+      *last_access_time = file_context.meta_data.last_access_time;
+      *last_write_time = file_context.meta_data.last_write_time;
+      // if (file_context.meta_data.end_of_file < file_context.meta_data.allocation_size)
+      //   file_context.meta_data.end_of_file = file_context.meta_data.allocation_size;
+      // else if (file_context.meta_data.allocation_size < file_context.meta_data.end_of_file)
+      //   file_context.meta_data.allocation_size = file_context.meta_data.end_of_file;
+      *end_of_file = file_context.meta_data.end_of_file;
+      *allocation_size = file_context.meta_data.allocation_size;
+      // *file_id = 0;
+      *file_attributes = file_context.meta_data.attributes;
+      if (real_file_name) {
+        wcscpy(real_file_name, file_context.meta_data.name.wstring().c_str());
+        *real_file_name_length = static_cast<WORD>(file_context.meta_data.name.wstring().size());
+      }
+      return false;
+    });
   }
   catch (const std::exception&) {
     *file_exists = false;
     *file_attributes = 0xFFFFFFFF;
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
   }
-
   *file_exists = true;
-  *creation_time = file_context->meta_data.creation_time;
-  *last_access_time = file_context->meta_data.last_access_time;
-  *last_write_time = file_context->meta_data.last_write_time;
-  // if (file_context->meta_data.end_of_file < file_context->meta_data.allocation_size)
-  //   file_context->meta_data.end_of_file = file_context->meta_data.allocation_size;
-  // else if (file_context->meta_data.allocation_size < file_context->meta_data.end_of_file)
-  //   file_context->meta_data.allocation_size = file_context->meta_data.end_of_file;
-  *end_of_file = file_context->meta_data.end_of_file;
-  *allocation_size = file_context->meta_data.allocation_size;
-  // *file_id = 0;
-  *file_attributes = file_context->meta_data.attributes;
-  if (real_file_name) {
-    wcscpy(real_file_name, file_context->meta_data.name.wstring().c_str());
-    *real_file_name_length = static_cast<WORD>(file_context->meta_data.name.wstring().size());
-  }
 }
 
 // Quote from CBFS documentation:
@@ -764,7 +783,7 @@ void CbfsDrive<Storage>::CbFsGetFileInfo(
 template <typename Storage>
 void CbfsDrive<Storage>::CbFsEnumerateDirectory(
     CallbackFileSystem* sender, CbFsFileInfo* directory_info, CbFsHandleInfo* /*handle_info*/,
-    CbFsDirectoryEnumerationInfo* /*directory_enumeration_info*/, LPCWSTR mask, int /*index*/,
+    CbFsDirectoryEnumerationInfo* directory_enumeration_info, LPCWSTR mask, int /*index*/,
     BOOL restart, LPBOOL file_found, LPWSTR file_name, PDWORD file_name_length,
     LPWSTR /*short_file_name*/ OPTIONAL, PUCHAR /*short_file_name_length*/ OPTIONAL,
     PFILETIME creation_time, PFILETIME last_access_time, PFILETIME last_write_time,
@@ -779,43 +798,35 @@ void CbfsDrive<Storage>::CbFsEnumerateDirectory(
   bool exact_match(mask_str != L"*");
   *file_found = false;
 
-  detail::Directory* directory(nullptr);
+  std::shared_ptr<detail::Directory> directory;
   try {
     directory = cbfs_drive->directory_handler_.Get(relative_path);
-    if (restart)
-      directory->ResetChildrenCounter();
   }
   catch (const std::exception& e) {
     LOG(kError) << "Failed enumerating " << relative_path << ": " << e.what();
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
   }
 
-  const detail::FileContext* file_context(nullptr);
-  if (exact_match) {
-    while (!(*file_found)) {
-      file_context = directory->GetChildAndIncrementCounter();
-      if (!file_context)
-        break;
-      *file_found = detail::MatchesMask(mask_str, file_context->meta_data.name);
-    }
-  } else {
-    file_context = directory->GetChildAndIncrementCounter();
-    *file_found = (file_context != nullptr);
-  }
-
-  if (*file_found) {
+  auto cursor(detail::GetEnumerationCursor(directory_enumeration_info, restart != 0));
+  directory->ForEachChildAfter(*cursor, [&](const detail::FileContext& child) {
+    *cursor = child.meta_data.name;
+    if (exact_match && !detail::MatchesMask(mask_str, child.meta_data.name))
+      return true;
     // Need to use wcscpy rather than the secure wcsncpy_s as file_name has a size of 0 in some
     // cases.  CBFS docs specify that callers must assign MAX_PATH chars to file_name, so we assume
     // this is done.
-    wcscpy(file_name, file_context->meta_data.name.wstring().c_str());
-    *file_name_length = static_cast<DWORD>(file_context->meta_data.name.wstring().size());
-    *creation_time = file_context->meta_data.creation_time;
-    *last_access_time = file_context->meta_data.last_access_time;
-    *last_write_time = file_context->meta_data.last_write_time;
-    *end_of_file = file_context->meta_data.end_of_file;
-    *allocation_size = file_context->meta_data.allocation_size;
-    *file_attributes = file_context->meta_data.attributes;
-  }
+    wcscpy(file_name, child.meta_data.name.wstring().c_str());
+    *file_name_length = static_cast<DWORD>(child.meta_data.name.wstring().size());
+    std::lock_guard<std::mutex> lock(*child.mutex);
+    *creation_time = child.meta_data.creation_time;
+    *last_access_time = child.meta_data.last_access_time;
+    *last_write_time = child.meta_data.last_write_time;
+    *end_of_file = child.meta_data.end_of_file;
+    *allocation_size = child.meta_data.allocation_size;
+    *file_attributes = child.meta_data.attributes;
+    *file_found = true;
+    return false;
+  });
 }
 
 // Quote from CBFS documentation:
@@ -825,17 +836,12 @@ void CbfsDrive<Storage>::CbFsEnumerateDirectory(
 template <typename Storage>
 void CbfsDrive<Storage>::CbFsCloseDirectoryEnumeration(
     CallbackFileSystem* sender, CbFsFileInfo* directory_info,
-    CbFsDirectoryEnumerationInfo* /*directory_enumeration_info*/) {
+    CbFsDirectoryEnumerationInfo* directory_enumeration_info) {
   auto cbfs_drive(detail::GetDrive<Storage>(sender));
   auto relative_path(detail::GetRelativePath<Storage>(cbfs_drive, directory_info));
   LOG(kInfo) << "CbFsCloseEnumeration - " << relative_path;
-  try {
-    cbfs_drive->ReleaseDir(relative_path);
-  }
-  catch (const std::exception& e) {
-    LOG(kError) << "Failed closing enumeration for " << relative_path << ": " << e.what();
-    throw ECBFSError(ERROR_FILE_NOT_FOUND);
-  }
+  delete static_cast<boost::filesystem::path*>(directory_enumeration_info->get_UserContext());
+  directory_enumeration_info->set_UserContext(nullptr);
 }
 
 // Quote from CBFS documentation:
@@ -855,9 +861,10 @@ void CbfsDrive<Storage>::CbFsSetAllocationSize(CallbackFileSystem* sender, CbFsF
   LOG(kInfo) << "CbFsSetAllocationSize - " << relative_path << " to " << allocation_size
              << " bytes.";
   try {
-    auto file_context(cbfs_drive->GetMutableContext(relative_path));
-    file_context->meta_data.allocation_size = allocation_size;
-    file_context->parent->ScheduleForStoring();
+    cbfs_drive->ApplyToContext(relative_path, [allocation_size](detail::FileContext& file_context) {
+      file_context.meta_data.allocation_size = allocation_size;
+      return true;
+    });
   }
   catch (const std::exception&) {
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
@@ -886,10 +893,15 @@ void CbfsDrive<Storage>::CbFsSetEndOfFile(CallbackFileSystem* sender, CbFsFileIn
   LOG(kInfo) << "CbFsSetEndOfFile - " << relative_path << " to " << end_of_file << " bytes.";
   try {
     auto file_context(cbfs_drive->GetMutableContext(relative_path));
-    assert(file_context->self_encryptor);
-    file_context->self_encryptor->Truncate(end_of_file);
-    file_context->meta_data.end_of_file = end_of_file;
-    file_context->parent->ScheduleForStoring();
+    std::shared_ptr<detail::Directory> parent;
+    {
+      std::lock_guard<std::mutex> lock(*file_context->mutex);
+      assert(file_context->self_encryptor);
+      file_context->self_encryptor->Truncate(end_of_file);
+      file_context->meta_data.end_of_file = end_of_file;
+      parent = file_context->parent->shared_from_this();
+    }
+    parent->ScheduleForStoring();
   }
   catch (const std::exception&) {
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
@@ -924,17 +936,19 @@ void CbfsDrive<Storage>::CbFsSetFileAttributes(
   auto relative_path(detail::GetRelativePath<Storage>(cbfs_drive, file_info));
   LOG(kInfo) << "CbFsSetFileAttributes- " << relative_path << " 0x" << std::hex << file_attributes;
   try {
-    auto file_context(cbfs_drive->GetMutableContext(relative_path));
-    bool changed(detail::SetAttributes(file_context->meta_data.attributes, file_attributes));
-    changed |= detail::SetFiletime(file_context->meta_data.creation_time, creation_time);
-    if (!detail::LastAccessUpdateIsDisabled())
-      // TODO(Fraser#5#): 2013-12-05 - Decide whether to treat this as worthy of marking the
-      //                  metadata as changed (hence causing a new directory version to be stored).
-      // changed |= detail::SetFiletime(file_context->meta_data.last_access_time, last_access_time);
-      detail::SetFiletime(file_context->meta_data.last_access_time, last_access_time);
-    changed |= detail::SetFiletime(file_context->meta_data.last_write_time, last_write_time);
-    if (changed)
-      file_context->parent->ScheduleForStoring();
+    cbfs_drive->ApplyToContext(relative_path, [&](detail::FileContext& file_context) {
+      bool changed(detail::SetAttributes(file_context.meta_data.attributes, file_attributes));
+      changed |= detail::SetFiletime(file_context.meta_data.creation_time, creation_time);
+      if (!detail::LastAccessUpdateIsDisabled())
+        // TODO(Fraser#5#): 2013-12-05 - Decide whether to treat this as worthy of marking the
+        //                  metadata as changed (hence causing a new directory version to be
+        //                  stored).
+        // changed |= detail::SetFiletime(file_context.meta_data.last_access_time,
+        //                                last_access_time);
+        detail::SetFiletime(file_context.meta_data.last_access_time, last_access_time);
+      changed |= detail::SetFiletime(file_context.meta_data.last_write_time, last_write_time);
+      return changed;
+    });
   }
   catch (const std::exception&) {
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
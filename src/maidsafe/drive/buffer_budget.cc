@@ -0,0 +1,77 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/buffer_budget.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "maidsafe/common/log.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+BufferBudget::BufferBudget(MemoryUsage total, MemoryUsage min_per_buffer,
+                           MemoryUsage max_per_buffer)
+    : kTotal_(total.data), kMinPerBuffer_(std::min(min_per_buffer.data, max_per_buffer.data)),
+      kMaxPerBuffer_(max_per_buffer.data), mutex_(), cond_var_(), available_(total.data),
+      buffer_count_(0) {}
+
+MemoryUsage BufferBudget::Reserve(std::chrono::steady_clock::duration timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const uint64_t fair_share(std::max(kMinPerBuffer_,
+                                     std::min(kMaxPerBuffer_, kTotal_ / (buffer_count_ + 1))));
+  if (available_ < fair_share &&
+      !cond_var_.wait_for(lock, timeout, [&] { return available_ >= fair_share; })) {
+    LOG(kWarning) << "Buffer memory budget exhausted (" << buffer_count_ << " buffers) - new "
+                  << "buffer gets " << available_ << " bytes rather than " << fair_share;
+  }
+  const uint64_t reserved(std::min(fair_share, available_));
+  available_ -= reserved;
+  ++buffer_count_;
+  return MemoryUsage(reserved);
+}
+
+void BufferBudget::Release(MemoryUsage reserved) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(buffer_count_ > 0 && available_ + reserved.data <= kTotal_);
+    available_ += reserved.data;
+    --buffer_count_;
+  }
+  cond_var_.notify_all();
+}
+
+MemoryUsage BufferBudget::available() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return MemoryUsage(available_);
+}
+
+uint32_t BufferBudget::buffer_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return buffer_count_;
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -0,0 +1,220 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/chunk_cache.h"
+
+#include "boost/filesystem/operations.hpp"
+
+#include "maidsafe/common/crypto.h"
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+#include "maidsafe/common/utils.h"
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace {
+
+// Returns true if the file at 'chunk_path' holds the chunk called 'name'.
+bool ReadValidChunk(const fs::path& chunk_path, const std::string& name, std::string& content) {
+  return ReadFile(chunk_path, &content) && !content.empty() &&
+         crypto::Hash<crypto::SHA512>(content).string() == name;
+}
+
+}  // unnamed namespace
+
+ChunkCache::ChunkCache(MemoryUsage max_memory_usage, DiskUsage max_disk_usage,
+                       const fs::path& disk_path)
+    : kMaxMemoryUsage_(max_memory_usage), kMaxDiskUsage_(max_disk_usage), kDiskPath_(disk_path),
+      mutex_(), memory_chunks_(), memory_index_(), memory_usage_(0), disk_chunks_(),
+      disk_index_(), disk_usage_(0), memory_hit_count_(0), disk_hit_count_(0), miss_count_(0) {
+  boost::system::error_code error_code;
+  if (!fs::exists(kDiskPath_, error_code) && !fs::create_directories(kDiskPath_, error_code)) {
+    LOG(kError) << "Failed to create chunk cache at " << kDiskPath_ << ": "
+                << error_code.message();
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+  }
+}
+
+ChunkCache::~ChunkCache() {
+  boost::system::error_code error_code;
+  fs::remove_all(kDiskPath_, error_code);
+  if (error_code)
+    LOG(kWarning) << "Failed to remove " << kDiskPath_ << ": " << error_code.message();
+}
+
+bool ChunkCache::Get(const std::string& name, NonEmptyString& content) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto itr(memory_index_.find(name));
+    if (itr != std::end(memory_index_)) {
+      memory_chunks_.splice(std::end(memory_chunks_), memory_chunks_, itr->second);
+      content = itr->second->second;
+      ++memory_hit_count_;
+      return true;
+    }
+    if (disk_index_.count(name) == 0) {
+      ++miss_count_;
+      return false;
+    }
+  }
+
+  std::string disk_content;
+  const fs::path chunk_path(ChunkPath(name));
+  bool valid(ReadValidChunk(chunk_path, name, disk_content));
+  std::vector<std::pair<std::string, NonEmptyString>> evicted;
+  {
+    // Whether valid or not, the chunk leaves the disk tier: valid chunks move back into memory.
+    // Files are only added and removed with 'mutex_' locked, so that a file written meanwhile by
+    // 'PutOnDisk' isn't removed here.  Since a valid file's content is fixed by its name, only an
+    // invalid one needs checking again.
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto itr(disk_index_.find(name));
+    if (itr != std::end(disk_index_)) {
+      if (!valid)
+        valid = ReadValidChunk(chunk_path, name, disk_content);
+      disk_usage_ -= itr->second->second;
+      disk_chunks_.erase(itr->second);
+      disk_index_.erase(itr);
+      boost::system::error_code error_code;
+      fs::remove(chunk_path, error_code);
+    }
+    if (valid) {
+      ++disk_hit_count_;
+      content = NonEmptyString(disk_content);
+      evicted = PutInMemory(name, content);
+    } else {
+      ++miss_count_;
+    }
+  }
+  if (!valid)
+    LOG(kWarning) << "Discarding invalid cached chunk " << HexSubstr(name);
+  PutOnDisk(evicted);
+  return valid;
+}
+
+void ChunkCache::Put(const std::string& name, const NonEmptyString& content) {
+  std::vector<std::pair<std::string, NonEmptyString>> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (disk_index_.count(name) != 0)
+      return;
+    evicted = PutInMemory(name, content);
+  }
+  PutOnDisk(evicted);
+}
+
+uint64_t ChunkCache::memory_hit_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return memory_hit_count_;
+}
+
+uint64_t ChunkCache::disk_hit_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return disk_hit_count_;
+}
+
+uint64_t ChunkCache::miss_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return miss_count_;
+}
+
+fs::path ChunkCache::ChunkPath(const std::string& name) const {
+  return kDiskPath_ / HexEncode(name);
+}
+
+std::vector<std::pair<std::string, NonEmptyString>> ChunkCache::PutInMemory(
+    const std::string& name, const NonEmptyString& content) {
+  std::vector<std::pair<std::string, NonEmptyString>> evicted;
+  auto itr(memory_index_.find(name));
+  if (itr != std::end(memory_index_)) {
+    memory_chunks_.splice(std::end(memory_chunks_), memory_chunks_, itr->second);
+    return evicted;
+  }
+  const uint64_t size(content.string().size());
+  if (size > kMaxMemoryUsage_.data) {
+    evicted.push_back(std::make_pair(name, content));
+    return evicted;
+  }
+  auto memory_itr(memory_chunks_.insert(std::end(memory_chunks_), std::make_pair(name, content)));
+  memory_index_.insert(std::make_pair(name, memory_itr));
+  memory_usage_ += size;
+  while (memory_usage_ > kMaxMemoryUsage_.data) {
+    memory_usage_ -= memory_chunks_.front().second.string().size();
+    memory_index_.erase(memory_chunks_.front().first);
+    evicted.push_back(std::move(memory_chunks_.front()));
+    memory_chunks_.pop_front();
+  }
+  return evicted;
+}
+
+void ChunkCache::PutOnDisk(const std::vector<std::pair<std::string, NonEmptyString>>& chunks) {
+  for (const auto& chunk : chunks) {
+    const uint64_t size(chunk.second.string().size());
+    if (size > kMaxDiskUsage_.data)
+      continue;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (disk_index_.count(chunk.first) != 0)
+        continue;
+    }
+    // Written to a temporary file first, so that a chunk file is never seen part-written.
+    const fs::path temp_path(kDiskPath_ / fs::unique_path("%%%%-%%%%-%%%%-%%%%.tmp"));
+    if (!WriteFile(temp_path, chunk.second.string())) {
+      LOG(kWarning) << "Failed to write chunk " << HexSubstr(chunk.first) << " to cache.";
+      boost::system::error_code error_code;
+      fs::remove(temp_path, error_code);
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      boost::system::error_code error_code;
+      if (disk_index_.count(chunk.first) != 0) {
+        fs::remove(temp_path, error_code);
+        continue;
+      }
+      fs::rename(temp_path, ChunkPath(chunk.first), error_code);
+      if (error_code) {
+        LOG(kWarning) << "Failed to move chunk " << HexSubstr(chunk.first) << " into cache: "
+                      << error_code.message();
+        fs::remove(temp_path, error_code);
+        continue;
+      }
+      auto disk_itr(disk_chunks_.insert(std::end(disk_chunks_), std::make_pair(chunk.first, size)));
+      disk_index_.insert(std::make_pair(chunk.first, disk_itr));
+      disk_usage_ += size;
+      while (disk_usage_ > kMaxDiskUsage_.data) {
+        disk_usage_ -= disk_chunks_.front().second;
+        disk_index_.erase(disk_chunks_.front().first);
+        fs::remove(ChunkPath(disk_chunks_.front().first), error_code);
+        disk_chunks_.pop_front();
+      }
+    }
+  }
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -0,0 +1,149 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/chunk_prefetcher.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "maidsafe/common/log.h"
+#include "maidsafe/common/utils.h"
+
+#include "maidsafe/drive/config.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+ChunkPrefetcher::ChunkPrefetcher(GetFunctor get_functor, uint32_t max_chunks)
+    : get_functor_(get_functor), kMaxChunks_(max_chunks), mutex_(), chunks_(), index_(),
+      hit_count_(0), request_count_(0) {}
+
+NonEmptyString ChunkPrefetcher::Get(const std::string& name) {
+  boost::shared_future<ImmutableData> prefetched;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++request_count_;
+    auto itr(index_.find(name));
+    if (itr != std::end(index_)) {
+      ++hit_count_;
+      prefetched = itr->second->second;
+      chunks_.erase(itr->second);
+      index_.erase(itr);
+    }
+  }
+  if (prefetched.valid()) {
+    try {
+      return prefetched.get().data();
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Prefetch of " << HexSubstr(name) << " failed: " << e.what();
+    }
+  }
+  return get_functor_(ImmutableData::Name(Identity(name))).get().data();
+}
+
+void ChunkPrefetcher::FetchRange(const encrypt::DataMap& data_map, uint64_t offset,
+                                 uint32_t size) {
+  std::vector<std::string> names;
+  uint64_t chunk_begin(0);
+  for (const auto& chunk : data_map.chunks) {
+    const uint64_t chunk_end(chunk_begin + chunk.size);
+    if (chunk_begin >= offset + size)
+      break;
+    if (chunk_end > offset)
+      names.push_back(chunk.hash);
+    chunk_begin = chunk_end;
+  }
+  // A read within a single chunk gains nothing from fetching it in the background.
+  if (names.size() < 2)
+    return;
+  size_t last(std::min<size_t>(names.size(), kMaxChunks_));
+  for (size_t i(0); i < last; ++i)
+    Prefetch(names[i]);
+}
+
+void ChunkPrefetcher::NotifyRead(const encrypt::DataMap& data_map, uint64_t offset,
+                                 uint32_t size, ReadPattern& read_pattern) {
+  if (offset == read_pattern.next_offset) {
+    ++read_pattern.sequential_count;
+  } else {
+    read_pattern.sequential_count = 0;
+    read_pattern.prefetched_until = 0;
+  }
+  read_pattern.next_offset = offset + size;
+  if (read_pattern.sequential_count < kSequentialReadThreshold || size == 0)
+    return;
+
+  // Find the chunk holding the last byte read, then request the ones after it.
+  size_t index(0);
+  uint64_t chunk_end(0);
+  for (; index != data_map.chunks.size(); ++index) {
+    chunk_end += data_map.chunks[index].size;
+    if (chunk_end >= offset + size)
+      break;
+  }
+  size_t begin(std::max(index + 1, read_pattern.prefetched_until));
+  size_t end(std::min(index + 1 + kReadAheadChunkCount, data_map.chunks.size()));
+  for (size_t i(begin); i < end; ++i)
+    Prefetch(data_map.chunks[i].hash);
+  read_pattern.prefetched_until = std::max(end, read_pattern.prefetched_until);
+}
+
+uint64_t ChunkPrefetcher::hit_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hit_count_;
+}
+
+uint64_t ChunkPrefetcher::request_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return request_count_;
+}
+
+void ChunkPrefetcher::Prefetch(const std::string& name) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.count(name) != 0)
+      return;
+  }
+  boost::shared_future<ImmutableData> chunk;
+  try {
+    chunk = get_functor_(ImmutableData::Name(Identity(name))).share();
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Failed to prefetch " << HexSubstr(name) << ": " << e.what();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (index_.count(name) != 0)
+    return;
+  index_.insert(std::make_pair(name, chunks_.insert(std::end(chunks_),
+                                                    std::make_pair(name, chunk))));
+  while (chunks_.size() > kMaxChunks_) {
+    index_.erase(chunks_.front().first);
+    chunks_.pop_front();
+  }
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -0,0 +1,143 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/chunk_uploader.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+#include "maidsafe/common/utils.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+ChunkUploader::ChunkUploader(PutFunctor put_functor, uint32_t max_in_flight, uint32_t max_queued)
+    : put_functor_(put_functor), kMaxQueued_(std::max(max_in_flight, max_queued)), mutex_(),
+      cond_var_(), outstanding_(), failed_(), max_queue_depth_(0), next_ticket_(0),
+      failure_count_(0), asio_service_(max_in_flight) {
+  if (!put_functor_ || max_in_flight == 0)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+}
+
+ChunkUploader::~ChunkUploader() {
+  WaitForQueued();
+  asio_service_.Stop();
+  if (!failed_.empty())
+    LOG(kError) << failed_.size() << " chunks were never stored.";
+}
+
+void ChunkUploader::Put(const ImmutableData& chunk, const std::string& batch) {
+  uint64_t ticket(0);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (outstanding_.size() >= kMaxQueued_)
+      LOG(kInfo) << "Chunk upload queue is full - waiting for space.";
+    cond_var_.wait(lock, [this] { return outstanding_.size() < kMaxQueued_; });
+    ticket = next_ticket_++;
+    outstanding_.insert(ticket);
+    max_queue_depth_ = std::max(max_queue_depth_, static_cast<uint32_t>(outstanding_.size()));
+  }
+  asio_service_.service().post([this, chunk, ticket, batch] { Store(chunk, ticket, batch); });
+}
+
+bool ChunkUploader::WaitForQueued(const std::string& batch) {
+  // The listing about to be stored may refer to chunks which failed before, and which only the
+  // uploader still holds.
+  std::vector<ImmutableData> retries;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto itr(std::begin(failed_)); itr != std::end(failed_);) {
+      if (itr->second.first == batch) {
+        retries.push_back(itr->second.second);
+        itr = failed_.erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+  }
+  for (const auto& chunk : retries)
+    Put(chunk, batch);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  const uint64_t end_ticket(next_ticket_);
+  cond_var_.wait(lock, [this, end_ticket] {
+    return outstanding_.empty() || *std::begin(outstanding_) >= end_ticket;
+  });
+  return std::none_of(std::begin(failed_), failed_.lower_bound(end_ticket),
+      [&batch](const std::pair<const uint64_t, std::pair<std::string, ImmutableData>>& failed) {
+        return failed.second.first == batch;
+      });
+}
+
+void ChunkUploader::DropFailed(const std::string& batch) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto itr(std::begin(failed_)); itr != std::end(failed_);) {
+    if (itr->second.first == batch)
+      itr = failed_.erase(itr);
+    else
+      ++itr;
+  }
+}
+
+uint32_t ChunkUploader::queue_depth() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<uint32_t>(outstanding_.size());
+}
+
+uint32_t ChunkUploader::max_queue_depth() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return max_queue_depth_;
+}
+
+uint64_t ChunkUploader::failure_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return failure_count_;
+}
+
+void ChunkUploader::Store(const ImmutableData& chunk, uint64_t ticket, const std::string& batch) {
+  bool succeeded(true);
+  try {
+    put_functor_(chunk);
+  }
+  catch (const std::exception& e) {
+    LOG(kError) << "Failed to store chunk " << HexSubstr(chunk.name()->string()) << ": "
+                << e.what();
+    succeeded = false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    outstanding_.erase(ticket);
+    if (!succeeded) {
+      failed_.insert(std::make_pair(ticket, std::make_pair(batch, chunk)));
+      ++failure_count_;
+    }
+  }
+  cond_var_.notify_all();
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -29,7 +29,43 @@ const boost::filesystem::path kRoot(boost::filesystem::path("/").make_preferred(
 const MaxVersions kMaxVersions(1);
 
 const std::chrono::steady_clock::duration kDirectoryInactivityDelay(std::chrono::seconds(3));
+const std::chrono::steady_clock::duration kMinDirectoryInactivityDelay(
+    std::chrono::milliseconds(500));
+const std::chrono::steady_clock::duration kMaxDirectoryStaleness(std::chrono::seconds(30));
 const std::chrono::steady_clock::duration kFileInactivityDelay(std::chrono::seconds(2));
+const std::chrono::steady_clock::duration kRemoteChangesCheckInterval(std::chrono::seconds(10));
+const std::chrono::steady_clock::duration kRemoteChangesMaxIdleTime(std::chrono::minutes(1));
+const std::chrono::steady_clock::duration kDirtyDirectoriesSweepInterval(
+    std::chrono::milliseconds(200));
+
+const uint32_t kDefaultMaxWrite(128 * 1024);
+const uint32_t kDefaultMaxReadahead(1024 * 1024);
+const uint32_t kDefaultMaxBackground(64);
+
+const double kDefaultAttributeTimeout(10.0);
+const double kDefaultEntryTimeout(10.0);
+const double kDefaultNegativeTimeout(1.0);
+
+const uint32_t kSequentialReadThreshold(2);
+const uint32_t kReadAheadChunkCount(4);
+const uint32_t kMaxPrefetchedChunks(32);
+
+const MemoryUsage kChunkCacheMemoryUsage(64 * 1024 * 1024);
+const DiskUsage kChunkCacheDiskUsage(1024 * 1024 * 1024);
+
+const MemoryUsage kBufferMemoryBudget(256 * 1024 * 1024);
+const MemoryUsage kMinBufferMemory(1024 * 1024);
+const std::chrono::steady_clock::duration kBufferBudgetTimeout(std::chrono::seconds(5));
+
+const uint32_t kMaxInFlightChunkPuts(8);
+const uint32_t kMaxQueuedChunkPuts(64);
+
+const uint32_t kTimerThreadCount(1);
+const uint32_t kMinStoreThreadCount(2);
+
+const uint32_t kMaxCachedDirectories(10000);
+const uint32_t kMaxSnapshotDirectories(20000);
+const uint32_t kMaxPrefetchedDirectories(16);
 
 }  // namespace detail
 
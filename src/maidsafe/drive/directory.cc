@@ -19,8 +19,10 @@
 #include "maidsafe/drive/directory.h"
 
 #include <algorithm>
+#include <exception>
 #include <iterator>
 
+#include "maidsafe/common/on_scope_exit.h"
 #include "maidsafe/common/profiler.h"
 
 #include "maidsafe/drive/meta_data.h"
@@ -37,45 +39,39 @@ namespace detail {
 
 namespace {
 
-std::function<void(const boost::system::error_code&)> GetStoreFunctor(
-    Directory* directory, std::function<void(Directory*)> put_functor,  // NOLINT
-    const boost::filesystem::path& path) {
-  return [=](const boost::system::error_code& ec) {  // NOLINT
-    if (ec != boost::asio::error::operation_aborted) {
-      LOG(kInfo) << "Storing " << path;
-      put_functor(directory);
-    } else {
-      LOG(kInfo) << "Timer was cancelled - not storing " << path;
-    }
-  };
-}
-
 void FlushEncryptor(FileContext* file_context,
                     std::function<void(const ImmutableData&)> put_chunk_functor,
                     std::vector<ImmutableData::Name>& chunks_to_be_incremented) {
   file_context->self_encryptor->Flush();
-  if (file_context->self_encryptor->original_data_map().chunks.empty()) {
-    // If the original data map didn't contain any chunks, just store the new ones.
-    for (const auto& chunk : file_context->self_encryptor->data_map().chunks) {
-      auto content(file_context->buffer->Get(chunk.hash));
-      put_chunk_functor(ImmutableData(content));
+  // Check each new chunk against those already stored when popped from the buffer, then against
+  // the original data map's chunks.  Store the truly new ones and increment the reference count on
+  // the existing ones.
+  const auto& original_chunks(file_context->self_encryptor->original_data_map().chunks);
+  for (const auto& chunk : file_context->self_encryptor->data_map().chunks) {
+    if (file_context->popped_chunks && file_context->popped_chunks->Take(chunk.hash))
+      continue;
+    if (std::any_of(std::begin(original_chunks), std::end(original_chunks),
+                    [&chunk](const encrypt::ChunkDetails& original_chunk) {
+                      return chunk.hash == original_chunk.hash;
+                    })) {
+      chunks_to_be_incremented.emplace_back(Identity(chunk.hash));
+      continue;
     }
-  } else {
-    // Check each new chunk against the original data map's chunks.  Store the new ones and
-    // increment the reference count on the existing chunks.
-    for (const auto& chunk : file_context->self_encryptor->data_map().chunks) {
-      if (std::any_of(std::begin(file_context->self_encryptor->original_data_map().chunks),
-                      std::end(file_context->self_encryptor->original_data_map().chunks),
-                      [&chunk](const encrypt::ChunkDetails& original_chunk) {
-                            return chunk.hash == original_chunk.hash;
-                      })) {
-        chunks_to_be_incremented.emplace_back(Identity(chunk.hash));
-      } else {
-        auto content(file_context->buffer->Get(chunk.hash));
-        put_chunk_functor(ImmutableData(content));
-      }
+    NonEmptyString content;
+    try {
+      content = file_context->buffer->Get(chunk.hash);
     }
+    catch (const std::exception&) {
+      if (!file_context->popped_chunks)
+        throw;
+      // The chunk is being popped from the buffer right now, and will be stored by the pop functor.
+      file_context->popped_chunks->Expect(chunk.hash);
+      continue;
+    }
+    put_chunk_functor(ImmutableData(content));
   }
+  if (file_context->popped_chunks)
+    file_context->popped_chunks->DeleteUntaken();
   if (*file_context->open_count == 0) {
     file_context->self_encryptor.reset();
     file_context->buffer.reset();
@@ -92,12 +88,15 @@ Directory::Directory(
     std::function<void(const std::vector<ImmutableData::Name>&)> increment_chunks_functor,
     const boost::filesystem::path& path)
         : mutex_(), cond_var_(), parent_id_(std::move(parent_id)),
-          directory_id_(std::move(directory_id)), timer_(io_service),
-          store_functor_(GetStoreFunctor(this, put_functor, path)),
-          put_chunk_functor_(put_chunk_functor),
+          directory_id_(std::move(directory_id)), timer_(io_service), put_functor_(put_functor),
+          path_(path), put_chunk_functor_(put_chunk_functor),
           increment_chunks_functor_(increment_chunks_functor), chunks_to_be_incremented_(),
-          versions_(), max_versions_(kMaxVersions), children_(), children_count_position_(0),
-          store_state_(StoreState::kComplete) {
+          versions_(), new_version_(), max_versions_(kMaxVersions), children_(),
+          store_state_(StoreState::kComplete), storing_(false), store_deferred_(false),
+          change_count_(0),
+          serialised_count_(0), stored_count_(0), pending_since_(), last_change_time_(),
+          mean_change_interval_(kDirectoryInactivityDelay), dirty_(false),
+          flushes_being_queued_(0) {
   DoScheduleForStoring();
 }
 
@@ -110,11 +109,15 @@ Directory::Directory(
     std::function<void(const std::vector<ImmutableData::Name>&)> increment_chunks_functor,
     const boost::filesystem::path& path)
         : mutex_(), cond_var_(), parent_id_(std::move(parent_id)), directory_id_(),
-          timer_(io_service), store_functor_(GetStoreFunctor(this, put_functor, path)),
+          timer_(io_service), put_functor_(put_functor), path_(path),
           put_chunk_functor_(put_chunk_functor),
           increment_chunks_functor_(increment_chunks_functor), chunks_to_be_incremented_(),
-          versions_(std::begin(versions), std::end(versions)), max_versions_(kMaxVersions),
-          children_(), children_count_position_(0), store_state_(StoreState::kComplete) {
+          versions_(std::begin(versions), std::end(versions)), new_version_(),
+          max_versions_(kMaxVersions), children_(), store_state_(StoreState::kComplete),
+          storing_(false), store_deferred_(false), change_count_(0), serialised_count_(0),
+          stored_count_(0),
+          pending_since_(), last_change_time_(), mean_change_interval_(kDirectoryInactivityDelay),
+          dirty_(false), flushes_being_queued_(0) {
   protobuf::Directory proto_directory;
   if (!proto_directory.ParseFromString(serialised_directory))
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
@@ -122,13 +125,17 @@ Directory::Directory(
   directory_id_ = Identity(proto_directory.directory_id());
   max_versions_ = MaxVersions(proto_directory.max_versions());
 
-  for (int i(0); i != proto_directory.children_size(); ++i)
-    children_.emplace_back(new FileContext(MetaData(proto_directory.children(i)), this));
-  SortAndResetChildrenCounter();
+  for (int i(0); i != proto_directory.children_size(); ++i) {
+    std::unique_ptr<FileContext> child(new FileContext(MetaData(proto_directory.children(i)),
+                                                       this));
+    auto name(child->meta_data.name);
+    children_.emplace_hint(std::end(children_), std::move(name), std::move(child));
+  }
 }
 
 Directory::~Directory() {
   std::unique_lock<std::mutex> lock(mutex_);
+  DoScheduleIfDirty();
   DoScheduleForStoring(false);
   bool result(cond_var_.wait_for(lock, kDirectoryInactivityDelay + std::chrono::milliseconds(500),
                                  [&] { return store_state_ == StoreState::kComplete; }));
@@ -138,16 +145,27 @@ Directory::~Directory() {
 
 std::string Directory::Serialise() {
   protobuf::Directory proto_directory;
+  // New chunks are only queued for storing once 'mutex_' has been released, since queueing blocks
+  // while the uploader is full.
+  std::vector<ImmutableData> new_chunks;
+  auto collect_chunk([&new_chunks](const ImmutableData& chunk) { new_chunks.push_back(chunk); });
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Chunks flushed by 'FlushChildAndDeleteEncryptor' must be queued before this version's chunks
+    // are waited for.
+    cond_var_.wait(lock, [this] { return flushes_being_queued_ == 0; });
+    // Changes marked before this point are covered by flushing the children below.
+    dirty_ = false;
     proto_directory.set_directory_id(directory_id_.string());
     proto_directory.set_max_versions(max_versions_.data);
 
-    for (const auto& child : children_) {
+    for (const auto& entry : children_) {
+      const auto& child(entry.second);
+      std::lock_guard<std::mutex> child_lock(*child->mutex);
       child->meta_data.ToProtobuf(proto_directory.add_children());
       if (child->self_encryptor) {  // Child is a file which has been opened
         child->timer->cancel();
-        FlushEncryptor(child.get(), put_chunk_functor_, chunks_to_be_incremented_);
+        FlushEncryptor(child.get(), collect_chunk, chunks_to_be_incremented_);
         child->flushed = false;
       } else if (child->meta_data.data_map) {
         if (child->flushed) {  // Child is a file which has already been flushed
@@ -162,82 +180,200 @@ std::string Directory::Serialise() {
     chunks_to_be_incremented_.clear();
 
     store_state_ = StoreState::kOngoing;
+    storing_ = true;
+    serialised_count_ = change_count_;
   }
+  for (const auto& chunk : new_chunks)
+    put_chunk_functor_(chunk);
   return proto_directory.SerializeAsString();
 }
 
 void Directory::FlushChildAndDeleteEncryptor(FileContext* child) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (child->self_encryptor)  // Child could already have been flushed via 'Directory::Serialise'
-    FlushEncryptor(child, put_chunk_functor_, chunks_to_be_incremented_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  DoFlushChildAndDeleteEncryptor(lock, child, false);
 }
 
-size_t Directory::VersionsCount() const {
-  return versions_.size();
+void Directory::FlushClosedChild(const fs::path& name, const FileContext* child) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto itr(Find(name));
+  if (itr == std::end(children_) || itr->second.get() != child)
+    return;  // removed or renamed since
+  DoFlushChildAndDeleteEncryptor(lock, itr->second.get(), true);
 }
 
-std::tuple<DirectoryId, StructuredDataVersions::VersionName>
-    Directory::InitialiseVersions(ImmutableData::Name version_id) {
-  std::tuple<DirectoryId, StructuredDataVersions::VersionName> result;
+void Directory::FlushChildAndApply(FileContext* child, std::mutex& other_mutex,
+                                   const std::function<void()>& functor) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  DoFlushChildAndDeleteEncryptor(lock, child, false, &other_mutex, functor);
+}
+
+void Directory::DoFlushChildAndDeleteEncryptor(std::unique_lock<std::mutex>& lock,
+                                               FileContext* child, bool only_if_closed,
+                                               std::mutex* other_mutex,
+                                               const std::function<void()>& functor) {
+  std::vector<ImmutableData> new_chunks;
+  std::exception_ptr functor_error;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    store_state_ = StoreState::kComplete;
-    if (versions_.empty()) {
-      versions_.emplace_back(0, version_id);
-      result = std::make_tuple(directory_id_, versions_[0]);
+    std::unique_lock<std::mutex> child_lock(*child->mutex, std::defer_lock);
+    std::unique_lock<std::mutex> other_lock;
+    if (other_mutex) {
+      other_lock = std::unique_lock<std::mutex>(*other_mutex, std::defer_lock);
+      std::lock(child_lock, other_lock);
     } else {
-      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::uninitialised));
+      child_lock.lock();
+    }
+    if (!child->self_encryptor) {  // Child could already have been flushed via 'Serialise'
+      if (functor)
+        functor();
+      return;
+    }
+    if (only_if_closed && *child->open_count > 0)
+      return;
+    FlushEncryptor(child, [&new_chunks](const ImmutableData& chunk) {
+                            new_chunks.push_back(chunk);
+                          }, chunks_to_be_incremented_);
+    ++flushes_being_queued_;
+    if (functor) {
+      try {
+        functor();
+      }
+      catch (...) {
+        functor_error = std::current_exception();
+      }
     }
   }
-  cond_var_.notify_one();
-  return result;
+  lock.unlock();
+  on_scope_exit queued([this] {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --flushes_being_queued_;
+    }
+    cond_var_.notify_all();
+  });
+  // The flushed data map refers to these chunks whether or not 'functor' succeeded.
+  for (const auto& chunk : new_chunks)
+    put_chunk_functor_(chunk);
+  if (functor_error)
+    std::rethrow_exception(functor_error);
+}
+
+size_t Directory::VersionsCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return versions_.size();
+}
+
+std::vector<StructuredDataVersions::VersionName> Directory::Versions() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::vector<StructuredDataVersions::VersionName>(std::begin(versions_),
+                                                          std::end(versions_));
+}
+
+std::tuple<DirectoryId, StructuredDataVersions::VersionName>
+    Directory::InitialiseVersions(ImmutableData::Name version_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!versions_.empty())
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::uninitialised));
+  new_version_.reset(new StructuredDataVersions::VersionName(0, version_id));
+  return std::make_tuple(directory_id_, *new_version_);
 }
 
 std::tuple<DirectoryId, StructuredDataVersions::VersionName, StructuredDataVersions::VersionName>
     Directory::AddNewVersion(ImmutableData::Name version_id) {
-  std::tuple<DirectoryId, StructuredDataVersions::VersionName,
-             StructuredDataVersions::VersionName> result;
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    store_state_ = StoreState::kComplete;
-    if (versions_.empty()) {
-      versions_.emplace_back(0, version_id);
-      result = std::make_tuple(directory_id_, StructuredDataVersions::VersionName(), versions_[0]);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (versions_.empty()) {
+    new_version_.reset(new StructuredDataVersions::VersionName(0, version_id));
+    return std::make_tuple(directory_id_, StructuredDataVersions::VersionName(), *new_version_);
+  }
+  new_version_.reset(new StructuredDataVersions::VersionName(versions_.front().index + 1,
+                                                             version_id));
+  return std::make_tuple(directory_id_, versions_.front(), *new_version_);
+}
+
+bool Directory::HasVersion(const StructuredDataVersions::VersionName& version) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::find(std::begin(versions_), std::end(versions_), version) != std::end(versions_);
+}
+
+bool Directory::ApplyRemoteVersion(Directory& remote) {
+  // Destroying a child which has been opened flushes it via 'FlushChildAndDeleteEncryptor', which
+  // locks 'mutex_', so children removed remotely are destroyed after 'lock' is released.
+  Children dropped;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (dirty_ || store_state_ != StoreState::kComplete)
+    return false;
+
+  auto in_use([](const FileContext& child) {
+    return *child.open_count > 0 || child.self_encryptor;
+  });
+  // Both sets of children are sorted by name, so merge them.
+  Children updated;
+  auto local_itr(std::begin(children_));
+  auto remote_itr(std::begin(remote.children_));
+  while (local_itr != std::end(children_) || remote_itr != std::end(remote.children_)) {
+    if (remote_itr == std::end(remote.children_) ||
+        (local_itr != std::end(children_) && local_itr->first < remote_itr->first)) {
+      // Removed remotely.
+      std::lock_guard<std::mutex> child_lock(*local_itr->second->mutex);
+      if (in_use(*local_itr->second))
+        updated.emplace_hint(std::end(updated), local_itr->first, std::move(local_itr->second));
+      else
+        dropped.emplace_hint(std::end(dropped), local_itr->first, std::move(local_itr->second));
+      ++local_itr;
+    } else if (local_itr == std::end(children_) || remote_itr->first < local_itr->first) {
+      // Added remotely.
+      remote_itr->second->parent = this;
+      updated.emplace_hint(std::end(updated), remote_itr->first, std::move(remote_itr->second));
+      ++remote_itr;
     } else {
-      versions_.emplace_front(versions_.front().index + 1, version_id);
-      auto itr(std::begin(versions_));
-      result = std::make_tuple(directory_id_, *(itr + 1), *itr);
-      if (versions_.size() > max_versions_)
-        versions_.pop_back();
+      {
+        std::lock_guard<std::mutex> child_lock(*local_itr->second->mutex);
+        if (!in_use(*local_itr->second))
+          local_itr->second->meta_data = std::move(remote_itr->second->meta_data);
+      }
+      updated.emplace_hint(std::end(updated), local_itr->first, std::move(local_itr->second));
+      ++local_itr;
+      ++remote_itr;
     }
   }
-  cond_var_.notify_one();
-  return result;
+  children_.swap(updated);
+  remote.children_.clear();
+  versions_ = remote.versions_;
+  max_versions_ = remote.max_versions_;
+  return true;
 }
 
-Directory::Children::iterator Directory::Find(const fs::path& name) {
-  return std::find_if(std::begin(children_), std::end(children_),
-                      [&name](const Children::value_type& file_context) {
-                           return file_context->meta_data.name == name; });
+void Directory::CompleteStore() {
+  // If further changes were made while storing, another store is already scheduled.
+  if (store_state_ == StoreState::kOngoing)
+    store_state_ = StoreState::kComplete;
 }
 
-Directory::Children::const_iterator Directory::Find(const fs::path& name) const {
-  return std::find_if(std::begin(children_), std::end(children_),
-                      [&name](const Children::value_type& file_context) {
-                           return file_context->meta_data.name == name; });
+Directory::Children::iterator Directory::Find(const fs::path& name) {
+  return children_.find(name);
 }
 
-void Directory::SortAndResetChildrenCounter() {
-  std::sort(std::begin(children_), std::end(children_),
-            [](const std::unique_ptr<FileContext>& lhs, const std::unique_ptr<FileContext>& rhs) {
-              return *lhs < *rhs;
-            });
-  children_count_position_ = 0;
+Directory::Children::const_iterator Directory::Find(const fs::path& name) const {
+  return children_.find(name);
 }
 
 void Directory::DoScheduleForStoring(bool use_delay) {
   if (use_delay) {
-    auto cancelled_count(timer_.expires_from_now(kDirectoryInactivityDelay));
+    // The store waits for a pause in changes, but no longer than 'kMaxDirectoryStaleness' after the
+    // first change not yet being stored.  The pause waited for scales with the recent interval
+    // between changes, so that bursts of changes are stored soon after they end.
+    const auto now(std::chrono::steady_clock::now());
+    const auto interval(std::min<std::chrono::steady_clock::duration>(now - last_change_time_,
+                                                                      kDirectoryInactivityDelay));
+    mean_change_interval_ = (3 * mean_change_interval_ + interval) / 4;
+    last_change_time_ = now;
+    if (store_state_ != StoreState::kPending)
+      pending_since_ = now;
+    const auto delay(std::max<std::chrono::steady_clock::duration>(
+        kMinDirectoryInactivityDelay,
+        std::min<std::chrono::steady_clock::duration>(4 * mean_change_interval_,
+                                                      kDirectoryInactivityDelay)));
+    auto cancelled_count(timer_.expires_at(std::min(now + delay,
+                                                    pending_since_ + kMaxDirectoryStaleness)));
 #ifndef NDEBUG
     if (cancelled_count > 0 && store_state_ != StoreState::kComplete) {
       LOG(kInfo) << "Successfully cancelled " << cancelled_count << " store functor.";
@@ -247,8 +383,9 @@ void Directory::DoScheduleForStoring(bool use_delay) {
     }
 #endif
     static_cast<void>(cancelled_count);
-    timer_.async_wait(store_functor_);
+    timer_.async_wait([this](const boost::system::error_code& ec) { StoreOnTimer(ec); });
     store_state_ = StoreState::kPending;
+    ++change_count_;
   } else if (store_state_ == StoreState::kPending) {
     // If 'use_delay' is false, the implication is that we should only store if there's already
     // a pending store waiting - i.e. we're just bringing forward the deadline of any outstanding
@@ -258,7 +395,7 @@ void Directory::DoScheduleForStoring(bool use_delay) {
       LOG(kInfo) << "Successfully brought forward schedule for " << cancelled_count
                  << " store functor.";
       assert(cancelled_count == 1);
-      timer_.get_io_service().post([this] { store_functor_(boost::system::error_code()); });
+      timer_.get_io_service().post([this] { StoreOnTimer(boost::system::error_code()); });
     } else {
       LOG(kWarning) << "Failed to cancel store functor.";
     }
@@ -272,9 +409,7 @@ void Directory::DoScheduleForStoring(bool use_delay) {
 
 bool Directory::HasChild(const fs::path& name) const {
   std::lock_guard<std::mutex> lock(mutex_);
-  return std::any_of(std::begin(children_), std::end(children_),
-      [&name](const Children::value_type& file_context) {
-          return file_context->meta_data.name == name; });
+  return Find(name) != std::end(children_);
 }
 
 const FileContext* Directory::GetChild(const fs::path& name) const {
@@ -284,10 +419,10 @@ const FileContext* Directory::GetChild(const fs::path& name) const {
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
   // The open_count must be >=0.  If > 0 and the context doesn't represent a directory, the buffer
   // and encryptor should be non-null.
-  assert(*(*itr)->open_count == 0 || (*(*itr)->open_count > 0 &&
-      ((*itr)->meta_data.directory_id ||
-          ((*itr)->buffer && (*itr)->self_encryptor && (*itr)->timer))));
-  return itr->get();
+  assert(*itr->second->open_count == 0 || (*itr->second->open_count > 0 &&
+      (itr->second->meta_data.directory_id ||
+          (itr->second->buffer && itr->second->self_encryptor && itr->second->timer))));
+  return itr->second.get();
 }
 
 FileContext* Directory::GetMutableChild(const fs::path& name) {
@@ -298,43 +433,70 @@ FileContext* Directory::GetMutableChild(const fs::path& name) {
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
   // The open_count must be >=0.  If > 0 and the context doesn't represent a directory, the buffer
   // and encryptor should be non-null.
-  assert(*(*itr)->open_count == 0 || (*(*itr)->open_count > 0 &&
-      ((*itr)->meta_data.directory_id ||
-          ((*itr)->buffer && (*itr)->self_encryptor && (*itr)->timer))));
-  return itr->get();
+  assert(*itr->second->open_count == 0 || (*itr->second->open_count > 0 &&
+      (itr->second->meta_data.directory_id ||
+          (itr->second->buffer && itr->second->self_encryptor && itr->second->timer))));
+  return itr->second.get();
 }
 
-const FileContext* Directory::GetChildAndIncrementCounter() {
+void Directory::ApplyToChild(const fs::path& name,
+                             const std::function<bool(FileContext&)>& functor) {
+  SCOPED_PROFILE
   std::lock_guard<std::mutex> lock(mutex_);
-  if (children_count_position_ < children_.size()) {
-    const FileContext* file_context(children_[children_count_position_].get());
-    ++children_count_position_;
-    return file_context;
+  auto itr(Find(name));
+  if (itr == std::end(children_))
+    BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
+  bool changed(false);
+  {
+    std::lock_guard<std::mutex> child_lock(*itr->second->mutex);
+    changed = functor(*itr->second);
   }
-  return nullptr;
+  if (changed)
+    DoScheduleForStoring();
 }
 
-void Directory::AddChild(FileContext&& child) {
+void Directory::ForEachChildAfter(const fs::path& name,
+                                  std::function<bool(const FileContext&)> functor) const {
   std::lock_guard<std::mutex> lock(mutex_);
-  auto itr(Find(child.meta_data.name));
-  if (itr != std::end(children_))
+  auto itr(name.empty() ? std::begin(children_) : children_.upper_bound(name));
+  while (itr != std::end(children_) && functor(*itr->second))
+    ++itr;
+}
+
+FileContext* Directory::AddChild(FileContext&& child) {
+  return AddChild(std::unique_ptr<FileContext>(new FileContext(std::move(child))));
+}
+
+FileContext* Directory::AddChild(std::unique_ptr<FileContext> child) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(children_.lower_bound(child->meta_data.name));
+  if (itr != std::end(children_) && itr->first == child->meta_data.name)
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::file_exists));
-  child.parent = this;
-  children_.emplace_back(new FileContext(std::move(child)));
-  SortAndResetChildrenCounter();
+  {
+    std::lock_guard<std::mutex> child_lock(*child->mutex);
+    child->parent = this;
+  }
+  FileContext* added(child.get());
+  auto name(child->meta_data.name);
+  children_.emplace_hint(itr, std::move(name), std::move(child));
   DoScheduleForStoring();
+  return added;
 }
 
 FileContext Directory::RemoveChild(const fs::path& name) {
+  std::unique_ptr<FileContext> file_context(TakeChild(name));
+  return std::move(*file_context);
+}
+
+std::unique_ptr<FileContext> Directory::TakeChild(const fs::path& name) {
   std::lock_guard<std::mutex> lock(mutex_);
   auto itr(Find(name));
   if (itr == std::end(children_))
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
-  std::unique_ptr<FileContext> file_context(std::move(*itr));
+  std::unique_ptr<FileContext> file_context(std::move(itr->second));
   children_.erase(itr);
-  SortAndResetChildrenCounter();
   DoScheduleForStoring();
-  return std::move(*file_context);
+  return file_context;
 }
 
 void Directory::RenameChild(const fs::path& old_name, const fs::path& new_name) {
@@ -343,21 +505,32 @@ void Directory::RenameChild(const fs::path& old_name, const fs::path& new_name)
   auto itr(Find(old_name));
   if (itr == std::end(children_))
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
-  (*itr)->meta_data.name = new_name;
-  SortAndResetChildrenCounter();
+  std::unique_ptr<FileContext> file_context(std::move(itr->second));
+  children_.erase(itr);
+  file_context->meta_data.name = new_name;
+  children_.emplace(new_name, std::move(file_context));
   DoScheduleForStoring();
 }
 
-void Directory::ResetChildrenCounter() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  children_count_position_ = 0;
-}
-
 bool Directory::empty() const {
   std::lock_guard<std::mutex> lock(mutex_);
   return children_.empty();
 }
 
+bool Directory::CanBeEvicted() const {
+  std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+  if (!lock.owns_lock() || dirty_ || storing_ || store_state_ != StoreState::kComplete ||
+      flushes_being_queued_ != 0) {
+    return false;
+  }
+  for (const auto& child : children_) {
+    std::unique_lock<std::mutex> child_lock(*child.second->mutex, std::try_to_lock);
+    if (!child_lock.owns_lock() || *child.second->open_count > 0 || child.second->self_encryptor)
+      return false;
+  }
+  return true;
+}
+
 ParentId Directory::parent_id() const {
   std::lock_guard<std::mutex> lock(mutex_);
   return parent_id_;
@@ -371,11 +544,11 @@ void Directory::SetNewParent(const ParentId parent_id, std::function<void(Direct
   assert(result);
   static_cast<void>(result);
   parent_id_ = parent_id;
-  store_functor_ = GetStoreFunctor(this, put_functor, path);
+  put_functor_ = put_functor;
+  path_ = path;
 }
 
 DirectoryId Directory::directory_id() const {
-  std::lock_guard<std::mutex> lock(mutex_);
   return directory_id_;
 }
 
@@ -384,11 +557,104 @@ void Directory::ScheduleForStoring() {
   DoScheduleForStoring();
 }
 
+void Directory::ScheduleIfDirty() {
+  if (!dirty_)
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  DoScheduleIfDirty();
+}
+
+void Directory::DoScheduleIfDirty() {
+  if (dirty_.exchange(false))
+    DoScheduleForStoring();
+}
+
 void Directory::StoreImmediatelyIfPending() {
   std::lock_guard<std::mutex> lock(mutex_);
+  DoScheduleIfDirty();
   DoScheduleForStoring(false);
 }
 
+void Directory::Sync() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  DoScheduleIfDirty();
+  const uint64_t target(change_count_);
+  while (stored_count_ < target) {
+    if (!storing_) {
+      // Take over the pending store.  If its timer has already expired, the handler will find this
+      // store running.  Other callers will wait for it to complete.
+      LOG(kInfo) << "Storing " << path_ << " immediately.";
+      timer_.cancel();
+      storing_ = true;
+      auto put_functor(put_functor_);
+      lock.unlock();
+      put_functor(this);
+      lock.lock();
+    } else {
+      // Wait for the running store, since it may not cover all changes made before this call.
+      cond_var_.wait(lock);
+    }
+  }
+}
+
+void Directory::StoreOnTimer(const boost::system::error_code& ec) {
+  if (ec == boost::asio::error::operation_aborted) {
+    LOG(kInfo) << "Timer was cancelled - not storing " << HexSubstr(directory_id_.string());
+    return;
+  }
+  std::function<void(Directory*)> put_functor;  // NOLINT
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (storing_) {
+      LOG(kInfo) << "Deferring store of " << path_ << " until the running one ends.";
+      store_deferred_ = true;
+      return;
+    }
+    LOG(kInfo) << "Storing " << path_;
+    storing_ = true;
+    put_functor = put_functor_;
+  }
+  put_functor(this);
+}
+
+void Directory::StartDeferredStore() {
+  // The deferred store's delay has already passed, so it's started straight away, unless the
+  // attempt just ended already covered the changes it was for.
+  if (store_deferred_ && store_state_ == StoreState::kPending) {
+    timer_.cancel();
+    timer_.get_io_service().post([this] { StoreOnTimer(boost::system::error_code()); });
+  }
+  store_deferred_ = false;
+}
+
+void Directory::StoreSucceeded() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (new_version_) {
+      versions_.push_front(*new_version_);
+      if (versions_.size() > max_versions_)
+        versions_.pop_back();
+      new_version_.reset();
+    }
+    CompleteStore();
+    storing_ = false;
+    stored_count_ = std::max(stored_count_, serialised_count_);
+    StartDeferredStore();
+  }
+  cond_var_.notify_all();
+}
+
+void Directory::StoreFailed() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    new_version_.reset();
+    storing_ = false;
+    store_deferred_ = false;
+    DoScheduleForStoring();
+  }
+  cond_var_.notify_all();
+}
+
 bool operator<(const Directory& lhs, const Directory& rhs) {
   return lhs.directory_id() < rhs.directory_id();
 }
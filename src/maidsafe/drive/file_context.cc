@@ -18,6 +18,8 @@
 
 #include "maidsafe/drive/file_context.h"
 
+#include <map>
+#include <string>
 #include <utility>
 
 #include "maidsafe/drive/directory.h"
@@ -28,22 +30,70 @@ namespace drive {
 
 namespace detail {
 
+PoppedChunks::PoppedChunks(
+    std::function<void(const ImmutableData::Name&)> delete_chunk_functor)  // NOLINT
+    : delete_chunk_functor_(delete_chunk_functor), mutex_(), stored_(), expected_() {}
+
+void PoppedChunks::Add(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(expected_.find(name));
+  if (itr == std::end(expected_)) {
+    ++stored_[name];
+  } else if (--itr->second == 0) {
+    expected_.erase(itr);
+  }
+}
+
+bool PoppedChunks::Take(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(stored_.find(name));
+  if (itr == std::end(stored_))
+    return false;
+  if (--itr->second == 0)
+    stored_.erase(itr);
+  return true;
+}
+
+void PoppedChunks::Expect(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++expected_[name];
+}
+
+void PoppedChunks::DeleteUntaken() {
+  std::map<std::string, int> untaken;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    untaken.swap(stored_);
+  }
+  for (const auto& chunk : untaken) {
+    for (int i(0); i != chunk.second; ++i)
+      delete_chunk_functor_(ImmutableData::Name(Identity(chunk.first)));
+  }
+}
+
 FileContext::FileContext()
-    : meta_data(), buffer(), self_encryptor(), timer(), open_count(new std::atomic<int>(0)),
-      parent(nullptr), flushed(false) {}
+    : meta_data(), buffer(), self_encryptor(), read_pattern(), write_pattern(), popped_chunks(),
+      timer(), open_count(new std::atomic<int>(0)), mutex(new std::mutex), parent(nullptr),
+      flushed(false) {}
 
 FileContext::FileContext(FileContext&& other)
     : meta_data(std::move(other.meta_data)), buffer(std::move(other.buffer)),
-      self_encryptor(std::move(other.self_encryptor)), timer(std::move(other.timer)),
-      open_count(std::move(other.open_count)), parent(other.parent), flushed(other.flushed) {}
+      self_encryptor(std::move(other.self_encryptor)),
+      read_pattern(std::move(other.read_pattern)),
+      write_pattern(std::move(other.write_pattern)),
+      popped_chunks(std::move(other.popped_chunks)), timer(std::move(other.timer)),
+      open_count(std::move(other.open_count)), mutex(std::move(other.mutex)),
+      parent(other.parent), flushed(other.flushed) {}
 
 FileContext::FileContext(MetaData meta_data_in, Directory* parent_in)
-    : meta_data(std::move(meta_data_in)), buffer(), self_encryptor(), timer(),
-      open_count(new std::atomic<int>(0)), parent(parent_in), flushed(false) {}
+    : meta_data(std::move(meta_data_in)), buffer(), self_encryptor(), read_pattern(),
+      write_pattern(), popped_chunks(), timer(), open_count(new std::atomic<int>(0)),
+      mutex(new std::mutex), parent(parent_in), flushed(false) {}
 
 FileContext::FileContext(const boost::filesystem::path& name, bool is_directory)
-    : meta_data(name, is_directory), buffer(), self_encryptor(), timer(),
-      open_count(new std::atomic<int>(0)), parent(nullptr), flushed(false) {}
+    : meta_data(name, is_directory), buffer(), self_encryptor(), read_pattern(),
+      write_pattern(), popped_chunks(), timer(), open_count(new std::atomic<int>(0)),
+      mutex(new std::mutex), parent(nullptr), flushed(false) {}
 
 FileContext& FileContext::operator=(FileContext other) {
   swap(*this, other);
@@ -62,8 +112,12 @@ void swap(FileContext& lhs, FileContext& rhs) MAIDSAFE_NOEXCEPT {
   swap(lhs.meta_data, rhs.meta_data);
   swap(lhs.buffer, rhs.buffer);
   swap(lhs.self_encryptor, rhs.self_encryptor);
+  swap(lhs.read_pattern, rhs.read_pattern);
+  swap(lhs.write_pattern, rhs.write_pattern);
+  swap(lhs.popped_chunks, rhs.popped_chunks);
   swap(lhs.timer, rhs.timer);
   swap(lhs.open_count, rhs.open_count);
+  swap(lhs.mutex, rhs.mutex);
   swap(lhs.parent, rhs.parent);
   swap(lhs.flushed, rhs.flushed);
 }
@@ -143,6 +143,21 @@ po::options_description VisibleOptions() {
       ("drive_name,N", po::value<std::string>(), " virtual drive name")
       ("create,C", " Must be called on first run")
       ("check_data,Z", " check all data in chunkstore");
+#ifndef MAIDSAFE_WIN32
+  options.add_options()
+      ("max_write", po::value<uint32_t>()->default_value(detail::kDefaultMaxWrite),
+                    " largest write request (bytes) the kernel may send")
+      ("max_readahead", po::value<uint32_t>()->default_value(detail::kDefaultMaxReadahead),
+                        " maximum kernel readahead (bytes)")
+      ("max_background", po::value<uint32_t>()->default_value(detail::kDefaultMaxBackground),
+                         " maximum number of outstanding background requests")
+      ("attr_timeout", po::value<double>()->default_value(detail::kDefaultAttributeTimeout),
+                       " seconds for which the kernel may cache file attributes")
+      ("entry_timeout", po::value<double>()->default_value(detail::kDefaultEntryTimeout),
+                        " seconds for which the kernel may cache name lookups")
+      ("negative_timeout", po::value<double>()->default_value(detail::kDefaultNegativeTimeout),
+                           " seconds for which the kernel may cache failed name lookups");
+#endif
   return options;
 }
 
@@ -220,6 +235,14 @@ void GetFromProgramOptions(const po::variables_map& variables_map, Options& opti
     options.root_parent_id = Identity(parent_id);
   options.drive_name = GetStringFromProgramOption("drive_name", variables_map);
   options.create_store = (variables_map.count("create") != 0);
+#ifndef MAIDSAFE_WIN32
+  options.max_write = variables_map.at("max_write").as<uint32_t>();
+  options.max_readahead = variables_map.at("max_readahead").as<uint32_t>();
+  options.max_background = variables_map.at("max_background").as<uint32_t>();
+  options.attribute_timeout = variables_map.at("attr_timeout").as<double>();
+  options.entry_timeout = variables_map.at("entry_timeout").as<double>();
+  options.negative_timeout = variables_map.at("negative_timeout").as<double>();
+#endif
 }
 
 void ValidateOptions(const Options& options) {
@@ -280,6 +303,10 @@ int MountAndWaitForIpcNotification(const Options& options) {
 #ifdef MAIDSAFE_WIN32
   std::string guid(BOOST_PP_STRINGIZE(PRODUCT_ID));
   drive.SetGuid(guid);
+#else
+  drive.SetTransferLimits(options.max_write, options.max_readahead, options.max_background);
+  drive.SetCacheTimeouts(options.attribute_timeout, options.entry_timeout,
+                         options.negative_timeout);
 #endif
   // Start a thread to poll the parent process' continued existence *before* calling drive.Mount().
   std::thread poll_parent([&] { MonitorParentProcess(options); });
@@ -316,6 +343,10 @@ int MountAndWaitForSignal(const Options& options) {
 #ifdef MAIDSAFE_WIN32
   std::string guid(BOOST_PP_STRINGIZE(PRODUCT_ID));
   drive.SetGuid(guid);
+#else
+  drive.SetTransferLimits(options.max_write, options.max_readahead, options.max_background);
+  drive.SetCacheTimeouts(options.attribute_timeout, options.entry_timeout,
+                         options.negative_timeout);
 #endif
   drive.Mount();
   return 0;
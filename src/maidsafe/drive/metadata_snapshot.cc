@@ -0,0 +1,284 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+
+#include "maidsafe/drive/metadata_snapshot.h"
+
+#include <algorithm>
+#include <cassert>
+#include <ctime>
+#include <iterator>
+#include <tuple>
+#include <utility>
+
+#include "boost/filesystem/operations.hpp"
+#include "cryptopp/aes.h"
+#include "cryptopp/filters.h"
+#include "cryptopp/gcm.h"
+
+#include "maidsafe/common/crypto.h"
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+#include "maidsafe/common/utils.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+
+#include "maidsafe/drive/proto_structs.pb.h"
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace {
+
+const size_t kIvSize(12);
+const size_t kTagSize(16);
+
+// The encryption key and the key used to name files, neither of which can be derived from the
+// drive's identities alone.
+std::string DeriveKeys(const NonEmptyString& secret) {
+  return crypto::Hash<crypto::SHA512>(std::string("MaidSafe-Drive metadata snapshot") +
+                                      secret.string()).string();
+}
+
+std::vector<StructuredDataVersions::VersionName> ParseVersions(
+    const protobuf::MetadataSnapshotEntry& proto_entry) {
+  std::vector<StructuredDataVersions::VersionName> versions;
+  for (const auto& proto_version : proto_entry.versions()) {
+    versions.emplace_back(proto_version.index(),
+                          ImmutableData::Name(Identity(proto_version.id())));
+  }
+  if (versions.empty())
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+  return versions;
+}
+
+}  // unnamed namespace
+
+MetadataSnapshot::MetadataSnapshot(const fs::path& snapshot_dir, const Identity& unique_user_id,
+                                   const Identity& root_parent_id, const NonEmptyString& secret,
+                                   size_t max_entries)
+    : kEncryptionKey_(DeriveKeys(secret).substr(0, crypto::AES256_KeySize)),
+      kNameKey_(DeriveKeys(secret).substr(crypto::AES256_KeySize)),
+      kDir_(snapshot_dir / HexEncode(crypto::Hash<crypto::SHA512>(
+          kNameKey_ + unique_user_id.string() + root_parent_id.string()).string()).substr(0, 32)),
+      kMaxEntries_(max_entries), mutex_(), entries_(), lru_(), hit_count_(0), miss_count_(0) {
+  Load();
+}
+
+bool MetadataSnapshot::Get(const DirectoryId& directory_id,
+                           const StructuredDataVersions::VersionName& version_tip,
+                           std::string& serialised_listing,
+                           std::vector<StructuredDataVersions::VersionName>& versions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(entries_.find(directory_id));
+  if (itr == std::end(entries_) || !(itr->second.version_tip == version_tip)) {
+    ++miss_count_;
+    return false;
+  }
+  try {
+    std::string content;
+    if (!ReadFile(EntryPath(directory_id), &content))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+    protobuf::MetadataSnapshotEntry proto_entry;
+    if (!proto_entry.ParseFromString(Decrypt(content)) ||
+        proto_entry.directory_id() != directory_id.string()) {
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+    }
+    auto parsed_versions(ParseVersions(proto_entry));
+    if (!(parsed_versions.front() == version_tip))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+    serialised_listing = proto_entry.serialised_listing();
+    versions.swap(parsed_versions);
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Discarding snapshot of " << HexSubstr(directory_id.string()) << ": "
+                  << e.what();
+    Erase(itr);
+    ++miss_count_;
+    return false;
+  }
+  lru_.splice(std::end(lru_), lru_, itr->second.lru_itr);
+  ++hit_count_;
+  return true;
+}
+
+void MetadataSnapshot::Put(const DirectoryId& directory_id,
+                           const std::vector<StructuredDataVersions::VersionName>& versions,
+                           const std::string& serialised_listing) {
+  assert(!versions.empty());
+  protobuf::MetadataSnapshotEntry proto_entry;
+  proto_entry.set_directory_id(directory_id.string());
+  for (const auto& version : versions) {
+    auto proto_version(proto_entry.add_versions());
+    proto_version->set_index(version.index);
+    proto_version->set_id(version.id->string());
+  }
+  proto_entry.set_serialised_listing(serialised_listing);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(entries_.find(directory_id));
+  try {
+    boost::system::error_code error_code;
+    if (!fs::exists(kDir_, error_code))
+      fs::create_directories(kDir_);
+    // Written alongside and renamed, so that a crash while writing leaves the previous listing.
+    const fs::path path(EntryPath(directory_id)), temp_path(path.string() + ".tmp");
+    if (!WriteFile(temp_path, Encrypt(proto_entry.SerializeAsString())))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+    fs::rename(temp_path, path);
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "Failed to write snapshot of " << HexSubstr(directory_id.string()) << ": "
+                  << e.what();
+    if (itr != std::end(entries_))
+      Erase(itr);
+    return;
+  }
+  if (itr == std::end(entries_)) {
+    entries_.insert(std::make_pair(directory_id,
+                                   Entry(versions.front(), lru_.insert(std::end(lru_),
+                                                                       directory_id))));
+  } else {
+    itr->second.version_tip = versions.front();
+    lru_.splice(std::end(lru_), lru_, itr->second.lru_itr);
+  }
+  EvictExcess();
+}
+
+void MetadataSnapshot::Remove(const DirectoryId& directory_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(entries_.find(directory_id));
+  if (itr != std::end(entries_))
+    Erase(itr);
+}
+
+size_t MetadataSnapshot::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+uint64_t MetadataSnapshot::hit_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hit_count_;
+}
+
+uint64_t MetadataSnapshot::miss_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return miss_count_;
+}
+
+void MetadataSnapshot::Load() {
+  boost::system::error_code error_code;
+  if (!fs::exists(kDir_, error_code))
+    return;
+  std::vector<fs::path> paths;
+  for (fs::directory_iterator itr(kDir_, error_code), end; !error_code && itr != end;
+       itr.increment(error_code)) {
+    paths.push_back(itr->path());
+  }
+  // Only the directory IDs and tip versions are kept in memory; listings are read when needed.
+  typedef std::tuple<std::time_t, DirectoryId, StructuredDataVersions::VersionName> Loaded;
+  std::vector<Loaded> loaded;
+  for (const auto& path : paths) {
+    try {
+      std::string content;
+      if (path.extension() == ".tmp" || !ReadFile(path, &content))
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+      protobuf::MetadataSnapshotEntry proto_entry;
+      if (!proto_entry.ParseFromString(Decrypt(content)))
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+      DirectoryId directory_id(proto_entry.directory_id());
+      // A file moved to another's name would otherwise serve the wrong listing.
+      if (EntryPath(directory_id) != path)
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+      loaded.emplace_back(fs::last_write_time(path), directory_id,
+                          ParseVersions(proto_entry).front());
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Discarding metadata snapshot file " << path << ": " << e.what();
+      fs::remove(path, error_code);
+    }
+  }
+  // Least recently written first.
+  std::sort(std::begin(loaded), std::end(loaded), [](const Loaded& lhs, const Loaded& rhs) {
+    return std::get<0>(lhs) < std::get<0>(rhs);
+  });
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& entry : loaded) {
+    entries_.insert(std::make_pair(std::get<1>(entry),
+                                   Entry(std::get<2>(entry), lru_.insert(std::end(lru_),
+                                                                         std::get<1>(entry)))));
+  }
+  EvictExcess();
+  LOG(kInfo) << "Loaded metadata snapshot of " << entries_.size() << " directories.";
+}
+
+fs::path MetadataSnapshot::EntryPath(const DirectoryId& directory_id) const {
+  return kDir_ / HexEncode(crypto::Hash<crypto::SHA512>(kNameKey_ + directory_id.string())
+                               .string()).substr(0, 32);
+}
+
+void MetadataSnapshot::Erase(std::map<DirectoryId, Entry>::iterator itr) {
+  boost::system::error_code error_code;
+  fs::remove(EntryPath(itr->first), error_code);
+  lru_.erase(itr->second.lru_itr);
+  entries_.erase(itr);
+}
+
+void MetadataSnapshot::EvictExcess() {
+  while (entries_.size() > kMaxEntries_)
+    Erase(entries_.find(lru_.front()));
+}
+
+std::string MetadataSnapshot::Encrypt(const std::string& plain_text) const {
+  const std::string iv(RandomString(kIvSize));
+  CryptoPP::GCM<CryptoPP::AES>::Encryption encryption;
+  encryption.SetKeyWithIV(reinterpret_cast<const unsigned char*>(kEncryptionKey_.data()),
+                          kEncryptionKey_.size(),
+                          reinterpret_cast<const unsigned char*>(iv.data()), iv.size());
+  std::string cipher_text;
+  CryptoPP::StringSource source(plain_text, true, new CryptoPP::AuthenticatedEncryptionFilter(
+      encryption, new CryptoPP::StringSink(cipher_text), false, kTagSize));
+  return iv + cipher_text;
+}
+
+std::string MetadataSnapshot::Decrypt(const std::string& cipher_text) const {
+  if (cipher_text.size() < kIvSize + kTagSize)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+  CryptoPP::GCM<CryptoPP::AES>::Decryption decryption;
+  decryption.SetKeyWithIV(reinterpret_cast<const unsigned char*>(kEncryptionKey_.data()),
+                          kEncryptionKey_.size(),
+                          reinterpret_cast<const unsigned char*>(cipher_text.data()), kIvSize);
+  std::string plain_text;
+  // Throws if the tag doesn't match, i.e. if the file was modified or encrypted with another key.
+  CryptoPP::StringSource source(cipher_text.substr(kIvSize), true,
+      new CryptoPP::AuthenticatedDecryptionFilter(decryption,
+          new CryptoPP::StringSink(plain_text),
+          CryptoPP::AuthenticatedDecryptionFilter::THROW_EXCEPTION, kTagSize));
+  return plain_text;
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
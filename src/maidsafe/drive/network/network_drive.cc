@@ -229,6 +229,21 @@ po::options_description VisibleOptions() {
       ("keys_path", po::value<std::string>()->default_value(fs::path(
                        fs::temp_directory_path(error_code) / "key_directory.dat").string()),
                     "Path to keys file");
+#ifndef MAIDSAFE_WIN32
+  options.add_options()
+      ("max_write", po::value<uint32_t>()->default_value(detail::kDefaultMaxWrite),
+                    " largest write request (bytes) the kernel may send")
+      ("max_readahead", po::value<uint32_t>()->default_value(detail::kDefaultMaxReadahead),
+                        " maximum kernel readahead (bytes)")
+      ("max_background", po::value<uint32_t>()->default_value(detail::kDefaultMaxBackground),
+                         " maximum number of outstanding background requests")
+      ("attr_timeout", po::value<double>()->default_value(detail::kDefaultAttributeTimeout),
+                       " seconds for which the kernel may cache file attributes")
+      ("entry_timeout", po::value<double>()->default_value(detail::kDefaultEntryTimeout),
+                        " seconds for which the kernel may cache name lookups")
+      ("negative_timeout", po::value<double>()->default_value(detail::kDefaultNegativeTimeout),
+                           " seconds for which the kernel may cache failed name lookups");
+#endif
   return options;
 }
 
@@ -311,6 +326,14 @@ void GetFromProgramOptions(const po::variables_map& variables_map, Options& opti
 
   options.drive_name = GetStringFromProgramOption("drive_name", variables_map);
   options.create_store = (variables_map.count("create") != 0);
+#ifndef MAIDSAFE_WIN32
+  options.max_write = variables_map.at("max_write").as<uint32_t>();
+  options.max_readahead = variables_map.at("max_readahead").as<uint32_t>();
+  options.max_background = variables_map.at("max_background").as<uint32_t>();
+  options.attribute_timeout = variables_map.at("attr_timeout").as<double>();
+  options.entry_timeout = variables_map.at("entry_timeout").as<double>();
+  options.negative_timeout = variables_map.at("negative_timeout").as<double>();
+#endif
   options.keys_path = GetStringFromProgramOption("keys_path", variables_map);
   options.peer_endpoint = GetStringFromProgramOption("peer", variables_map);
   options.key_index = variables_map.at("key_index").as<int>();
@@ -415,10 +438,16 @@ int MountAndWait(const Options& options, bool use_ipc) {
 
 //   bool create_store(!account_exists);
   NetworkDrive drive(g_client_nfs_, unique_id, root_parent_id, options.mount_path, GetUserAppDir(),
-                     options.drive_name, options.mount_status_shared_object_name, false);
+                     options.drive_name, options.mount_status_shared_object_name, false,
+                     asymm::EncodeKey(maid->private_key()).string());
   g_network_drive = &drive;
 #ifdef MAIDSAFE_WIN32
   g_network_drive->SetGuid(BOOST_PP_STRINGIZE(PRODUCT_ID));
+#else
+  g_network_drive->SetTransferLimits(options.max_write, options.max_readahead,
+                                     options.max_background);
+  g_network_drive->SetCacheTimeouts(options.attribute_timeout, options.entry_timeout,
+                                    options.negative_timeout);
 #endif
   if (use_ipc) {
     return MountAndWaitForIpcNotification(options, drive);
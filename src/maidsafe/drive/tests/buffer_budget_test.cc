@@ -0,0 +1,76 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <chrono>
+#include <future>
+
+#include "maidsafe/common/test.h"
+
+#include "maidsafe/drive/buffer_budget.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+TEST_CASE("Buffer budget shares", "[BufferBudget][behavioural]") {
+  const uint64_t kTotal(8), kMin(2), kMax(4);
+  BufferBudget budget(MemoryUsage(kTotal), MemoryUsage(kMin), MemoryUsage(kMax));
+  const std::chrono::milliseconds kNoWait(0);
+
+  // The first buffer is limited by the per-buffer maximum, later ones get an equal share
+  auto first(budget.Reserve(kNoWait));
+  CHECK(first.data == kMax);
+  auto second(budget.Reserve(kNoWait));
+  CHECK(second.data == kTotal / 2);
+  CHECK(budget.available().data == 0);
+
+  // With the budget exhausted, new buffers get nothing once the timeout expires
+  auto third(budget.Reserve(kNoWait));
+  CHECK(third.data == 0);
+  CHECK(budget.buffer_count() == 3);
+
+  budget.Release(first);
+  budget.Release(second);
+  budget.Release(third);
+  CHECK(budget.available().data == kTotal);
+  CHECK(budget.buffer_count() == 0);
+}
+
+TEST_CASE("Buffer budget waits for release", "[BufferBudget][behavioural]") {
+  BufferBudget budget(MemoryUsage(4), MemoryUsage(2), MemoryUsage(4));
+  auto first(budget.Reserve(std::chrono::milliseconds(0)));
+  REQUIRE(first.data == 4);
+  auto second(std::async(std::launch::async,
+                         [&] { return budget.Reserve(std::chrono::seconds(10)); }));
+  CHECK(second.wait_for(std::chrono::milliseconds(100)) == std::future_status::timeout);
+  budget.Release(first);
+  REQUIRE(second.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+  CHECK(second.get().data == 2);
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
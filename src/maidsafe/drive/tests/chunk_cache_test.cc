@@ -0,0 +1,107 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/operations.hpp"
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+
+#include "maidsafe/drive/chunk_cache.h"
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+namespace {
+
+std::pair<std::string, NonEmptyString> MakeChunk(size_t size) {
+  ImmutableData chunk(NonEmptyString(RandomString(size)));
+  return std::make_pair(chunk.name()->string(), chunk.data());
+}
+
+}  // unnamed namespace
+
+TEST_CASE("Chunk cache tiers", "[ChunkCache][behavioural]") {
+  maidsafe::test::TestPath test_dir(maidsafe::test::CreateTestPath("MaidSafe_Test_Drive"));
+  const size_t kChunkSize(1024);
+  ChunkCache cache(MemoryUsage(2 * kChunkSize), DiskUsage(2 * kChunkSize), *test_dir / "cache");
+  std::vector<std::pair<std::string, NonEmptyString>> chunks;
+  for (int i(0); i != 5; ++i)
+    chunks.push_back(MakeChunk(kChunkSize));
+
+  NonEmptyString content;
+  CHECK_FALSE(cache.Get(chunks[0].first, content));
+  CHECK(cache.miss_count() == 1);
+
+  // The two most recent chunks are held in memory, the two before on disk, and the first dropped
+  for (const auto& chunk : chunks)
+    cache.Put(chunk.first, chunk.second);
+  REQUIRE(cache.Get(chunks[4].first, content));
+  CHECK(content == chunks[4].second);
+  REQUIRE(cache.Get(chunks[3].first, content));
+  CHECK(content == chunks[3].second);
+  CHECK(cache.memory_hit_count() == 2);
+  REQUIRE(cache.Get(chunks[1].first, content));
+  CHECK(content == chunks[1].second);
+  CHECK(cache.disk_hit_count() == 1);
+  CHECK_FALSE(cache.Get(chunks[0].first, content));
+  CHECK(cache.miss_count() == 2);
+
+  // Corrupt chunks on disk are discarded.  'chunks[1]' was moved back into memory, pushing
+  // 'chunks[4]' out to disk alongside 'chunks[2]'.
+  for (fs::directory_iterator itr(*test_dir / "cache"), end; itr != end; ++itr)
+    REQUIRE(WriteFile(itr->path(), RandomString(kChunkSize)));
+  CHECK_FALSE(cache.Get(chunks[2].first, content));
+  CHECK_FALSE(cache.Get(chunks[4].first, content));
+  CHECK(cache.miss_count() == 4);
+  CHECK(cache.disk_hit_count() == 1);
+}
+
+TEST_CASE("Chunk cache cleans up", "[ChunkCache][behavioural]") {
+  maidsafe::test::TestPath test_dir(maidsafe::test::CreateTestPath("MaidSafe_Test_Drive"));
+  const fs::path kCachePath(*test_dir / "cache");
+  {
+    ChunkCache cache(MemoryUsage(0), DiskUsage(1024 * 1024), kCachePath);
+    auto chunk(MakeChunk(1024));
+    cache.Put(chunk.first, chunk.second);
+    CHECK(fs::exists(kCachePath));
+    NonEmptyString content;
+    CHECK(cache.Get(chunk.first, content));
+    CHECK(cache.disk_hit_count() == 1);
+  }
+  CHECK_FALSE(fs::exists(kCachePath));
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -0,0 +1,165 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "boost/thread/future.hpp"
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+
+#include "maidsafe/encrypt/data_map.h"
+
+#include "maidsafe/drive/chunk_prefetcher.h"
+#include "maidsafe/drive/config.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+class ChunkPrefetcherTest {
+ public:
+  ChunkPrefetcherTest() : kChunkSize_(1024), store_(), data_map_(), requested_() {
+    for (int i(0); i != 10; ++i) {
+      ImmutableData chunk(NonEmptyString(RandomString(kChunkSize_)));
+      store_.insert(std::make_pair(chunk.name()->string(), chunk));
+      encrypt::ChunkDetails chunk_details;
+      chunk_details.hash = chunk.name()->string();
+      chunk_details.size = kChunkSize_;
+      data_map_.chunks.push_back(chunk_details);
+    }
+  }
+
+ protected:
+  ChunkPrefetcher::GetFunctor GetFunctor() {
+    return [this](const ImmutableData::Name& name) {
+      requested_.push_back(name->string());
+      boost::promise<ImmutableData> promise;
+      promise.set_value(store_.at(name->string()));
+      return promise.get_future();
+    };
+  }
+
+  const uint32_t kChunkSize_;
+  std::map<std::string, ImmutableData> store_;
+  encrypt::DataMap data_map_;
+  std::vector<std::string> requested_;
+
+ private:
+  ChunkPrefetcherTest(const ChunkPrefetcherTest&);
+  ChunkPrefetcherTest& operator=(const ChunkPrefetcherTest&);
+};
+
+TEST_CASE_METHOD(ChunkPrefetcherTest, "Sequential reads", "[ChunkPrefetcher][behavioural]") {
+  ChunkPrefetcher prefetcher(GetFunctor(), kMaxPrefetchedChunks);
+  ReadPattern read_pattern;
+  uint64_t offset(0);
+  for (uint32_t i(0); i != kSequentialReadThreshold - 1; ++i) {
+    prefetcher.NotifyRead(data_map_, offset, kChunkSize_, read_pattern);
+    offset += kChunkSize_;
+  }
+  CHECK(requested_.empty());
+
+  // Reading chunk 'n' should request the following chunks
+  const size_t n(kSequentialReadThreshold - 1);
+  prefetcher.NotifyRead(data_map_, offset, kChunkSize_, read_pattern);
+  REQUIRE(requested_.size() == kReadAheadChunkCount);
+  for (size_t i(0); i != kReadAheadChunkCount; ++i)
+    CHECK(requested_[i] == data_map_.chunks[n + 1 + i].hash);
+
+  // Prefetched chunks are returned without a further request
+  auto name(data_map_.chunks[n + 1].hash);
+  CHECK(prefetcher.Get(name) == store_.at(name).data());
+  CHECK(requested_.size() == kReadAheadChunkCount);
+  CHECK(prefetcher.hit_count() == 1);
+
+  // Continuing sequentially only requests chunks not already requested
+  prefetcher.NotifyRead(data_map_, offset + kChunkSize_, kChunkSize_, read_pattern);
+  CHECK(requested_.size() == kReadAheadChunkCount + 1);
+
+  // A random read stops the prefetching
+  requested_.clear();
+  prefetcher.NotifyRead(data_map_, 0, kChunkSize_, read_pattern);
+  CHECK(requested_.empty());
+}
+
+TEST_CASE_METHOD(ChunkPrefetcherTest, "Prefetched chunks bounded",
+                 "[ChunkPrefetcher][behavioural]") {
+  const uint32_t kMaxChunks(2);
+  ChunkPrefetcher prefetcher(GetFunctor(), kMaxChunks);
+  ReadPattern read_pattern;
+  for (uint32_t i(0); i != kSequentialReadThreshold; ++i)
+    prefetcher.NotifyRead(data_map_, i * kChunkSize_, kChunkSize_, read_pattern);
+  REQUIRE(requested_.size() == kReadAheadChunkCount);
+
+  // The oldest prefetched chunk has been evicted, so has to be fetched again
+  auto evicted(requested_.front());
+  CHECK(prefetcher.Get(evicted) == store_.at(evicted).data());
+  CHECK(requested_.size() == kReadAheadChunkCount + 1);
+  auto retained(requested_[kReadAheadChunkCount - 1]);
+  CHECK(prefetcher.Get(retained) == store_.at(retained).data());
+  CHECK(requested_.size() == kReadAheadChunkCount + 1);
+  CHECK(prefetcher.hit_count() == 1);
+  CHECK(prefetcher.request_count() == 2);
+}
+
+TEST_CASE_METHOD(ChunkPrefetcherTest, "Fetch range", "[ChunkPrefetcher][behavioural]") {
+  ChunkPrefetcher prefetcher(GetFunctor(), kMaxPrefetchedChunks);
+
+  // A read within one chunk is left to the encryptor
+  prefetcher.FetchRange(data_map_, kChunkSize_ + 10, kChunkSize_ - 10);
+  CHECK(requested_.empty());
+
+  // All chunks of a read starting on a chunk boundary are requested together
+  prefetcher.FetchRange(data_map_, kChunkSize_, 3 * kChunkSize_);
+  REQUIRE(requested_.size() == 3);
+  for (size_t i(0); i != 3; ++i)
+    CHECK(requested_[i] == data_map_.chunks[1 + i].hash);
+  for (size_t i(0); i != 3; ++i)
+    CHECK(prefetcher.Get(data_map_.chunks[1 + i].hash) == store_.at(requested_[i]).data());
+  CHECK(requested_.size() == 3);
+
+  // A read starting part-way into a chunk requests that chunk too
+  requested_.clear();
+  prefetcher.FetchRange(data_map_, 5 * kChunkSize_ - 1, 2 * kChunkSize_);
+  REQUIRE(requested_.size() == 3);
+  for (size_t i(0); i != 3; ++i)
+    CHECK(requested_[i] == data_map_.chunks[4 + i].hash);
+
+  // So does a small read straddling two chunks
+  requested_.clear();
+  prefetcher.FetchRange(data_map_, 8 * kChunkSize_ - 10, 20);
+  REQUIRE(requested_.size() == 2);
+  CHECK(requested_[0] == data_map_.chunks[7].hash);
+  CHECK(requested_[1] == data_map_.chunks[8].hash);
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
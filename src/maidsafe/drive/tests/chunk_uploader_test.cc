@@ -0,0 +1,141 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+
+#include "maidsafe/drive/chunk_uploader.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+TEST_CASE("Chunk uploader bounds in-flight puts", "[ChunkUploader][behavioural]") {
+  const uint32_t kMaxInFlight(3), kChunkCount(20);
+  std::mutex mutex;
+  std::condition_variable cond_var;
+  std::set<std::string> stored;
+  uint32_t in_flight(0), max_in_flight(0);
+  bool release(false);
+  ChunkUploader uploader([&](const ImmutableData& chunk) {
+                           std::unique_lock<std::mutex> lock(mutex);
+                           max_in_flight = std::max(max_in_flight, ++in_flight);
+                           cond_var.wait(lock, [&] { return release; });
+                           --in_flight;
+                           stored.insert(chunk.name()->string());
+                         }, kMaxInFlight, kChunkCount);
+
+  std::set<std::string> names;
+  for (uint32_t i(0); i != kChunkCount; ++i) {
+    ImmutableData chunk(NonEmptyString(RandomString(100)));
+    names.insert(chunk.name()->string());
+    uploader.Put(chunk);
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    // 'Put' doesn't wait for the chunks to be stored
+    CHECK(stored.empty());
+    CHECK(uploader.queue_depth() == kChunkCount);
+    release = true;
+  }
+  cond_var.notify_all();
+  CHECK(uploader.WaitForQueued());
+  std::lock_guard<std::mutex> lock(mutex);
+  CHECK(stored == names);
+  CHECK(max_in_flight <= kMaxInFlight);
+  CHECK(uploader.queue_depth() == 0);
+  CHECK(uploader.max_queue_depth() == kChunkCount);
+  CHECK(uploader.failure_count() == 0);
+}
+
+TEST_CASE("Chunk uploader reports failures", "[ChunkUploader][behavioural]") {
+  ImmutableData bad_chunk(NonEmptyString(RandomString(100)));
+  ChunkUploader uploader([&](const ImmutableData& chunk) {
+                           if (chunk.name() == bad_chunk.name())
+                             BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+                         }, 2, 4);
+  uploader.Put(ImmutableData(NonEmptyString(RandomString(100))));
+  CHECK(uploader.WaitForQueued());
+  uploader.Put(bad_chunk);
+  uploader.Put(ImmutableData(NonEmptyString(RandomString(100))));
+  CHECK_FALSE(uploader.WaitForQueued());
+  CHECK(uploader.failure_count() == 1);
+  // The failed chunk is put again by each wait until it's stored
+  CHECK_FALSE(uploader.WaitForQueued());
+  CHECK(uploader.failure_count() == 2);
+  uploader.DropFailed("");
+  CHECK(uploader.WaitForQueued());
+  CHECK(uploader.failure_count() == 2);
+}
+
+TEST_CASE("Chunk uploader reports failures to their own batch", "[ChunkUploader][behavioural]") {
+  ImmutableData bad_chunk(NonEmptyString(RandomString(100)));
+  ChunkUploader uploader([&](const ImmutableData& chunk) {
+                           if (chunk.name() == bad_chunk.name())
+                             BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+                         }, 2, 4);
+  uploader.Put(bad_chunk, "A");
+  uploader.Put(ImmutableData(NonEmptyString(RandomString(100))), "B");
+  CHECK(uploader.WaitForQueued("B"));
+  CHECK_FALSE(uploader.WaitForQueued("A"));
+  CHECK(uploader.WaitForQueued("B"));
+  CHECK(uploader.failure_count() == 2);
+  uploader.DropFailed("A");
+}
+
+TEST_CASE("Chunk uploader re-puts failed chunks", "[ChunkUploader][behavioural]") {
+  ImmutableData flaky_chunk(NonEmptyString(RandomString(100)));
+  std::mutex mutex;
+  int put_count(0);
+  ChunkUploader uploader([&](const ImmutableData& chunk) {
+                           if (chunk.name() != flaky_chunk.name())
+                             return;
+                           std::lock_guard<std::mutex> lock(mutex);
+                           if (++put_count == 1)
+                             BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+                         }, 2, 4);
+  // The first store of the batch fails, and the second puts the failed chunk again even though it
+  // isn't queued again by the caller.
+  uploader.Put(flaky_chunk, "A");
+  CHECK_FALSE(uploader.WaitForQueued("A"));
+  uploader.Put(ImmutableData(NonEmptyString(RandomString(100))), "A");
+  CHECK(uploader.WaitForQueued("A"));
+  std::lock_guard<std::mutex> lock(mutex);
+  CHECK(put_count == 2);
+  CHECK(uploader.failure_count() == 1);
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -22,9 +22,13 @@
 #include <time.h>
 #endif
 
+#include <atomic>
+#include <chrono>
 #include <fstream>  // NOLINT
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "boost/filesystem/path.hpp"
 
@@ -54,6 +58,24 @@ namespace detail {
 
 namespace test {
 
+// A local store whose next 'PutVersion' can be made to fail.
+class FlakyStore : public data_stores::LocalStore {
+ public:
+  FlakyStore(const fs::path& disk_path, DiskUsage max_disk_usage)
+      : data_stores::LocalStore(disk_path, max_disk_usage), fail_next_put_version(false) {}
+
+  template <typename DataName>
+  boost::future<void> PutVersion(const DataName& data_name,
+                                 const StructuredDataVersions::VersionName& old_version_name,
+                                 const StructuredDataVersions::VersionName& new_version_name) {
+    if (fail_next_put_version.exchange(false))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+    return data_stores::LocalStore::PutVersion(data_name, old_version_name, new_version_name);
+  }
+
+  std::atomic<bool> fail_next_put_version;
+};
+
 class DirectoryHandlerTest {
  public:
   DirectoryHandlerTest()
@@ -66,6 +88,10 @@ class DirectoryHandlerTest {
   ~DirectoryHandlerTest() { asio_service_.Stop(); }
 
  protected:
+  void SetCacheLimit(size_t max_cached_directories) {
+    listing_handler_->max_cached_directories_ = max_cached_directories;
+  }
+
   maidsafe::test::TestPath main_test_dir_;
   std::shared_ptr<data_stores::LocalStore> data_store_;
   Identity unique_user_id_, root_parent_id_;
@@ -81,7 +107,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Construct", "[DirectoryHandler][behaviou
   listing_handler_.reset(new detail::DirectoryHandler<data_stores::LocalStore>(
       data_store_, unique_user_id_, root_parent_id_, boost::filesystem::unique_path(GetUserAppDir()
       / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true, asio_service_.service()));
-  Directory* recovered_directory(nullptr);
+  std::shared_ptr<Directory> recovered_directory;
   const FileContext* recovered_file_context(nullptr);
 
   CHECK_NOTHROW(recovered_directory = listing_handler_->Get(""));
@@ -101,7 +127,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Add directory", "[DirectoryHandler][beha
   std::string directory_name("Directory");
   FileContext file_context(directory_name, true);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
   DirectoryId dir(*file_context.meta_data.directory_id);
   CHECK_NOTHROW(listing_handler_->Add(kRoot / directory_name, std::move(file_context)));
   CHECK_NOTHROW(directory = listing_handler_->Get(kRoot / directory_name));
@@ -119,7 +145,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Add same directory", "[DirectoryHandler]
   FileContext file_context(directory_name, true);
   DirectoryId dir(*file_context.meta_data.directory_id);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
   boost::filesystem::path meta_data_name(file_context.meta_data.name);
   CHECK_NOTHROW(listing_handler_->Add(kRoot / directory_name, std::move(file_context)));
   CHECK_NOTHROW(directory = listing_handler_->Get(kRoot / directory_name));
@@ -141,7 +167,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Add file", "[DirectoryHandler][behaviour
   std::string file_name("File");
   FileContext file_context(file_name, false);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
 
   CHECK_NOTHROW(listing_handler_->Add(kRoot / file_name, std::move(file_context)));
   CHECK_THROWS_AS(directory = listing_handler_->Get(kRoot / file_name), std::exception);
@@ -158,7 +184,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Add same file", "[DirectoryHandler][beha
   std::string file_name("File");
   FileContext file_context(file_name, false);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
 
   CHECK_NOTHROW(listing_handler_->Add(kRoot / file_name, std::move(file_context)));
   CHECK_THROWS_AS(directory = listing_handler_->Get(kRoot / file_name), std::exception);
@@ -179,7 +205,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Delete directory", "[DirectoryHandler][b
   std::string directory_name("Directory");
   FileContext file_context(directory_name, true);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
   DirectoryId dir(*file_context.meta_data.directory_id);
 
   CHECK_NOTHROW(listing_handler_->Add(kRoot / directory_name, std::move(file_context)));
@@ -203,7 +229,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Delete same directory", "[DirectoryHandl
   std::string directory_name("Directory");
   FileContext file_context(directory_name, true);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
   DirectoryId dir(*file_context.meta_data.directory_id);
 
   CHECK_NOTHROW(listing_handler_->Add(kRoot / directory_name, std::move(file_context)));
@@ -228,7 +254,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Delete file", "[DirectoryHandler][behavi
   std::string file_name("File");
   FileContext file_context(file_name, false);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
 
   CHECK_NOTHROW(listing_handler_->Add(kRoot / file_name, std::move(file_context)));
   CHECK_THROWS_AS(directory = listing_handler_->Get(kRoot / file_name), std::exception);
@@ -248,7 +274,7 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Delete same file", "[DirectoryHandler][b
   std::string file_name("File");
   FileContext file_context(file_name, false);
   const FileContext* recovered_file_context(nullptr);
-  Directory* directory(nullptr);
+  std::shared_ptr<Directory> directory;
 
   CHECK_NOTHROW(listing_handler_->Add(kRoot / file_name, std::move(file_context)));
   CHECK_THROWS_AS(directory = listing_handler_->Get(kRoot / file_name), std::exception);
@@ -429,6 +455,198 @@ TEST_CASE_METHOD(DirectoryHandlerTest, "Rename and move file", "[DirectoryHandle
                   std::exception);
 }
 
+TEST_CASE_METHOD(DirectoryHandlerTest, "Evict cached directories",
+                 "[DirectoryHandler][behavioural]") {
+  listing_handler_.reset(new detail::DirectoryHandler<data_stores::LocalStore>(
+      data_store_, unique_user_id_, root_parent_id_, boost::filesystem::unique_path(GetUserAppDir()
+      / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true, asio_service_.service()));
+  std::vector<DirectoryId> directory_ids;
+  for (const std::string name : {"A", "B", "C", "D", "E"}) {
+    FileContext file_context(name, true);
+    directory_ids.push_back(*file_context.meta_data.directory_id);
+    REQUIRE_NOTHROW(listing_handler_->Add(kRoot / name, std::move(file_context)));
+    listing_handler_->Get(kRoot / name)->Sync();
+  }
+  listing_handler_->Get(kRoot)->Sync();
+  CHECK(listing_handler_->cache_size() == 7);
+
+  // Adding a further directory evicts the stored ones, but not the root, its parent or the new one
+  SetCacheLimit(3);
+  REQUIRE_NOTHROW(listing_handler_->Add(kRoot / "F", FileContext("F", true)));
+  CHECK(listing_handler_->cache_size() == 3);
+
+  // Evicted directories are reloaded from storage
+  const auto miss_count(listing_handler_->cache_miss_count());
+  std::shared_ptr<Directory> directory;
+  REQUIRE_NOTHROW(directory = listing_handler_->Get(kRoot / "A"));
+  CHECK(directory->directory_id() == directory_ids.front());
+  CHECK(listing_handler_->cache_miss_count() == miss_count + 1);
+  const auto hit_count(listing_handler_->cache_hit_count());
+  REQUIRE_NOTHROW(listing_handler_->Get(kRoot / "A"));
+  CHECK(listing_handler_->cache_hit_count() == hit_count + 1);
+
+  // Unstored directories aren't evicted
+  CHECK_NOTHROW(listing_handler_->Get(kRoot / "F"));
+  CHECK(listing_handler_->cache_size() == 4);
+
+  // Nor are directories still held by callers of 'Get'
+  REQUIRE_NOTHROW(listing_handler_->Get(kRoot / "B"));
+  CHECK(listing_handler_->cache_size() == 5);
+  directory.reset();
+  REQUIRE_NOTHROW(listing_handler_->Get(kRoot / "C"));
+  CHECK(listing_handler_->cache_size() == 4);
+}
+
+TEST_CASE_METHOD(DirectoryHandlerTest, "Rename keeps cached subdirectories",
+                 "[DirectoryHandler][behavioural]") {
+  listing_handler_.reset(new detail::DirectoryHandler<data_stores::LocalStore>(
+      data_store_, unique_user_id_, root_parent_id_, boost::filesystem::unique_path(GetUserAppDir()
+      / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true, asio_service_.service()));
+  const boost::filesystem::path kOld(kRoot / "Old"), kNew(kRoot / "New"), kOther(kRoot / "Other");
+  REQUIRE_NOTHROW(listing_handler_->Add(kOld, FileContext(kOld.filename(), true)));
+  REQUIRE_NOTHROW(listing_handler_->Add(kOld / "A", FileContext("A", true)));
+  REQUIRE_NOTHROW(listing_handler_->Add(kOld / "A" / "B", FileContext("B", true)));
+  REQUIRE_NOTHROW(listing_handler_->Add(kOther, FileContext(kOther.filename(), true)));
+  std::shared_ptr<Directory> deepest(listing_handler_->Get(kOld / "A" / "B"));
+  const auto cache_size(listing_handler_->cache_size());
+  const auto miss_count(listing_handler_->cache_miss_count());
+
+  // Renamed and moved directories keep their cached subdirectories under the new path
+  REQUIRE_NOTHROW(listing_handler_->Rename(kOld, kNew));
+  CHECK(listing_handler_->Get(kNew / "A" / "B") == deepest);
+  CHECK_THROWS_AS(listing_handler_->Get(kOld / "A" / "B"), std::exception);
+  REQUIRE_NOTHROW(listing_handler_->Rename(kNew / "A", kOther / "A"));
+  CHECK(listing_handler_->Get(kOther / "A" / "B") == deepest);
+  CHECK_THROWS_AS(listing_handler_->Get(kNew / "A"), std::exception);
+  CHECK(listing_handler_->cache_size() == cache_size);
+  CHECK(listing_handler_->cache_miss_count() == miss_count);
+}
+
+TEST_CASE_METHOD(DirectoryHandlerTest, "Prefetch subdirectories",
+                 "[DirectoryHandler][behavioural]") {
+  listing_handler_.reset(new detail::DirectoryHandler<data_stores::LocalStore>(
+      data_store_, unique_user_id_, root_parent_id_, boost::filesystem::unique_path(GetUserAppDir()
+      / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true, asio_service_.service()));
+  const boost::filesystem::path kParent(kRoot / "Parent");
+  REQUIRE_NOTHROW(listing_handler_->Add(kParent, FileContext(kParent.filename(), true)));
+  for (const std::string name : {"A", "B"}) {
+    REQUIRE_NOTHROW(listing_handler_->Add(kParent / name, FileContext(name, true)));
+    listing_handler_->Get(kParent / name)->Sync();
+  }
+  listing_handler_->Get(kParent)->Sync();
+  listing_handler_->Get(kRoot)->Sync();
+
+  // Evict the subdirectories, then have them loaded in the background
+  SetCacheLimit(2);
+  REQUIRE_NOTHROW(listing_handler_->Add(kRoot / "Other", FileContext("Other", true)));
+  REQUIRE(listing_handler_->cache_size() == 4);
+  SetCacheLimit(kMaxCachedDirectories);
+  const auto miss_count(listing_handler_->cache_miss_count());
+  listing_handler_->PrefetchSubdirectories(kParent);
+  const auto timeout(std::chrono::steady_clock::now() + std::chrono::seconds(10));
+  while (listing_handler_->cache_size() != 6 && std::chrono::steady_clock::now() < timeout)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  REQUIRE(listing_handler_->cache_size() == 6);
+  CHECK(listing_handler_->cache_miss_count() == miss_count + 2);
+
+  // Prefetched directories are then retrieved from the cache
+  const auto hit_count(listing_handler_->cache_hit_count());
+  CHECK_NOTHROW(listing_handler_->Get(kParent / "A"));
+  CHECK_NOTHROW(listing_handler_->Get(kParent / "B"));
+  CHECK(listing_handler_->cache_hit_count() == hit_count + 2);
+  CHECK(listing_handler_->cache_miss_count() == miss_count + 2);
+}
+
+TEST_CASE_METHOD(DirectoryHandlerTest, "Apply remote removal of opened file",
+                 "[DirectoryHandler][behavioural]") {
+  listing_handler_.reset(new detail::DirectoryHandler<data_stores::LocalStore>(
+      data_store_, unique_user_id_, root_parent_id_, boost::filesystem::unique_path(GetUserAppDir()
+      / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true, asio_service_.service()));
+  const boost::filesystem::path kFile(kRoot / "File");
+  REQUIRE_NOTHROW(listing_handler_->Add(kFile, FileContext(kFile.filename(), false)));
+  {
+    // A file which has been opened and released keeps its timer, and flushes itself via its parent
+    // when destroyed.
+    FileContext* file_context(listing_handler_->Get(kRoot)->GetMutableChild(kFile.filename()));
+    std::lock_guard<std::mutex> lock(*file_context->mutex);
+    file_context->timer.reset(new boost::asio::steady_timer(asio_service_.service()));
+  }
+  listing_handler_->Get(kRoot)->Sync();
+
+  // Another client removes the file
+  {
+    detail::DirectoryHandler<data_stores::LocalStore> other_handler(data_store_, unique_user_id_,
+        root_parent_id_, boost::filesystem::unique_path(GetUserAppDir() / "Buffers" /
+        "%%%%%-%%%%%-%%%%%-%%%%%"), false, asio_service_.service());
+    REQUIRE_NOTHROW(other_handler.Delete(kFile));
+    other_handler.Get(kRoot)->Sync();
+  }
+
+  REQUIRE_NOTHROW(listing_handler_->ApplyRemoteChanges());
+  CHECK_FALSE(listing_handler_->Get(kRoot)->HasChild(kFile.filename()));
+}
+
+TEST_CASE_METHOD(DirectoryHandlerTest, "Apply remote removal of cached directory",
+                 "[DirectoryHandler][behavioural]") {
+  listing_handler_.reset(new detail::DirectoryHandler<data_stores::LocalStore>(
+      data_store_, unique_user_id_, root_parent_id_, boost::filesystem::unique_path(GetUserAppDir()
+      / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true, asio_service_.service()));
+  const boost::filesystem::path kDirectory(kRoot / "Directory");
+  REQUIRE_NOTHROW(listing_handler_->Add(kDirectory, FileContext(kDirectory.filename(), true)));
+  REQUIRE_NOTHROW(listing_handler_->Add(kDirectory / "Sub", FileContext("Sub", true)));
+  listing_handler_->Get(kDirectory / "Sub")->Sync();
+  listing_handler_->Get(kDirectory)->Sync();
+  listing_handler_->Get(kRoot)->Sync();
+  const auto cache_size(listing_handler_->cache_size());
+
+  // Another client removes the directory
+  {
+    detail::DirectoryHandler<data_stores::LocalStore> other_handler(data_store_, unique_user_id_,
+        root_parent_id_, boost::filesystem::unique_path(GetUserAppDir() / "Buffers" /
+        "%%%%%-%%%%%-%%%%%-%%%%%"), false, asio_service_.service());
+    REQUIRE_NOTHROW(other_handler.Delete(kDirectory / "Sub"));
+    REQUIRE_NOTHROW(other_handler.Delete(kDirectory));
+    other_handler.Get(kRoot)->Sync();
+  }
+
+  // The directory and its cached subdirectory are dropped from the cache
+  REQUIRE_NOTHROW(listing_handler_->ApplyRemoteChanges());
+  CHECK_FALSE(listing_handler_->Get(kRoot)->HasChild(kDirectory.filename()));
+  CHECK(listing_handler_->cache_size() == cache_size - 2);
+  CHECK_THROWS_AS(listing_handler_->Get(kDirectory), std::exception);
+}
+
+TEST_CASE_METHOD(DirectoryHandlerTest, "Retry failed version store",
+                 "[DirectoryHandler][behavioural]") {
+  std::shared_ptr<FlakyStore> store(new FlakyStore(*main_test_dir_ / "Flaky", DiskUsage(1 << 30)));
+  detail::DirectoryHandler<FlakyStore> handler(store, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"),
+      true, asio_service_.service());
+  const boost::filesystem::path kDirectory(kRoot / "Directory");
+  REQUIRE_NOTHROW(handler.Add(kDirectory, FileContext(kDirectory.filename(), true)));
+  REQUIRE_NOTHROW(handler.Get(kDirectory)->Sync());
+  handler.Get(kRoot)->Sync();
+  handler.Get("")->Sync();
+  const auto versions(handler.Get(kDirectory)->Versions());
+  REQUIRE(versions.size() == 1U);
+
+  // A failed store leaves the versions as they are in storage, so the retry follows on from them
+  REQUIRE_NOTHROW(handler.Add(kDirectory / "File", FileContext("File", false)));
+  store->fail_next_put_version = true;
+  CHECK_THROWS_AS(handler.Get(kDirectory)->Sync(), std::exception);
+  CHECK(handler.Get(kDirectory)->Versions() == versions);
+  CHECK_NOTHROW(handler.Get(kDirectory)->Sync());
+  CHECK(handler.Get(kDirectory)->Versions().size() == 2U);
+  CHECK(handler.Get(kDirectory)->Versions().back() == versions.front());
+
+  detail::DirectoryHandler<FlakyStore> other_handler(store, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"),
+      false, asio_service_.service());
+  std::shared_ptr<Directory> directory;
+  REQUIRE_NOTHROW(directory = other_handler.Get(kDirectory));
+  CHECK(directory->HasChild("File"));
+}
+
 }  // namespace test
 
 }  // namespace detail
@@ -20,8 +20,13 @@
 #include <windows.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include "boost/filesystem.hpp"
 #include "boost/thread.hpp"
 #include "boost/random/mersenne_twister.hpp"
@@ -29,6 +34,7 @@
 #include "boost/random/variate_generator.hpp"
 
 #include "maidsafe/common/crypto.h"
+#include "maidsafe/common/error.h"
 #include "maidsafe/common/log.h"
 #include "maidsafe/common/test.h"
 #include "maidsafe/common/utils.h"
@@ -76,6 +82,7 @@ class DirectoryTest {
           LOG(kInfo) << "Putting directory.";
           ImmutableData contents(NonEmptyString(directory->Serialise()));
           directory->AddNewVersion(contents.name());
+          directory->StoreSucceeded();
         }),
         directory_(ParentId(unique_id_), parent_id_, asio_service_.service(), put_functor_,
                    put_chunk_functor_, increment_chunks_functor_, "") {}
@@ -124,6 +131,7 @@ class DirectoryTest {
       ImmutableData contents(NonEmptyString(directory.Serialise()));
       CHECK(WriteFile(path / "msdir.listing", contents.data().string()));
       directory.AddNewVersion(contents.name());
+      directory.StoreSucceeded();
     }
     catch (const std::exception& e) {
       LOG(kError) << "GenerateDirectoryListings test failed: " << e.what();
@@ -310,14 +318,6 @@ class DirectoryTest {
     return true;
   }
 
-  void SortAndResetChildrenCounter() {
-    directory_.SortAndResetChildrenCounter();
-  }
-
-  void ResetChildrenCounter() {
-    directory_.ResetChildrenCounter();
-  }
-
   maidsafe::test::TestPath main_test_dir_;
   fs::path relative_root_;
   Identity unique_id_, parent_id_, directory_id_;
@@ -362,20 +362,23 @@ void DirectoriesMatch(const Directory& lhs, const Directory& rhs) {
   if (lhs.directory_id() != rhs.directory_id())
     FAIL("Directory ID mismatch.");
   REQUIRE(lhs.children_.size() == rhs.children_.size());
-  auto itr1(lhs.children_.begin()), itr2(rhs.children_.begin());
-  for (; itr1 != lhs.children_.end(); ++itr1, ++itr2) {
-    REQUIRE((*itr1)->meta_data.name == (*itr2)->meta_data.name);
-    if (((*itr1)->meta_data.data_map && !(*itr2)->meta_data.data_map) ||
-        (!(*itr1)->meta_data.data_map && (*itr2)->meta_data.data_map))
+  auto entry1(lhs.children_.begin()), entry2(rhs.children_.begin());
+  for (; entry1 != lhs.children_.end(); ++entry1, ++entry2) {
+    REQUIRE(entry1->first == entry2->first);
+    FileContext* child1(entry1->second.get());
+    FileContext* child2(entry2->second.get());
+    REQUIRE(child1->meta_data.name == child2->meta_data.name);
+    if ((child1->meta_data.data_map && !child2->meta_data.data_map) ||
+        (!child1->meta_data.data_map && child2->meta_data.data_map))
       FAIL("Data map pointer mismatch");
-    if ((*itr1)->meta_data.data_map) {
-      REQUIRE(TotalSize(*(*itr1)->meta_data.data_map) == TotalSize(*(*itr2)->meta_data.data_map));
-      REQUIRE((*itr1)->meta_data.data_map->chunks.size() ==
-              (*itr2)->meta_data.data_map->chunks.size());
-      auto chunk_itr1((*itr1)->meta_data.data_map->chunks.begin());
-      auto chunk_itr2((*itr2)->meta_data.data_map->chunks.begin());
+    if (child1->meta_data.data_map) {
+      REQUIRE(TotalSize(*child1->meta_data.data_map) == TotalSize(*child2->meta_data.data_map));
+      REQUIRE(child1->meta_data.data_map->chunks.size() ==
+              child2->meta_data.data_map->chunks.size());
+      auto chunk_itr1(child1->meta_data.data_map->chunks.begin());
+      auto chunk_itr2(child2->meta_data.data_map->chunks.begin());
       size_t chunk_no(0);
-      for (; chunk_itr1 != (*itr1)->meta_data.data_map->chunks.end();
+      for (; chunk_itr1 != child1->meta_data.data_map->chunks.end();
            ++chunk_itr1, ++chunk_itr2, ++chunk_no) {
         if ((*chunk_itr1).hash != (*chunk_itr2).hash)
           FAIL("DataMap chunk " << chunk_no << " hash mismatch.");
@@ -383,56 +386,56 @@ void DirectoriesMatch(const Directory& lhs, const Directory& rhs) {
           FAIL("DataMap chunk " << chunk_no << " pre_hash mismatch.");
         REQUIRE((*chunk_itr1).size == (*chunk_itr2).size);
       }
-      if ((*itr1)->meta_data.data_map->content != (*itr2)->meta_data.data_map->content)
+      if (child1->meta_data.data_map->content != child2->meta_data.data_map->content)
         FAIL("DataMap content mismatch.");
-      //       if ((*itr1).data_map->self_encryption_type !=
-      //           (*itr2).data_map->self_encryption_type)
+      //       if (child1->data_map->self_encryption_type !=
+      //           child2->data_map->self_encryption_type)
       //         FAIL("DataMap SE type mismatch.");
     }
-    //     if ((*itr1).end_of_file != (*itr2).end_of_file)
-    REQUIRE(GetSize(std::move((*itr1)->meta_data)) == GetSize(std::move((*itr2)->meta_data)));
+    //     if (child1->end_of_file != child2->end_of_file)
+    REQUIRE(GetSize(std::move(child1->meta_data)) == GetSize(std::move(child2->meta_data)));
 #ifdef MAIDSAFE_WIN32
-    REQUIRE((*itr1)->meta_data.allocation_size == (*itr2)->meta_data.allocation_size);
-    REQUIRE((*itr1)->meta_data.attributes == (*itr2)->meta_data.attributes);
-    REQUIRE((*itr1)->meta_data.creation_time.dwHighDateTime ==
-            (*itr2)->meta_data.creation_time.dwHighDateTime);
-    if ((*itr1)->meta_data.creation_time.dwLowDateTime !=
-        (*itr2)->meta_data.creation_time.dwLowDateTime) {
+    REQUIRE(child1->meta_data.allocation_size == child2->meta_data.allocation_size);
+    REQUIRE(child1->meta_data.attributes == child2->meta_data.attributes);
+    REQUIRE(child1->meta_data.creation_time.dwHighDateTime ==
+            child2->meta_data.creation_time.dwHighDateTime);
+    if (child1->meta_data.creation_time.dwLowDateTime !=
+        child2->meta_data.creation_time.dwLowDateTime) {
       uint32_t error = 0xA;
-      if ((*itr1)->meta_data.creation_time.dwLowDateTime >
-          (*itr2)->meta_data.creation_time.dwLowDateTime + error ||
-          (*itr1)->meta_data.creation_time.dwLowDateTime <
-          (*itr2)->meta_data.creation_time.dwLowDateTime - error)
-        FAIL("Creation times low: " << (*itr1)->meta_data.creation_time.dwLowDateTime << " != "
-             << (*itr2)->meta_data.creation_time.dwLowDateTime);
+      if (child1->meta_data.creation_time.dwLowDateTime >
+          child2->meta_data.creation_time.dwLowDateTime + error ||
+          child1->meta_data.creation_time.dwLowDateTime <
+          child2->meta_data.creation_time.dwLowDateTime - error)
+        FAIL("Creation times low: " << child1->meta_data.creation_time.dwLowDateTime << " != "
+             << child2->meta_data.creation_time.dwLowDateTime);
     }
-    REQUIRE((*itr1)->meta_data.last_access_time.dwHighDateTime ==
-            (*itr2)->meta_data.last_access_time.dwHighDateTime);
-    if ((*itr1)->meta_data.last_access_time.dwLowDateTime !=
-        (*itr2)->meta_data.last_access_time.dwLowDateTime) {
+    REQUIRE(child1->meta_data.last_access_time.dwHighDateTime ==
+            child2->meta_data.last_access_time.dwHighDateTime);
+    if (child1->meta_data.last_access_time.dwLowDateTime !=
+        child2->meta_data.last_access_time.dwLowDateTime) {
       uint32_t error = 0xA;
-      if ((*itr1)->meta_data.last_access_time.dwLowDateTime >
-          (*itr2)->meta_data.last_access_time.dwLowDateTime + error ||
-          (*itr1)->meta_data.last_access_time.dwLowDateTime <
-          (*itr2)->meta_data.last_access_time.dwLowDateTime - error)
-        FAIL("Last access times low: " << (*itr1)->meta_data.last_access_time.dwLowDateTime
-             << " != " << (*itr2)->meta_data.last_access_time.dwLowDateTime);
+      if (child1->meta_data.last_access_time.dwLowDateTime >
+          child2->meta_data.last_access_time.dwLowDateTime + error ||
+          child1->meta_data.last_access_time.dwLowDateTime <
+          child2->meta_data.last_access_time.dwLowDateTime - error)
+        FAIL("Last access times low: " << child1->meta_data.last_access_time.dwLowDateTime
+             << " != " << child2->meta_data.last_access_time.dwLowDateTime);
     }
-    REQUIRE((*itr1)->meta_data.last_write_time.dwHighDateTime ==
-            (*itr2)->meta_data.last_write_time.dwHighDateTime);
-    if ((*itr1)->meta_data.last_write_time.dwLowDateTime !=
-        (*itr2)->meta_data.last_write_time.dwLowDateTime) {
+    REQUIRE(child1->meta_data.last_write_time.dwHighDateTime ==
+            child2->meta_data.last_write_time.dwHighDateTime);
+    if (child1->meta_data.last_write_time.dwLowDateTime !=
+        child2->meta_data.last_write_time.dwLowDateTime) {
       uint32_t error = 0xA;
-      if ((*itr1)->meta_data.last_write_time.dwLowDateTime >
-          (*itr2)->meta_data.last_write_time.dwLowDateTime + error ||
-          (*itr1)->meta_data.last_write_time.dwLowDateTime <
-          (*itr2)->meta_data.last_write_time.dwLowDateTime - error)
-        FAIL("Last write times low: " << (*itr1)->meta_data.last_write_time.dwLowDateTime << " != "
-             << (*itr2)->meta_data.last_write_time.dwLowDateTime);
+      if (child1->meta_data.last_write_time.dwLowDateTime >
+          child2->meta_data.last_write_time.dwLowDateTime + error ||
+          child1->meta_data.last_write_time.dwLowDateTime <
+          child2->meta_data.last_write_time.dwLowDateTime - error)
+        FAIL("Last write times low: " << child1->meta_data.last_write_time.dwLowDateTime << " != "
+             << child2->meta_data.last_write_time.dwLowDateTime);
     }
 #else
-    REQUIRE((*itr1)->meta_data.attributes.st_atime == (*itr2)->meta_data.attributes.st_atime);
-    REQUIRE((*itr1)->meta_data.attributes.st_mtime == (*itr2)->meta_data.attributes.st_mtime);
+    REQUIRE(child1->meta_data.attributes.st_atime == child2->meta_data.attributes.st_atime);
+    REQUIRE(child1->meta_data.attributes.st_mtime == child2->meta_data.attributes.st_mtime);
 #endif
   }
 }
@@ -489,6 +492,7 @@ TEST_CASE_METHOD(DirectoryTest, "Serialise and parse", "[Directory][behavioural]
   std::string serialised_directory(directory_.Serialise());
   ImmutableData contents(NonEmptyString(directory_.Serialise()));
   directory_.AddNewVersion(contents.name());
+  directory_.StoreSucceeded();
 
   std::vector<StructuredDataVersions::VersionName> versions;
   Directory recovered_directory(directory_.parent_id(), serialised_directory, versions,
@@ -497,12 +501,10 @@ TEST_CASE_METHOD(DirectoryTest, "Serialise and parse", "[Directory][behavioural]
   DirectoriesMatch(directory_, recovered_directory);
 }
 
-TEST_CASE_METHOD(DirectoryTest, "Iterator reset", "[Directory][behavioural]") {
+TEST_CASE_METHOD(DirectoryTest, "List children in order", "[Directory][behavioural]") {
   // Add elements
   REQUIRE(directory_.empty());
   const size_t kTestCount(10);
-  ResetChildrenCounter();
-  CHECK(4U < kTestCount);
   char c('A');
   for (size_t i(0); i != kTestCount; ++i, ++c) {
     FileContext file_context(std::string(1, c), ((i % 2) == 0));
@@ -510,52 +512,333 @@ TEST_CASE_METHOD(DirectoryTest, "Iterator reset", "[Directory][behavioural]") {
   }
   CHECK_FALSE(directory_.empty());
 
-  // Check internal iterator
-  const FileContext* file_context(nullptr);
+  // Check all are listed in name order
+  size_t i(0);
   c = 'A';
-  for (size_t i(0); i != kTestCount; ++i, ++c) {
-    CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-    CHECK(std::string(1, c) == file_context->meta_data.name);
-    CHECK(((i % 2) == 0) == (file_context->meta_data.directory_id != nullptr));
+  directory_.ForEachChildAfter("", [&](const FileContext& child) {
+    CHECK(std::string(1, c) == child.meta_data.name);
+    CHECK(((i % 2) == 0) == (child.meta_data.directory_id != nullptr));
+    ++i;
+    ++c;
+    return true;
+  });
+  CHECK(kTestCount == i);
+
+  // Check listing stops when asked to
+  i = 0;
+  directory_.ForEachChildAfter("", [&](const FileContext&) { return ++i != 2; });
+  CHECK(2U == i);
+}
+
+TEST_CASE_METHOD(DirectoryTest, "List children after name", "[Directory][behavioural]") {
+  const size_t kTestCount(10);
+  char c('A');
+  for (size_t i(0); i != kTestCount; ++i, c += 2) {
+    FileContext file_context(std::string(1, c), ((i % 2) == 0));
+    CHECK_NOTHROW(directory_.AddChild(std::move(file_context)));
+  }
+
+  std::vector<std::string> listed;
+  auto list_batch([&](const fs::path& after, size_t batch_size) {
+    directory_.ForEachChildAfter(after, [&](const FileContext& child) {
+      listed.push_back(child.meta_data.name.string());
+      return --batch_size != 0;
+    });
+  });
+
+  // List the first batch, then add and remove children either side of the resume point
+  list_batch("", 3);
+  REQUIRE(listed.size() == 3U);
+  CHECK(listed.back() == "E");
+  CHECK_NOTHROW(directory_.AddChild(FileContext("B", false)));
+  CHECK_NOTHROW(directory_.AddChild(FileContext("F", false)));
+  CHECK_NOTHROW(FileContext context(directory_.RemoveChild("G")));
+
+  // Resuming shouldn't restart the listing, should include 'F' and shouldn't include 'G'
+  list_batch(listed.back(), kTestCount);
+  REQUIRE(listed.size() == kTestCount);
+  CHECK(std::is_sorted(std::begin(listed), std::end(listed)));
+  CHECK(std::count(std::begin(listed), std::end(listed), "B") == 0);
+  CHECK(std::count(std::begin(listed), std::end(listed), "F") == 1);
+  CHECK(std::count(std::begin(listed), std::end(listed), "G") == 0);
+
+  // Nothing sorts after the last child
+  listed.clear();
+  list_batch(std::string(1, c), kTestCount);
+  CHECK(listed.empty());
+}
+
+TEST_CASE_METHOD(DirectoryTest, "Apply remote version", "[Directory][behavioural]") {
+  for (const auto& name : { "A", "B", "C" }) {
+    FileContext file_context(name, false);
+    file_context.meta_data.data_map->content = "local";
+    CHECK_NOTHROW(directory_.AddChild(std::move(file_context)));
+  }
+  std::vector<StructuredDataVersions::VersionName> local_versions(
+      1, StructuredDataVersions::VersionName(0, ImmutableData::Name(Identity(RandomString(64)))));
+  Directory local(directory_.parent_id(), directory_.Serialise(), local_versions,
+                  asio_service_.service(), put_functor_, put_chunk_functor_,
+                  increment_chunks_functor_, "");
+  FileContext* open_child(local.GetMutableChild("A"));
+  FileContext* closed_child(local.GetMutableChild("B"));
+  *open_child->open_count = 1;
+
+  // Another client modifies 'A' and 'B', removes 'C' and adds 'D'
+  directory_.GetMutableChild("A")->meta_data.data_map->content = "remote";
+  directory_.GetMutableChild("B")->meta_data.data_map->content = "remote";
+  CHECK_NOTHROW(FileContext context(directory_.RemoveChild("C")));
+  CHECK_NOTHROW(directory_.AddChild(FileContext("D", false)));
+  std::vector<StructuredDataVersions::VersionName> remote_versions(
+      1, StructuredDataVersions::VersionName(1, ImmutableData::Name(Identity(RandomString(64)))));
+  Directory remote(directory_.parent_id(), directory_.Serialise(), remote_versions,
+                   asio_service_.service(), put_functor_, put_chunk_functor_,
+                   increment_chunks_functor_, "");
+
+  CHECK(local.HasVersion(local_versions.front()));
+  CHECK_FALSE(local.HasVersion(remote_versions.front()));
+  REQUIRE(local.ApplyRemoteVersion(remote));
+  CHECK(local.HasVersion(remote_versions.front()));
+
+  // Existing children are updated in place, except for open ones which keep their local state
+  CHECK(local.GetChild("A") == open_child);
+  CHECK(open_child->meta_data.data_map->content == "local");
+  CHECK(local.GetChild("B") == closed_child);
+  CHECK(closed_child->meta_data.data_map->content == "remote");
+  CHECK_FALSE(local.HasChild("C"));
+  REQUIRE(local.HasChild("D"));
+  CHECK(local.GetChild("D")->parent == &local);
+  *open_child->open_count = 0;
+
+  // Remote versions aren't applied while local changes are pending
+  local.ScheduleForStoring();
+  CHECK_FALSE(local.ApplyRemoteVersion(remote));
+}
+
+TEST_CASE_METHOD(DirectoryTest, "Sync", "[Directory][behavioural]") {
+  std::atomic<int> store_count(0);
+  std::mutex serialised_mutex;
+  std::string last_serialised;
+  std::function<void(Directory*)> put_functor([&](Directory* directory) {  // NOLINT
+    std::string serialised(directory->Serialise());
+    {
+      std::lock_guard<std::mutex> lock(serialised_mutex);
+      last_serialised = serialised;
+    }
+    directory->AddNewVersion(ImmutableData(NonEmptyString(serialised)).name());
+    ++store_count;
+    directory->StoreSucceeded();
+  });
+  Directory directory(ParentId(unique_id_), parent_id_, asio_service_.service(), put_functor,
+                      put_chunk_functor_, increment_chunks_functor_, "");
+
+  // Sync shouldn't wait for the store delay
+  CHECK_NOTHROW(directory.AddChild(FileContext("A", false)));
+  auto start(std::chrono::steady_clock::now());
+  directory.Sync();
+  CHECK(std::chrono::steady_clock::now() - start < kDirectoryInactivityDelay);
+  CHECK(store_count == 1);
+
+  // Nothing to store
+  directory.Sync();
+  CHECK(store_count == 1);
+
+  // Concurrent syncs each see their own change stored, but share stores where possible
+  const int kThreadCount(10);
+  std::vector<std::thread> threads;
+  for (int i(0); i != kThreadCount; ++i) {
+    threads.emplace_back([&directory, i] {
+      directory.AddChild(FileContext(std::to_string(i), false));
+      directory.Sync();
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  CHECK(store_count <= kThreadCount + 1);
+  Directory stored(directory.parent_id(), last_serialised,
+                   std::vector<StructuredDataVersions::VersionName>(), asio_service_.service(),
+                   put_functor_, put_chunk_functor_, increment_chunks_functor_, "");
+  for (int i(0); i != kThreadCount; ++i)
+    CHECK(stored.HasChild(std::to_string(i)));
+}
+
+TEST_CASE_METHOD(DirectoryTest, "Stores don't overlap", "[Directory][behavioural]") {
+  std::atomic<int> running(0), max_running(0), store_count(0);
+  std::function<void(Directory*)> put_functor([&](Directory* directory) {  // NOLINT
+    std::string serialised(directory->Serialise());
+    int now_running(++running);
+    int previous_max(max_running);
+    while (now_running > previous_max &&
+           !max_running.compare_exchange_weak(previous_max, now_running)) {}
+    // Long enough for further changes to expire the store timer meanwhile
+    std::this_thread::sleep_for(kMinDirectoryInactivityDelay + std::chrono::milliseconds(200));
+    directory->AddNewVersion(ImmutableData(NonEmptyString(serialised)).name());
+    --running;
+    ++store_count;
+    directory->StoreSucceeded();
+  });
+  Directory directory(ParentId(unique_id_), parent_id_, asio_service_.service(), put_functor,
+                      put_chunk_functor_, increment_chunks_functor_, "");
+  directory.Sync();
+
+  std::vector<std::thread> threads;
+  for (int i(0); i != 4; ++i) {
+    threads.emplace_back([&directory, i] {
+      for (int j(0); j != 3; ++j) {
+        directory.AddChild(FileContext(std::to_string(i) + "-" + std::to_string(j), false));
+        std::this_thread::sleep_for(kMinDirectoryInactivityDelay);
+        if (j == 1)
+          directory.Sync();
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  directory.Sync();
+  CHECK(max_running == 1);
+  CHECK(store_count > 1);
+}
+
+// Not run by default; run with the "[benchmark]" tag to see how child operations scale.
+TEST_CASE_METHOD(DirectoryTest, "Child operations scale", "[Directory][benchmark][.]") {
+  for (size_t child_count : {10U, 10000U, 1000000U}) {
+    std::vector<std::string> names;
+    names.reserve(child_count);
+    for (size_t i(0); i != child_count; ++i)
+      names.push_back(RandomAlphaNumericString(20));
+    Directory directory(ParentId(unique_id_), parent_id_, asio_service_.service(), put_functor_,
+                        put_chunk_functor_, increment_chunks_functor_, "");
+
+    auto start(std::chrono::steady_clock::now());
+    for (const auto& name : names)
+      directory.AddChild(FileContext(name, false));
+    auto added(std::chrono::steady_clock::now());
+    for (const auto& name : names)
+      REQUIRE(directory.HasChild(name));
+    auto found(std::chrono::steady_clock::now());
+    size_t listed(0);
+    directory.ForEachChildAfter("", [&listed](const FileContext&) {
+      ++listed;
+      return true;
+    });
+    auto finished(std::chrono::steady_clock::now());
+    CHECK(listed == child_count);
+
+    auto per_child([child_count](std::chrono::steady_clock::duration duration) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() /
+             static_cast<int64_t>(child_count);
+    });
+    LOG(kInfo) << child_count << " children - add: " << per_child(added - start)
+               << " ns/child, find: " << per_child(found - added) << " ns/child, list: "
+               << per_child(finished - found) << " ns/child";
   }
+}
+
+TEST_CASE_METHOD(DirectoryTest, "Store delay adapts to changes", "[Directory][behavioural]") {
+  std::atomic<int> store_count(0);
+  std::function<void(Directory*)> put_functor([&](Directory* directory) {  // NOLINT
+    ImmutableData contents(NonEmptyString(directory->Serialise()));
+    directory->AddNewVersion(contents.name());
+    ++store_count;
+    directory->StoreSucceeded();
+  });
+  Directory directory(ParentId(unique_id_), parent_id_, asio_service_.service(), put_functor,
+                      put_chunk_functor_, increment_chunks_functor_, "");
+
+  // After a burst of frequent changes, the store shouldn't wait for the full inactivity delay
+  for (int i(0); i != 20; ++i) {
+    CHECK_NOTHROW(directory.AddChild(FileContext(std::to_string(i), false)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  CHECK(store_count == 0);
+  auto start(std::chrono::steady_clock::now());
+  while (store_count == 0 &&
+         std::chrono::steady_clock::now() - start < 2 * kDirectoryInactivityDelay) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  CHECK(store_count == 1);
+  CHECK(std::chrono::steady_clock::now() - start < kDirectoryInactivityDelay);
+}
+
+TEST_CASE_METHOD(DirectoryTest, "Dirty tracking", "[Directory][behavioural]") {
+  std::atomic<int> store_count(0);
+  std::function<void(Directory*)> put_functor([&](Directory* directory) {  // NOLINT
+    ImmutableData contents(NonEmptyString(directory->Serialise()));
+    directory->AddNewVersion(contents.name());
+    ++store_count;
+    directory->StoreSucceeded();
+  });
+  Directory directory(ParentId(unique_id_), parent_id_, asio_service_.service(), put_functor,
+                      put_chunk_functor_, increment_chunks_functor_, "");
+  directory.Sync();
+  REQUIRE(store_count == 1);
+
+  // Marking dirty doesn't schedule a store by itself, but is picked up by 'Sync'
+  CHECK(directory.MarkDirty());
+  CHECK_FALSE(directory.MarkDirty());
+  std::this_thread::sleep_for(kDirectoryInactivityDelay + std::chrono::milliseconds(500));
+  CHECK(store_count == 1);
+  directory.Sync();
+  CHECK(store_count == 2);
+
+  // ... and by 'ScheduleIfDirty'
+  directory.ScheduleIfDirty();
+  directory.Sync();
+  CHECK(store_count == 2);
+  CHECK(directory.MarkDirty());
+  directory.ScheduleIfDirty();
+  directory.Sync();
+  CHECK(store_count == 3);
+}
+
+TEST_CASE_METHOD(DirectoryTest, "Flush child and apply", "[Directory][behavioural]") {
+  FileContext* child(directory_.AddChild(FileContext("A", false)));
+  std::mutex other_mutex;
+  bool applied(false);
+  directory_.FlushChildAndApply(child, other_mutex, [&] {
+    // Both the child's and the other mutex are held while the functor runs
+    CHECK_FALSE(child->mutex->try_lock());
+    CHECK_FALSE(other_mutex.try_lock());
+    applied = true;
+  });
+  CHECK(applied);
+  CHECK(other_mutex.try_lock());
+  other_mutex.unlock();
+
+  // An exception thrown by the functor is passed on once the locks have been released
+  CHECK_THROWS_AS(directory_.FlushChildAndApply(child, other_mutex, [] {
+                    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+                  }), std::exception);
+  CHECK(child->mutex->try_lock());
+  child->mutex->unlock();
+}
 
-  SortAndResetChildrenCounter();
-
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("A" == file_context->meta_data.name);
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("B" == file_context->meta_data.name);
-
-  // Add another element and check iterator is reset
-  ++c;
-  FileContext new_file_context(std::string(1, c), false);
-  CHECK_NOTHROW(directory_.AddChild(std::move(new_file_context)));
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("A" == file_context->meta_data.name);
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("B" == file_context->meta_data.name);
-
-  // Remove an element and check iterator is reset
-  REQUIRE(directory_.HasChild(new_file_context.meta_data.name));
-  CHECK_NOTHROW(FileContext context(directory_.RemoveChild(new_file_context.meta_data.name)));
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("A" == file_context->meta_data.name);
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("B" == file_context->meta_data.name);
-
-  // Try to remove a non-existent element and check iterator is not reset
-  REQUIRE_FALSE(directory_.HasChild(new_file_context.meta_data.name));
-  CHECK_THROWS_AS(FileContext context(directory_.RemoveChild(new_file_context.meta_data.name)),
-                  std::exception);
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("C" == file_context->meta_data.name);
-  CHECK_NOTHROW(file_context = directory_.GetChildAndIncrementCounter());
-  CHECK("D" == file_context->meta_data.name);
-
-  // Check operator<
-  // DirectoryListing directory_listing1(Identity(crypto::Hash<crypto::SHA512>(std::string("A")))),
-  //     directory_listing2(Identity(crypto::Hash<crypto::SHA512>(std::string("B"))));
-  // CHECK(directory_listing1 < directory_listing2);
+TEST_CASE("Popped chunks", "[Directory][behavioural]") {
+  std::vector<std::string> deleted;
+  PoppedChunks popped_chunks([&](const ImmutableData::Name& name) {
+    deleted.push_back(name->string());
+  });
+  const std::string kReferenced(RandomString(64)), kUnreferenced(RandomString(64)),
+      kInFlight(RandomString(64));
+
+  // Two copies of one chunk were popped, but only one is still referenced at flush time
+  popped_chunks.Add(kReferenced);
+  popped_chunks.Add(kReferenced);
+  popped_chunks.Add(kUnreferenced);
+  CHECK(popped_chunks.Take(kReferenced));
+  CHECK_FALSE(popped_chunks.Take(kInFlight));
+  // This one is popped during the flush, after it has been found missing from the buffer
+  popped_chunks.Expect(kInFlight);
+  popped_chunks.DeleteUntaken();
+  REQUIRE(deleted.size() == 2);
+  CHECK(std::count(std::begin(deleted), std::end(deleted), kReferenced) == 1);
+  CHECK(std::count(std::begin(deleted), std::end(deleted), kUnreferenced) == 1);
+
+  // The expected chunk has been accounted for, so isn't available to (or deleted by) the next flush
+  popped_chunks.Add(kInFlight);
+  CHECK_FALSE(popped_chunks.Take(kInFlight));
+  deleted.clear();
+  popped_chunks.DeleteUntaken();
+  CHECK(deleted.empty());
 }
 
 }  // namespace test
@@ -0,0 +1,179 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/operations.hpp"
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+#include "maidsafe/common/data_types/immutable_data.h"
+
+#include "maidsafe/drive/metadata_snapshot.h"
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+namespace {
+
+typedef std::vector<StructuredDataVersions::VersionName> Versions;
+
+StructuredDataVersions::VersionName RandomVersion(uint64_t index) {
+  return StructuredDataVersions::VersionName(index,
+                                             ImmutableData::Name(Identity(RandomString(64))));
+}
+
+size_t FileCount(const fs::path& dir) {
+  size_t count(0);
+  for (fs::recursive_directory_iterator itr(dir), end; itr != end; ++itr) {
+    if (fs::is_regular_file(itr->status()))
+      ++count;
+  }
+  return count;
+}
+
+}  // unnamed namespace
+
+TEST_CASE("Metadata snapshot persists", "[MetadataSnapshot][behavioural]") {
+  maidsafe::test::TestPath test_dir(maidsafe::test::CreateTestPath("MaidSafe_Test_Drive"));
+  const Identity kUniqueUserId(RandomString(64)), kRootParentId(RandomString(64));
+  const NonEmptyString kSecret(RandomString(64));
+  const DirectoryId kDirectoryId(RandomString(64));
+  const Versions kVersions{ RandomVersion(1), RandomVersion(0) };
+  const std::string kListing(RandomString(1000));
+  std::string listing;
+  Versions versions;
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId, kSecret);
+    CHECK_FALSE(snapshot.Get(kDirectoryId, kVersions.front(), listing, versions));
+    snapshot.Put(kDirectoryId, kVersions, kListing);
+    REQUIRE(snapshot.Get(kDirectoryId, kVersions.front(), listing, versions));
+    CHECK(listing == kListing);
+    CHECK(versions == kVersions);
+    // Listings are only served for the version at the tip
+    CHECK_FALSE(snapshot.Get(kDirectoryId, RandomVersion(2), listing, versions));
+    CHECK(snapshot.hit_count() == 1);
+    CHECK(snapshot.miss_count() == 2);
+  }
+
+  // The listing was written when put and is reloaded by the same drive
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId, kSecret);
+    CHECK(snapshot.size() == 1);
+    listing.clear();
+    versions.clear();
+    REQUIRE(snapshot.Get(kDirectoryId, kVersions.front(), listing, versions));
+    CHECK(listing == kListing);
+    CHECK(versions == kVersions);
+  }
+
+  // Neither another drive nor the same drive with another secret sees it
+  {
+    MetadataSnapshot snapshot(*test_dir, Identity(RandomString(64)), kRootParentId, kSecret);
+    CHECK(snapshot.size() == 0);
+  }
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId,
+                              NonEmptyString(RandomString(64)));
+    CHECK(snapshot.size() == 0);
+    CHECK_FALSE(snapshot.Get(kDirectoryId, kVersions.front(), listing, versions));
+  }
+  REQUIRE(FileCount(*test_dir) == 1);
+
+  // A modified file is discarded
+  for (fs::recursive_directory_iterator itr(*test_dir), end; itr != end; ++itr) {
+    if (!fs::is_regular_file(itr->status()))
+      continue;
+    std::string content;
+    REQUIRE(ReadFile(itr->path(), &content));
+    content[content.size() / 2] ^= 1;
+    REQUIRE(WriteFile(itr->path(), content));
+  }
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId, kSecret);
+    CHECK(snapshot.size() == 0);
+    CHECK_FALSE(snapshot.Get(kDirectoryId, kVersions.front(), listing, versions));
+  }
+  CHECK(FileCount(*test_dir) == 0);
+}
+
+TEST_CASE("Metadata snapshot is bounded", "[MetadataSnapshot][behavioural]") {
+  maidsafe::test::TestPath test_dir(maidsafe::test::CreateTestPath("MaidSafe_Test_Drive"));
+  const Identity kUniqueUserId(RandomString(64)), kRootParentId(RandomString(64));
+  const NonEmptyString kSecret(RandomString(64));
+  const size_t kMaxEntries(3);
+  std::vector<std::pair<DirectoryId, Versions>> directories;
+  for (size_t i(0); i != kMaxEntries + 1; ++i)
+    directories.emplace_back(DirectoryId(RandomString(64)), Versions(1, RandomVersion(0)));
+  std::string listing;
+  Versions versions;
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId, kSecret, kMaxEntries);
+    for (size_t i(0); i != kMaxEntries; ++i)
+      snapshot.Put(directories[i].first, directories[i].second, RandomString(100));
+    // Using the first makes the second the least recently used
+    REQUIRE(snapshot.Get(directories[0].first, directories[0].second.front(), listing, versions));
+    snapshot.Put(directories[kMaxEntries].first, directories[kMaxEntries].second,
+                 RandomString(100));
+    CHECK(snapshot.size() == kMaxEntries);
+    CHECK(FileCount(*test_dir) == kMaxEntries);
+    CHECK_FALSE(
+        snapshot.Get(directories[1].first, directories[1].second.front(), listing, versions));
+    CHECK(snapshot.Get(directories[0].first, directories[0].second.front(), listing, versions));
+  }
+
+  // A smaller bound on reloading drops the excess
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId, kSecret, 1);
+    CHECK(snapshot.size() == 1);
+  }
+  CHECK(FileCount(*test_dir) == 1);
+}
+
+TEST_CASE("Metadata snapshot removal", "[MetadataSnapshot][behavioural]") {
+  maidsafe::test::TestPath test_dir(maidsafe::test::CreateTestPath("MaidSafe_Test_Drive"));
+  const Identity kUniqueUserId(RandomString(64)), kRootParentId(RandomString(64));
+  const NonEmptyString kSecret(RandomString(64));
+  const DirectoryId kDirectoryId(RandomString(64));
+  {
+    MetadataSnapshot snapshot(*test_dir, kUniqueUserId, kRootParentId, kSecret);
+    snapshot.Put(kDirectoryId, Versions(1, RandomVersion(0)), RandomString(100));
+    CHECK(FileCount(*test_dir) == 1);
+    snapshot.Remove(kDirectoryId);
+    CHECK(snapshot.size() == 0);
+  }
+  CHECK(FileCount(*test_dir) == 0);
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
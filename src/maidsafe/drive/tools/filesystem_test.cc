@@ -17,18 +17,24 @@
     use of the MaidSafe Software.                                                                 */
 
 #ifndef MAIDSAFE_WIN32
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifdef MAIDSAFE_BSD
@@ -59,6 +65,7 @@ extern "C" char **environ;
 #else
 #include "maidsafe/drive/tools/commands/unix_file_commands.h"
 #endif
+#include "maidsafe/drive/copy_range.h"
 #include "maidsafe/drive/drive.h"
 #include "maidsafe/drive/tools/launcher.h"
 
@@ -950,6 +957,132 @@ TEST_CASE("Rename directory hierarchy to different parent", "[Filesystem]") {
   RequireDirectoriesEqual(directory, renamed_directory, true);
 }
 
+TEST_CASE("Concurrent operations on different files", "[Filesystem][behavioural]") {
+  on_scope_exit cleanup(clean_root);
+  const int kThreadCount(8), kIterations(10);
+  auto directory(CreateDirectory(g_root));
+
+  // Each thread repeatedly rewrites, reads back and renames its own file, and creates and deletes
+  // siblings in the shared parent directory.  Catch assertions aren't thread-safe, so failures are
+  // collected and checked after all threads have joined.
+  std::vector<std::string> contents;
+  for (int i(0); i != kThreadCount * kIterations; ++i)
+    contents.push_back(RandomString((RandomUint32() % (1024 * 1024)) + 1));
+  std::vector<int> failures(kThreadCount, 0);
+  std::vector<std::thread> threads;
+  for (int i(0); i != kThreadCount; ++i) {
+    threads.emplace_back([&, i] {
+      auto file(directory / ("file_" + std::to_string(i)));
+      auto sibling(directory / ("sibling_" + std::to_string(i)));
+      for (int j(0); j != kIterations; ++j) {
+        try {
+          const std::string& content(contents[i * kIterations + j]);
+          if (!WriteFile(file, content) || ReadFile(file).string() != content)
+            ++failures[i];
+          auto renamed(directory / ("renamed_" + std::to_string(i)));
+          fs::rename(file, renamed);
+          fs::rename(renamed, file);
+          if (!WriteFile(sibling, content.substr(0, 1)) || !fs::remove(sibling))
+            ++failures[i];
+        }
+        catch (const std::exception& e) {
+          LOG(kError) << "Thread " << i << " failed: " << e.what();
+          ++failures[i];
+        }
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  for (int i(0); i != kThreadCount; ++i) {
+    CAPTURE(i);
+    CHECK(failures[i] == 0);
+    auto file(directory / ("file_" + std::to_string(i)));
+    RequireExists(file);
+    REQUIRE(ReadFile(file).string() == contents[i * kIterations + kIterations - 1]);
+  }
+  fs::directory_iterator end;
+  REQUIRE(std::distance(fs::directory_iterator(directory), end) == kThreadCount);
+}
+
+#ifndef MAIDSAFE_WIN32
+TEST_CASE("Copy range within drive", "[Filesystem][behavioural]") {
+  // The copy range request is only understood by the drive, so don't attempt it on a disk test
+  if (g_test_type != drive::DriveType::kLocal && g_test_type != drive::DriveType::kLocalConsole &&
+      g_test_type != drive::DriveType::kNetwork &&
+      g_test_type != drive::DriveType::kNetworkConsole) {
+    return;
+  }
+  on_scope_exit cleanup(clean_root);
+  auto source(CreateFile(g_root, (RandomUint32() % 1048577) + 1024));
+  auto destination(g_root / (RandomAlphaNumericString(5) + ".txt"));
+  auto copy_range([&](uint64_t source_offset, uint64_t destination_offset,
+                      uint64_t size) -> uint64_t {
+    int destination_fd(open(destination.c_str(), O_CREAT | O_WRONLY, 0644));
+    REQUIRE(destination_fd != -1);
+    drive::CopyRangeRequest request;
+    std::memset(&request, 0, sizeof(request));
+    request.source_offset = source_offset;
+    request.destination_offset = destination_offset;
+    request.size = size;
+    std::strncpy(request.source_path, source.first.filename().c_str(),
+                 sizeof(request.source_path) - 1);
+    int result(ioctl(destination_fd, drive::kCopyRangeIoctl, &request));
+    REQUIRE(close(destination_fd) == 0);
+    REQUIRE(result == 0);
+    return request.size;
+  });
+
+  // Copying the whole file shares the source's chunks
+  REQUIRE(copy_range(0, 0, std::numeric_limits<uint64_t>::max()) == source.second.size());
+  REQUIRE(ReadFile(destination).string() == source.second);
+
+  // A partial range is copied via read and write
+  const uint64_t kOffset(10), kSize(100);
+  REQUIRE(copy_range(kOffset, kOffset / 2, kSize) == kSize);
+  std::string expected(source.second);
+  expected.replace(kOffset / 2, kSize, source.second.substr(kOffset, kSize));
+  REQUIRE(ReadFile(destination).string() == expected);
+  // The source is unchanged
+  REQUIRE(ReadFile(source.first).string() == source.second);
+}
+#endif
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+TEST_CASE("Fallocate", "[Filesystem][behavioural]") {
+  on_scope_exit cleanup(clean_root);
+  auto file(CreateFile(g_root, (RandomUint32() % 1048577) + 4096));
+  std::string expected(file.second);
+  int fd(open(file.first.c_str(), O_RDWR));
+  REQUIRE(fd != -1);
+  on_scope_exit close_file([fd] { close(fd); });
+
+  // Extending the file fills it with zeros
+  const off_t kExtension(100000);
+  REQUIRE(fallocate(fd, 0, expected.size(), kExtension) == 0);
+  expected.append(kExtension, '\0');
+  REQUIRE(fs::file_size(file.first) == expected.size());
+
+  // With KEEP_SIZE, the size is unchanged
+  REQUIRE(fallocate(fd, FALLOC_FL_KEEP_SIZE, expected.size(), kExtension) == 0);
+  REQUIRE(fs::file_size(file.first) == expected.size());
+
+  // Punching a hole zeroes the range, whether inside the file or running to its end
+  REQUIRE(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100, 2000) == 0);
+  expected.replace(100, 2000, 2000, '\0');
+  const off_t kTail(expected.size() - 5000);
+  REQUIRE(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, kTail, 10000) == 0);
+  expected.replace(kTail, 5000, 5000, '\0');
+  REQUIRE(fs::file_size(file.first) == expected.size());
+  REQUIRE(ReadFile(file.first).string() == expected);
+
+  // Punching a hole requires KEEP_SIZE
+  REQUIRE(fallocate(fd, FALLOC_FL_PUNCH_HOLE, 0, 100) == -1);
+  REQUIRE(errno == EOPNOTSUPP);
+}
+#endif
+
 TEST_CASE("Check failures", "[Filesystem]") {
   // Create a file in 'g_temp'
   on_scope_exit cleanup(clean_root);
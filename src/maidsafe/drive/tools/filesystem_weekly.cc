@@ -21,6 +21,7 @@
 #include <cstdio>
 #include <functional>
 #include <string>
+#include <vector>
 
 #ifdef MAIDSAFE_BSD
 extern "C" char **environ;
@@ -179,6 +180,28 @@ void PrintResult(const std::chrono::high_resolution_clock::time_point& start,
          BytesToBinarySiUnits(rate).c_str());
 }
 
+// Copies 'src' to 'dest' issuing unbuffered writes of exactly 'block_size' bytes, so that each
+// write reaches the drive as a separate request (or as several, if larger than max_write).
+void CopyFileInBlocks(const fs::path& src, const fs::path& dest, size_t block_size) {
+  std::FILE* input(std::fopen(src.string().c_str(), "rb"));
+  std::FILE* output(std::fopen(dest.string().c_str(), "wb"));
+  on_scope_exit close_files([&] {
+    if (input)
+      std::fclose(input);
+    if (output)
+      std::fclose(output);
+  });
+  if (!input || !output || std::setvbuf(output, nullptr, _IONBF, 0) != 0)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+
+  std::vector<char> buffer(block_size);
+  size_t read_count(0);
+  while ((read_count = std::fread(buffer.data(), 1, block_size, input)) != 0) {
+    if (std::fwrite(buffer.data(), 1, read_count, output) != read_count)
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+  }
+}
+
 }  // namespace
 
 void CopyThenReadLargeFile() {
@@ -216,6 +239,59 @@ void CopyThenReadLargeFile() {
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
   auto compare_stop_time(std::chrono::high_resolution_clock::now());
   PrintResult(compare_start_time, compare_stop_time, size, "Compared");
+
+  // Copy again using page-sized and large writes.  Page-sized writes show the cost per FUSE write
+  // request as if big_writes were not negotiated; large writes are split by the kernel at the
+  // negotiated max_write.
+  const std::vector<size_t> block_sizes{ 4 * 1024, 1024 * 1024 };
+  for (auto block_size : block_sizes) {
+    fs::path block_copy(g_root / (RandomAlphaNumericString(5) + ".txt"));
+    auto block_copy_start_time(std::chrono::high_resolution_clock::now());
+    CopyFileInBlocks(file, block_copy, block_size);
+    auto block_copy_stop_time(std::chrono::high_resolution_clock::now());
+    PrintResult(block_copy_start_time, block_copy_stop_time, size,
+                "Copied (" + BytesToBinarySiUnits(block_size) + " writes)");
+    if (fs::file_size(block_copy) != size)
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+    fs::remove(block_copy);
+  }
+}
+
+// Similar to mdtest's stat phase: creates a tree of empty files, then repeatedly stats all of them.
+// The first pass populates the kernel's caches; later passes show the rate the attribute and entry
+// timeouts allow.
+void StatManyFiles() {
+  on_scope_exit cleanup(clean_root);
+
+  const size_t kDirectoryCount(10), kFilesPerDirectory(1000), kPassCount(5);
+  std::vector<fs::path> files;
+  files.reserve(kDirectoryCount * kFilesPerDirectory);
+  for (size_t i(0); i != kDirectoryCount; ++i) {
+    auto directory(g_root / ("stat_dir_" + std::to_string(i)));
+    fs::create_directory(directory);
+    for (size_t j(0); j != kFilesPerDirectory; ++j) {
+      files.emplace_back(directory / ("file_" + std::to_string(j)));
+      std::ofstream output_stream(files.back().c_str(), std::ios::binary);
+      if (!output_stream.is_open())
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+    }
+  }
+
+  for (size_t pass(0); pass != kPassCount; ++pass) {
+    auto start_time(std::chrono::high_resolution_clock::now());
+    for (const auto& file : files) {
+      if (!fs::is_regular_file(file))
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::filesystem_io_error));
+    }
+    auto stop_time(std::chrono::high_resolution_clock::now());
+    auto duration(std::chrono::duration_cast<std::chrono::microseconds>(stop_time -
+                                                                        start_time).count());
+    if (duration == 0)
+      duration = 1;
+    printf("Stat pass %u: %u files in %f seconds at a rate of %u stats/s\n",
+           static_cast<unsigned>(pass + 1), static_cast<unsigned>(files.size()),
+           (duration / 1000000.0), static_cast<unsigned>((files.size() * 1000000) / duration));
+  }
 }
 
 void CopyThenReadManySmallFiles() {
@@ -519,6 +595,8 @@ int RunTool(int argc, char** argv, const fs::path& root, const fs::path& temp,
                                    [](const std::string& arg) { return arg == "--no_big_test"; }));
   bool no_small_test(std::any_of(std::begin(arguments), std::end(arguments),
                                  [](const std::string& arg) { return arg == "--no_small_test"; }));
+  bool no_stat_test(std::any_of(std::begin(arguments), std::end(arguments),
+                                [](const std::string& arg) { return arg == "--no_stat_test"; }));
   bool no_clone_and_build_maidsafe_test(std::any_of(std::begin(arguments), std::end(arguments),
               [](const std::string& arg) { return arg == "--no_clone_and_build_maidsafe_test"; }));
   bool no_download_and_build_poco_test(std::any_of(std::begin(arguments), std::end(arguments),
@@ -539,6 +617,9 @@ int RunTool(int argc, char** argv, const fs::path& root, const fs::path& temp,
   if (!no_small_test)
     CopyThenReadManySmallFiles();
 
+  if (!no_stat_test)
+    StatManyFiles();
+
   if (!no_clone_and_build_maidsafe_test)
     CloneMaidSafeAndBuildDefaults(g_root);
 
@@ -113,6 +113,12 @@ enum SharedMemoryArgIndex {
   kSymmKeyArg,
   kSymmIvArg,
   kParentProcessHandle,
+  kMaxWriteArg,
+  kMaxReadaheadArg,
+  kMaxBackgroundArg,
+  kAttributeTimeoutArg,
+  kEntryTimeoutArg,
+  kNegativeTimeoutArg,
   kMaxArgIndex
 };
 
@@ -160,6 +166,13 @@ void ReadAndRemoveInitialSharedMemory(const std::string& initial_shared_memory_n
       GetMountStatusSharedMemoryName(initial_shared_memory_name);
   options.parent_handle =
       reinterpret_cast<void*>(std::stoull(shared_memory_args[kParentProcessHandle]));
+  options.max_write = static_cast<uint32_t>(std::stoul(shared_memory_args[kMaxWriteArg]));
+  options.max_readahead = static_cast<uint32_t>(std::stoul(shared_memory_args[kMaxReadaheadArg]));
+  options.max_background =
+      static_cast<uint32_t>(std::stoul(shared_memory_args[kMaxBackgroundArg]));
+  options.attribute_timeout = std::stod(shared_memory_args[kAttributeTimeoutArg]);
+  options.entry_timeout = std::stod(shared_memory_args[kEntryTimeoutArg]);
+  options.negative_timeout = std::stod(shared_memory_args[kNegativeTimeoutArg]);
   ipc::RemoveSharedMemory(initial_shared_memory_name);
 }
 
@@ -306,6 +319,12 @@ void Launcher::CreateInitialSharedMemory(const Options& options) {
   shared_memory_args[kSymmIvArg] = options.symm_iv;
   shared_memory_args[kParentProcessHandle] =
       std::to_string(reinterpret_cast<uintptr_t>(this_process_handle_));
+  shared_memory_args[kMaxWriteArg] = std::to_string(options.max_write);
+  shared_memory_args[kMaxReadaheadArg] = std::to_string(options.max_readahead);
+  shared_memory_args[kMaxBackgroundArg] = std::to_string(options.max_background);
+  shared_memory_args[kAttributeTimeoutArg] = std::to_string(options.attribute_timeout);
+  shared_memory_args[kEntryTimeoutArg] = std::to_string(options.entry_timeout);
+  shared_memory_args[kNegativeTimeoutArg] = std::to_string(options.negative_timeout);
   ipc::CreateSharedMemory(initial_shared_memory_name_, shared_memory_args);
 }
 